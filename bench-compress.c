@@ -0,0 +1,180 @@
+/* Benchmark for stream compression.
+
+For every compression backend that is compiled in and for levels 1, 6
+and 9, writes synthetic page content, font and image streams, one class
+at a time, with texpdf_set_compression_class(). Prints the throughput
+(uncompressed megabytes per second) against the compressed size for
+each class, so that per-class levels can be chosen.
+
+./bench-compress [megabytes per class]
+
+*/
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "libtexpdf.h"
+
+#define CHUNK_SIZE (256 * 1024)
+
+static const char *class_names[STREAM_CLASS_MAX] = { NULL, "content", "font", "image" };
+static const char *backend_names[] = { "zlib", "libdeflate" };
+static const int   levels[] = { 1, 6, 9 };
+
+static unsigned long rnd_state = 1;
+
+static unsigned
+rnd (void)
+{
+  rnd_state = rnd_state * 1103515245 + 12345;
+  return (unsigned) (rnd_state >> 16) & 0x7fff;
+}
+
+static double
+now (void)
+{
+  struct timespec t;
+
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+/* Text showing operators, as texpdf_dev_set_string() writes them */
+static void
+make_content (unsigned char *data, long size)
+{
+  long n = 0;
+
+  while (n < size - 64) {
+    int i, words = 1 + rnd() % 4;
+
+    n += sprintf((char *) data + n, "1 0 0 1 %d.%02d %d Tm[", 72 + rnd() % 40, rnd() % 100, rnd() % 800);
+    for (i = 0; i < words && n < size - 64; i++) {
+      int j, len = 2 + rnd() % 6;
+
+      data[n++] = '<';
+      for (j = 0; j < len; j++)
+        n += sprintf((char *) data + n, "%04x", 20 + rnd() % 60);
+      n += sprintf((char *) data + n, ">%d", (int) (rnd() % 7) - 3);
+    }
+    n += sprintf((char *) data + n, "]TJ\n");
+  }
+  memset(data + n, '\n', size - n);
+}
+
+/* TrueType-like glyph data: small headers, flags and coordinate deltas */
+static void
+make_font (unsigned char *data, long size)
+{
+  long n = 0;
+
+  while (n < size) {
+    int i, points = 8 + rnd() % 40;
+
+    for (i = 0; i < 10 && n < size; i++)
+      data[n++] = i < 2 ? 0 : rnd() & 0x03;
+    for (i = 0; i < points && n < size; i++)
+      data[n++] = (rnd() & 1) ? 0x01 : 0x33;
+    for (i = 0; i < 2 * points && n < size; i++)
+      data[n++] = (unsigned char) (rnd() % 64 - 32);
+  }
+}
+
+/* RGB samples of a smooth gradient with some noise */
+static void
+make_image (unsigned char *data, long size)
+{
+  long n;
+
+  for (n = 0; n < size; n++) {
+    long pixel = n / 3, x = pixel % 1024, y = pixel / 1024;
+
+    data[n] = (unsigned char) ((n % 3 == 0 ? x / 4 : n % 3 == 1 ? y / 4 : (x + y) / 8) + rnd() % 6);
+  }
+}
+
+static long
+write_streams (const char *filename, int stream_class, int level,
+               const unsigned char *data, long size, int num_chunks)
+{
+  pdf_rect mediabox = { 0.0, 0.0, 595.0, 842.0 };
+  pdf_doc *p;
+  FILE    *fp;
+  long     file_size = 0;
+  int      i;
+
+  texpdf_set_version(5);
+  texpdf_set_compression(0);
+  texpdf_set_compression_class(stream_class, level);
+  p = texpdf_open_document(filename, 0, 595.0, 842.0, 0, 0, 0);
+  texpdf_init_device(p, 1.0, 2, 0);
+  texpdf_doc_set_mediabox(p, 0, &mediabox);
+  texpdf_doc_begin_page(p, 1.0, 0.0, 0.0);
+
+  for (i = 0; i < num_chunks; i++) {
+    pdf_obj *stream = texpdf_new_stream(STREAM_COMPRESS);
+
+    texpdf_stream_set_class(stream, stream_class);
+    texpdf_add_stream(stream, data + (long) (i % 4) * CHUNK_SIZE / 4, size);
+    texpdf_release_obj(texpdf_ref_obj(stream));
+    texpdf_release_obj(stream);
+  }
+
+  texpdf_doc_end_page(p);
+  texpdf_close_document(p);
+  texpdf_close_device();
+  texpdf_set_compression_class(stream_class, -1);
+
+  if ((fp = fopen(filename, "rb"))) {
+    fseek(fp, 0, SEEK_END);
+    file_size = ftell(fp);
+    fclose(fp);
+  }
+  remove(filename);
+
+  return file_size;
+}
+
+int
+main (int argc, char **argv)
+{
+  long           megabytes  = argc > 1 ? atol(argv[1]) : 16;
+  int            num_chunks = (int) (megabytes * 1024 * 1024 / CHUNK_SIZE);
+  unsigned char *data;
+  int            b, c, l;
+
+  /* Chunks start at different offsets into a buffer of a little more */
+  data = malloc(CHUNK_SIZE + CHUNK_SIZE);
+  if (!data)
+    return 1;
+
+  for (b = 0; b < (int) (sizeof(backend_names) / sizeof(backend_names[0])); b++) {
+    if (texpdf_set_compression_backend(backend_names[b]) < 0)
+      continue;
+    for (c = STREAM_CLASS_CONTENT; c < STREAM_CLASS_MAX; c++) {
+      if (c == STREAM_CLASS_CONTENT)
+        make_content(data, CHUNK_SIZE + CHUNK_SIZE);
+      else if (c == STREAM_CLASS_FONT)
+        make_font(data, CHUNK_SIZE + CHUNK_SIZE);
+      else
+        make_image(data, CHUNK_SIZE + CHUNK_SIZE);
+      for (l = 0; l < (int) (sizeof(levels) / sizeof(levels[0])); l++) {
+        double t;
+        long   size;
+
+        t    = now();
+        size = write_streams("bench-compress.pdf", c, levels[l], data, CHUNK_SIZE, num_chunks);
+        t    = now() - t;
+        printf("%-10s %-7s level %d: %6.1f MB/s, %ld MB -> %ld bytes (%.1f%%)\n",
+               backend_names[b], class_names[c], levels[l],
+               (double) num_chunks * CHUNK_SIZE / t / 1e6, megabytes, size,
+               100.0 * size / ((double) num_chunks * CHUNK_SIZE));
+      }
+    }
+  }
+  free(data);
+
+  return 0;
+}
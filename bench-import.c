@@ -0,0 +1,119 @@
+/* Benchmark for importing pages of PDF files.
+
+Writes a synthetic PDF 1.4 file with many pages, each with its own
+content stream and graphics state dictionaries, so that the file has
+about five objects per page. Then imports every page of it as a form
+XObject, which goes through pdf_include_page(), and prints the time
+taken per page. The time per page should not grow with the file size.
+
+./bench-import [pages]
+
+*/
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "libtexpdf.h"
+
+#define GSTATES_PER_PAGE 3
+
+static double
+now (void)
+{
+  struct timespec t;
+
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+static void
+write_input (const char *filename, long num_pages)
+{
+  pdf_rect mediabox = { 0.0, 0.0, 595.0, 842.0 };
+  pdf_doc *p;
+  char     buf[128];
+  long     page;
+  int      i, len;
+
+  texpdf_set_version(4);
+  texpdf_set_compression(0);
+  p = texpdf_open_document(filename, 0, 595.0, 842.0, 0, 0, 0);
+  texpdf_init_device(p, 1.0, 2, 0);
+  texpdf_doc_set_mediabox(p, 0, &mediabox);
+
+  for (page = 0; page < num_pages; page++) {
+    texpdf_doc_begin_page(p, 1.0, 0.0, 0.0);
+    for (i = 0; i < GSTATES_PER_PAGE; i++) {
+      pdf_obj *gstate = texpdf_new_dict();
+
+      texpdf_add_dict(gstate, texpdf_new_name("Type"), texpdf_new_name("ExtGState"));
+      texpdf_add_dict(gstate, texpdf_new_name("CA"), texpdf_new_number((page % 100) / 100.0));
+      texpdf_add_dict(gstate, texpdf_new_name("LW"), texpdf_new_number(i + 1));
+      sprintf(buf, "GS%d", i);
+      texpdf_doc_add_page_resource(p, "ExtGState", buf, texpdf_ref_obj(gstate));
+      texpdf_release_obj(gstate);
+
+      len = sprintf(buf, " q /GS%d gs %d %ld m %d %ld l S Q", i, 10 * i, page % 800, 500 - i, page % 800);
+      texpdf_doc_add_page_content(p, buf, len);
+    }
+    texpdf_doc_end_page(p);
+  }
+
+  texpdf_close_document(p);
+  texpdf_close_device();
+}
+
+static void
+import_pages (const char *input, const char *filename, long num_pages)
+{
+  pdf_doc *p;
+  long     page;
+
+  texpdf_set_version(4);
+  texpdf_set_compression(0);
+  p = texpdf_open_document(filename, 0, 595.0, 842.0, 0, 0, 0);
+  texpdf_init_device(p, 1.0, 2, 0);
+  texpdf_files_init();
+
+  for (page = 1; page <= num_pages; page++) {
+    transform_info ti;
+    int            id;
+
+    texpdf_doc_begin_page(p, 1.0, 0.0, 0.0);
+    id = texpdf_ximage_findresource(p, input, page, NULL);
+    if (id < 0) {
+      fprintf(stderr, "cannot import page %ld of %s\n", page, input);
+      exit(1);
+    }
+    texpdf_transform_info_clear(&ti);
+    texpdf_dev_put_image(p, id, &ti, 0, 0, 0);
+    texpdf_doc_end_page(p);
+  }
+
+  texpdf_close_document(p);
+  texpdf_close_device();
+  texpdf_files_close();
+}
+
+int
+main (int argc, char **argv)
+{
+  long   num_pages = argc > 1 ? atol(argv[1]) : 10000;
+  double t;
+
+  t = now();
+  write_input("bench-import-in.pdf", num_pages);
+  printf("wrote %ld pages (%ld objects): %.3f s\n",
+         num_pages, num_pages * (2 + GSTATES_PER_PAGE), now() - t);
+
+  t = now();
+  import_pages("bench-import-in.pdf", "bench-import.pdf", num_pages);
+  t = now() - t;
+  printf("imported %ld pages: %.3f s, %.1f us/page\n", num_pages, t, 1e6 * t / num_pages);
+
+  remove("bench-import-in.pdf");
+  remove("bench-import.pdf");
+
+  return 0;
+}
@@ -0,0 +1,132 @@
+/* Benchmark for setting a synthetic 1,000-page novel.
+
+Sets the same pages three times: once with one texpdf_dev_set_string()
+call per glyph, as SILE did, once with texpdf_dev_set_glyphs() per word
+and once per line. Every page has 45 lines of 11 words with kerned and
+raised glyphs. Prints the time taken and the size of each file.
+
+./bench-novel ./SomeFont.ttf [pages]
+
+*/
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "libtexpdf.h"
+
+#define MODE_STRING 0  /* texpdf_dev_set_string() per glyph */
+#define MODE_WORD   1  /* texpdf_dev_set_glyphs() per word */
+#define MODE_LINE   2  /* texpdf_dev_set_glyphs() per line */
+
+static const char *mode_names[] = { "string", "word", "line" };
+
+static double
+now (void)
+{
+  struct timespec t;
+
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+static void
+set_novel (const char *filename, const char *fontname, int mode, int npages)
+{
+  pdf_rect       mediabox = { 0.0, 0.0, 595.0, 842.0 };
+  pdf_doc       *p;
+  unsigned short glyphs[128];
+  spt_t          advances[128], offsets[256];
+  unsigned       seed = 1;
+  int            font, page, line, word, i, n;
+
+  texpdf_set_compression(0);
+  p = texpdf_open_document(filename, 0, 595.0, 842.0, 0, 0, 0);
+  texpdf_init_device(p, 1/65536.0, 2, 0);
+  texpdf_init_fontmaps();
+  texpdf_doc_set_mediabox(p, 0, &mediabox);
+  font = texpdf_dev_load_native_font(fontname, 0, 10*65536, 0, 65536, 0, 0);
+  if (font < 0) {
+    fprintf(stderr, "cannot load %s\n", fontname);
+    exit(1);
+  }
+
+  for (page = 0; page < npages; page++) {
+    texpdf_doc_begin_page(p, 1.0, 72.0, 770.0);
+    for (line = 0; line < 45; line++) {
+      spt_t x = 0, y = -line * 14 * 65536;
+
+      n = 0;
+      for (word = 0; word < 11; word++) {
+        int length, start = n;
+
+        seed   = seed * 1103515245 + 12345;
+        length = 2 + seed % 8;
+        for (i = 0; i < length; i++, n++) {
+          seed = seed * 1103515245 + 12345;
+          glyphs[n]      = 20 + (seed >> 16) % 60;
+          advances[n]    = 5 * 65536 + (seed >> 8) % 30000;
+          offsets[2*n]   = (i == 1 && (seed & 64)) ? -3000 : 0;
+          offsets[2*n+1] = (i == 2 && (seed & 128)) ? 3 * 65536 : 0;
+        }
+        advances[n-1] += 3 * 65536; /* interword space */
+
+        if (mode == MODE_STRING) {
+          for (i = start; i < n; i++) {
+            unsigned char g[2];
+
+            g[0] = glyphs[i] >> 8;
+            g[1] = glyphs[i] & 0xff;
+            texpdf_dev_set_string(p, x + offsets[2*i], y + offsets[2*i+1],
+                                  g, 2, advances[i], font, -1);
+            x += advances[i];
+          }
+        } else if (mode == MODE_WORD) {
+          texpdf_dev_set_glyphs(p, x, y, glyphs + start, advances + start,
+                                offsets + 2 * start, n - start, font);
+          for (i = start; i < n; i++)
+            x += advances[i];
+        }
+      }
+      if (mode == MODE_LINE)
+        texpdf_dev_set_glyphs(p, 0, y, glyphs, advances, offsets, n, font);
+    }
+    texpdf_doc_end_page(p);
+  }
+
+  texpdf_close_document(p);
+  texpdf_close_device();
+  texpdf_close_fontmaps();
+}
+
+int
+main (int argc, char **argv)
+{
+  int npages = argc > 2 ? atoi(argv[2]) : 1000;
+  int mode;
+
+  if (argc < 2) {
+    fprintf(stderr, "usage: %s font [pages]\n", argv[0]);
+    return 1;
+  }
+
+  for (mode = MODE_STRING; mode <= MODE_LINE; mode++) {
+    char   filename[64];
+    FILE  *fp;
+    double t;
+    long   size = 0;
+
+    sprintf(filename, "bench-novel-%s.pdf", mode_names[mode]);
+    t = now();
+    set_novel(filename, argv[1], mode, npages);
+    t = now() - t;
+    if ((fp = fopen(filename, "rb"))) {
+      fseek(fp, 0, SEEK_END);
+      size = ftell(fp);
+      fclose(fp);
+    }
+    printf("%-6s %d pages: %.3f s, %ld bytes\n", mode_names[mode], npages, t, size);
+  }
+
+  return 0;
+}
@@ -0,0 +1,118 @@
+/* Benchmark for writing PDF objects.
+
+Writes a synthetic object graph without compression: dictionaries with
+names, numbers, strings that need escaping and references to earlier
+objects, and arrays linking them together. This is done for PDF 1.4,
+where every object goes to the file with its own xref entry, and for
+PDF 1.5, where they go into object streams. Prints the time taken and
+the output throughput.
+
+./bench-output [objects]
+
+*/
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "libtexpdf.h"
+
+static double
+now (void)
+{
+  struct timespec t;
+
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+static pdf_obj *
+make_object (long i, pdf_obj **recent)
+{
+  static const char text[] = "Some (parenthesized) text with a \\ and \r\n\t\x01\xff bytes";
+  pdf_obj *dict = texpdf_new_dict();
+  pdf_obj *kids = texpdf_new_array();
+  char     name[32];
+  int      k;
+
+  texpdf_add_dict(dict, texpdf_new_name("Type"), texpdf_new_name("BenchNode"));
+  sprintf(name, "Node#20%ld", i);
+  texpdf_add_dict(dict, texpdf_new_name("Name"), texpdf_new_name(name));
+  texpdf_add_dict(dict, texpdf_new_name("Index"), texpdf_new_number(i));
+  texpdf_add_dict(dict, texpdf_new_name("Scale"), texpdf_new_number(i / 65536.0));
+  texpdf_add_dict(dict, texpdf_new_name("Text"),
+                  texpdf_new_string(text, sizeof(text) - 1 - i % 17));
+  texpdf_add_dict(dict, texpdf_new_name("Visible"), texpdf_new_boolean(i & 1));
+  for (k = 0; k < 8; k++) {
+    if (recent[k])
+      texpdf_add_array(kids, texpdf_ref_obj(recent[k]));
+    texpdf_add_array(kids, texpdf_new_number(k * 1.25 - i));
+  }
+  texpdf_add_dict(dict, texpdf_new_name("Kids"), kids);
+
+  return dict;
+}
+
+static void
+write_graph (const char *filename, int version, long num_objects)
+{
+  pdf_rect mediabox = { 0.0, 0.0, 595.0, 842.0 };
+  pdf_doc *p;
+  pdf_obj *recent[8] = { NULL };
+  long     i;
+  int      k;
+
+  texpdf_set_version(version);
+  texpdf_set_compression(0);
+  p = texpdf_open_document(filename, 0, 595.0, 842.0, 0, 0, 0);
+  texpdf_init_device(p, 1.0, 2, 0);
+  texpdf_doc_set_mediabox(p, 0, &mediabox);
+  texpdf_doc_begin_page(p, 1.0, 0.0, 0.0);
+
+  /* Keep the last eight objects open, so that later ones refer back to them */
+  for (i = 0; i < num_objects; i++) {
+    pdf_obj *obj = make_object(i, recent);
+
+    texpdf_release_obj(texpdf_ref_obj(obj));
+    k = i % 8;
+    if (recent[k])
+      texpdf_release_obj(recent[k]);
+    recent[k] = obj;
+  }
+  for (k = 0; k < 8; k++) {
+    if (recent[k])
+      texpdf_release_obj(recent[k]);
+  }
+
+  texpdf_doc_end_page(p);
+  texpdf_close_document(p);
+  texpdf_close_device();
+}
+
+int
+main (int argc, char **argv)
+{
+  long num_objects = argc > 1 ? atol(argv[1]) : 500000;
+  int  version;
+
+  for (version = 4; version <= 5; version++) {
+    const char *filename = "bench-output.pdf";
+    FILE       *fp;
+    double      t;
+    long        size = 0;
+
+    t = now();
+    write_graph(filename, version, num_objects);
+    t = now() - t;
+    if ((fp = fopen(filename, "rb"))) {
+      fseek(fp, 0, SEEK_END);
+      size = ftell(fp);
+      fclose(fp);
+    }
+    remove(filename);
+    printf("PDF 1.%d, %ld objects: %.3f s, %ld bytes, %.1f MB/s\n",
+           version, num_objects, t, size, size / t / 1e6);
+  }
+
+  return 0;
+}
@@ -159,6 +159,7 @@ bmp_include_image (pdf_ximage *ximage, FILE *fp)
 
   /* Start reading raster data */
   stream      = texpdf_new_stream(STREAM_COMPRESS);
+  texpdf_stream_set_class(stream, STREAM_CLASS_IMAGE);
   stream_dict = texpdf_stream_dict(stream);
 
   /* Color space: Indexed or DeviceRGB */
@@ -455,6 +455,7 @@ write_fontfile (CIDFont *font, cff_font *cffont)
     pdf_obj *fontfile, *stream_dict;
 
     fontfile    = texpdf_new_stream(STREAM_COMPRESS);
+    texpdf_stream_set_class(fontfile, STREAM_CLASS_FONT);
     stream_dict = texpdf_stream_dict(fontfile);
     texpdf_add_dict(font->descriptor,
                     texpdf_new_name("FontFile3"),
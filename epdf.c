@@ -148,11 +148,9 @@ texpdf_get_page_obj (pdf_file *pf, long page_no,
 	WARN("File contains tagged PDF. Ignoring tags.");
       texpdf_release_obj(markinfo);
     }
-
-    page_tree = pdf_deref_obj(texpdf_lookup_dict(catalog, "Pages"));
     texpdf_release_obj(catalog);
   }
-  if (!page_tree) {
+  if (pdf_file_get_page_count(pf) < 0) {
     WARN("Page tree not found.");
     return NULL;
   }
@@ -161,45 +159,39 @@ texpdf_get_page_obj (pdf_file *pf, long page_no,
    * Negative page numbers are counted from the back.
    */
   {
-    long count = texpdf_number_value(texpdf_lookup_dict(page_tree, "Count"));
+    long count = pdf_file_get_page_count(pf);
     page_idx = page_no + (page_no >= 0 ? -1 : count);
     if (page_idx < 0 || page_idx >= count) {
 	WARN("Page %ld does not exist.", page_no);
-	texpdf_release_obj(page_tree);
 	return NULL;
       }
     page_no = page_idx+1;
   }
 
   /*
-   * Seek correct page. Get Media/Crop Box.
-   * Media box and resources can be inherited.
+   * Get Media/Crop Box from the page index of PF, where inherited
+   * entries are already resolved.
    */
   {
-    pdf_obj *kids_ref, *kids;
-    pdf_obj *crop_box = NULL;
+    const pdf_file_page *page = pdf_file_get_page(pf, page_idx);
     pdf_obj *tmp;
+    static const char *boxes[] = { "BleedBox", "TrimBox", "ArtBox" };
+    int i;
 
-    tmp = texpdf_lookup_dict(page_tree, "Resources");
-    resources = tmp ? pdf_deref_obj(tmp) : texpdf_new_dict();
+    page_tree = page ? pdf_deref_obj(page->ref) : NULL;
+    if (!PDF_OBJ_DICTTYPE(page_tree)) {
+      WARN("Page %ld not found! Broken PDF file?", page_no);
+      if (page_tree)
+	texpdf_release_obj(page_tree);
+      return NULL;
+    }
+    resources = page->resources ?
+      texpdf_link_obj(page->resources) : texpdf_new_dict();
+    bbox   = page->media_box ? texpdf_link_obj(page->media_box) : NULL;
+    rotate = page->rotate ? texpdf_link_obj(page->rotate) : NULL;
 
-    while (1) {
-      long kids_length, i;
- 
-      if ((tmp = pdf_deref_obj(texpdf_lookup_dict(page_tree, "MediaBox")))) {
-	if (bbox)
-	  texpdf_release_obj(bbox);
-	bbox = tmp;
-      }
-      if ((tmp = pdf_deref_obj(texpdf_lookup_dict(page_tree, "BleedBox")))) {
-        if (!rect_equal(tmp, bbox)) {
-	  if (bbox)
-	    texpdf_release_obj(bbox);
-	  bbox = tmp;
-        } else
-          texpdf_release_obj(tmp);
-      }
-      if ((tmp = pdf_deref_obj(texpdf_lookup_dict(page_tree, "TrimBox")))) {
+    for (i = 0; i < 3; i++) {
+      if ((tmp = pdf_deref_obj(texpdf_lookup_dict(page_tree, boxes[i])))) {
         if (!rect_equal(tmp, bbox)) {
 	  if (bbox)
 	    texpdf_release_obj(bbox);
@@ -207,78 +199,11 @@ texpdf_get_page_obj (pdf_file *pf, long page_no,
         } else
           texpdf_release_obj(tmp);
       }
-      if ((tmp = pdf_deref_obj(texpdf_lookup_dict(page_tree, "ArtBox")))) {
-        if (!rect_equal(tmp, bbox)) {
-	  if (bbox)
-	    texpdf_release_obj(bbox);
-	  bbox = tmp;
-        } else
-          texpdf_release_obj(tmp);
-      }
-      if ((tmp = pdf_deref_obj(texpdf_lookup_dict(page_tree, "CropBox")))) {
-	if (crop_box)
-	  texpdf_release_obj(crop_box);
-	crop_box = tmp;
-      }
-      if ((tmp = pdf_deref_obj(texpdf_lookup_dict(page_tree, "Rotate")))) {
-	if (rotate)
-	  texpdf_release_obj(rotate);
-	rotate = tmp;
-      }
-      if ((tmp = pdf_deref_obj(texpdf_lookup_dict(page_tree, "Resources")))) {
-#if 0
-	texpdf_merge_dict(tmp, resources);
-#endif
-	if (resources)
-	  texpdf_release_obj(resources);
-	resources = tmp;
-      }
-
-      kids_ref = texpdf_lookup_dict(page_tree, "Kids");
-      if (!kids_ref)
-	break;
-      kids = pdf_deref_obj(kids_ref);
-      kids_length = texpdf_array_length(kids);
-
-      for (i = 0; i < kids_length; i++) {
-	long count;
-
-	texpdf_release_obj(page_tree);
-	page_tree = pdf_deref_obj(texpdf_get_array(kids, i));
-
-	tmp = pdf_deref_obj(texpdf_lookup_dict(page_tree, "Count"));
-	if (tmp) {
-	  /* Pages object */
-	  count = texpdf_number_value(tmp);
-	  texpdf_release_obj(tmp);
-	} else
-	  /* Page object */
-	  count = 1;
-
-	if (page_idx < count)
-	  break;
-
-	page_idx -= count;
-      }
-      
-      texpdf_release_obj(kids);
-
-      if (i == kids_length) {
-	WARN("Page %ld not found! Broken PDF file?", page_no);
-	if (bbox)
-	  texpdf_release_obj(bbox);
-	if (crop_box)
-	  texpdf_release_obj(crop_box);
-	if (rotate)
-	  texpdf_release_obj(rotate);
-	texpdf_release_obj(resources);
-	texpdf_release_obj(page_tree);
-	return NULL;
-      }
     }
-    if (crop_box) {
-      texpdf_release_obj(bbox);
-      bbox = crop_box;
+    if (page->crop_box) {
+      if (bbox)
+	texpdf_release_obj(bbox);
+      bbox = texpdf_link_obj(page->crop_box);
     }
   }
 
@@ -327,6 +252,7 @@ texpdf_get_page_content (pdf_obj* page)
     pdf_obj *content_seg;
     int      idx = 0;
     content_new = texpdf_new_stream(STREAM_COMPRESS);
+    texpdf_stream_set_class(content_new, STREAM_CLASS_CONTENT);
     for (;;) {
       content_seg = pdf_deref_obj(texpdf_get_array(contents, idx));
       if (!content_seg)
@@ -359,6 +285,7 @@ texpdf_get_page_content (pdf_obj* page)
     }
     /* Flate the contents if necessary. */
     content_new = texpdf_new_stream(STREAM_COMPRESS);
+    texpdf_stream_set_class(content_new, STREAM_CLASS_CONTENT);
     if (pdf_concat_stream(content_new, contents) < 0) {
       WARN("Could not handle a content stream.");
       texpdf_release_obj(contents);
@@ -442,17 +369,41 @@ pdf_include_page (pdf_ximage *ximage, FILE *image_file, const char *filename)
        * Concatenate all content streams.
        */
       int idx, len = texpdf_array_length(contents);
-      content_new = texpdf_new_stream(STREAM_COMPRESS);
+      pdf_obj **segs = NEW(len, pdf_obj *);
+
+      for (idx = 0; idx < len; idx++)
+	segs[idx] = pdf_deref_obj(texpdf_get_array(contents, idx));
+      content_new = NULL;
+#if HAVE_ZLIB
+      /* Flate-compressed segments are joined without recompressing them */
+      content_new = texpdf_new_stream(0);
+      texpdf_stream_set_class(content_new, STREAM_CLASS_CONTENT);
       for (idx = 0; idx < len; idx++) {
-	pdf_obj *content_seg = pdf_deref_obj(texpdf_get_array(contents, idx));
-	if (!PDF_OBJ_STREAMTYPE(content_seg) ||
-	    pdf_concat_stream(content_new, content_seg) < 0) {
-	  texpdf_release_obj(content_seg);
-	  texpdf_release_obj(content_new);
-	  goto error;
+	if (!PDF_OBJ_STREAMTYPE(segs[idx]))
+	  break;
+      }
+      if (idx < len || pdf_join_flate_streams(content_new, segs, len) < 0) {
+	texpdf_release_obj(content_new);
+	content_new = NULL;
+      }
+#endif
+      if (!content_new) {
+	content_new = texpdf_new_stream(STREAM_COMPRESS);
+	texpdf_stream_set_class(content_new, STREAM_CLASS_CONTENT);
+	for (idx = 0; idx < len; idx++) {
+	  if (!PDF_OBJ_STREAMTYPE(segs[idx]) ||
+	      pdf_concat_stream(content_new, segs[idx]) < 0) {
+	    texpdf_release_obj(content_new);
+	    content_new = NULL;
+	    break;
+	  }
 	}
-	texpdf_release_obj(content_seg);
       }
+      for (idx = 0; idx < len; idx++)
+	texpdf_release_obj(segs[idx]);
+      RELEASE(segs);
+      if (!content_new)
+	goto error;
     } else
       goto error;
 
@@ -601,24 +552,196 @@ static struct operator
 };
 
 
+struct clip_state
+{
+  pdf_doc    *p;
+  pdf_tmatrix M;
+  int         depth;
+};
+
+/* Copy the last COUNT operands, which must be numbers, to V */
+static int
+clip_operands (pdf_content_operand *operands, int num_operands,
+               int count, double *v)
+{
+  int i;
+
+  if (num_operands < count)
+    return -1;
+  operands += num_operands - count;
+  for (i = 0; i < count; i++) {
+    if (operands[i].type != PDF_NUMBER)
+      return -1;
+    v[i] = operands[i].value;
+  }
+
+  return 0;
+}
+
+static int
+clip_op (void *data, const char *op, int length,
+         pdf_content_operand *operands, int num_operands)
+{
+  struct clip_state *st = data;
+  pdf_doc     *p = st->p;
+  pdf_tmatrix  T;
+  pdf_coord    p0, p1, p2, p3;
+  double       v[6];
+  int          j;
+
+  if (st->depth > 1) {
+    if (length == 1 && *op == 'q')
+      st->depth++;
+    else if (length == 1 && *op == 'Q')
+      st->depth--;
+    return 0;
+  }
+
+  for (j = 0; j < sizeof(pdf_operators) / sizeof(pdf_operators[0]); j++)
+    if (!strncmp(op, pdf_operators[j].token, length) &&
+        pdf_operators[j].token[length] == '\0')
+      break;
+  if (j == sizeof(pdf_operators) / sizeof(pdf_operators[0]))
+    return -1;
+
+  switch (pdf_operators[j].opcode) {
+  case  0:
+  case -1:
+  case -2:
+  case -3:
+  case -4:
+    /* Just check the number of operands and do nothing. */
+    if (num_operands < -pdf_operators[j].opcode)
+      return -1;
+    break;
+  case OP_SETCOLOR:
+    break;
+  case OP_CLOSEandCLIP:
+    texpdf_dev_closepath();
+  case OP_CLIP:
+#if 0
+    texpdf_dev_clip();
+#else
+    texpdf_dev_flushpath(p, 'W', PDF_FILL_RULE_NONZERO);
+#endif
+    break;
+  case OP_CONCATMATRIX:
+    if (clip_operands(operands, num_operands, 6, v) < 0)
+      return -1;
+    T.a = v[0]; T.b = v[1]; T.c = v[2];
+    T.d = v[3]; T.e = v[4]; T.f = v[5];
+    pdf_concatmatrix(&st->M, &T);
+    break;
+  case OP_SETCOLORSPACE:
+    /* Do nothing. */
+    break;
+  case OP_RECTANGLE:
+    if (clip_operands(operands, num_operands, 4, v) < 0)
+      return -1;
+    p0.x = v[0]; p0.y = v[1];
+    p1.x = v[2]; p1.y = v[3];
+    if (st->M.b == 0 && st->M.c == 0) {
+      pdf_tmatrix M0;
+      M0.a = st->M.a; M0.b = st->M.b; M0.c = st->M.c; M0.d = st->M.d;
+      M0.e = 0; M0.f = 0;
+      texpdf_dev_transform(&p0, &st->M);
+      texpdf_dev_transform(&p1, &M0);
+      texpdf_dev_rectadd(p, p0.x, p0.y, p1.x, p1.y);
+    } else {
+      p2.x = p0.x + p1.x; p2.y = p0.y + p1.y;
+      p3.x = p0.x; p3.y = p0.y + p1.y;
+      p1.x += p0.x; p1.y = p0.y;
+      texpdf_dev_transform(&p0, &st->M);
+      texpdf_dev_transform(&p1, &st->M);
+      texpdf_dev_transform(&p2, &st->M);
+      texpdf_dev_transform(&p3, &st->M);
+      texpdf_dev_moveto(p0.x, p0.y);
+      texpdf_dev_lineto(p1.x, p1.y);
+      texpdf_dev_lineto(p2.x, p2.y);
+      texpdf_dev_lineto(p3.x, p3.y);
+      texpdf_dev_closepath();
+    }
+    break;
+  case OP_CURVETO:
+    if (clip_operands(operands, num_operands, 6, v) < 0)
+      return -1;
+    p0.x = v[4]; p0.y = v[5];
+    p1.x = v[2]; p1.y = v[3];
+    p2.x = v[0]; p2.y = v[1];
+    texpdf_dev_transform(&p0, &st->M);
+    texpdf_dev_transform(&p1, &st->M);
+    texpdf_dev_transform(&p2, &st->M);
+    texpdf_dev_curveto(p2.x, p2.y, p1.x, p1.y, p0.x, p0.y);
+    break;
+  case OP_CLOSEPATH:
+    texpdf_dev_closepath();
+    break;
+  case OP_LINETO:
+    if (clip_operands(operands, num_operands, 2, v) < 0)
+      return -1;
+    p0.x = v[0]; p0.y = v[1];
+    texpdf_dev_transform(&p0, &st->M);
+    texpdf_dev_lineto(p0.x, p0.y);
+    break;
+  case OP_MOVETO:
+    if (clip_operands(operands, num_operands, 2, v) < 0)
+      return -1;
+    p0.x = v[0]; p0.y = v[1];
+    texpdf_dev_transform(&p0, &st->M);
+    texpdf_dev_moveto(p0.x, p0.y);
+    break;
+  case OP_NOOP:
+    texpdf_doc_add_page_content(p, " n", 2);
+    break;
+  case OP_GSAVE:
+    st->depth++;
+    break;
+  case OP_GRESTORE:
+    st->depth--;
+    break;
+  case OP_CURVETO1:
+    if (clip_operands(operands, num_operands, 4, v) < 0)
+      return -1;
+    p0.x = v[2]; p0.y = v[3];
+    p1.x = v[0]; p1.y = v[1];
+    texpdf_dev_transform(&p0, &st->M);
+    texpdf_dev_transform(&p1, &st->M);
+    texpdf_dev_vcurveto(p1.x, p1.y, p0.x, p0.y);
+    break;
+  case OP_CURVETO2:
+    if (clip_operands(operands, num_operands, 4, v) < 0)
+      return -1;
+    p0.x = v[2]; p0.y = v[3];
+    p1.x = v[0]; p1.y = v[1];
+    texpdf_dev_transform(&p0, &st->M);
+    texpdf_dev_transform(&p1, &st->M);
+    texpdf_dev_ycurveto(p1.x, p1.y, p0.x, p0.y);
+    break;
+  default:
+    return -1;
+  }
+
+  return 0;
+}
+
 int
 texpdf_copy_clip (pdf_doc *p, FILE *image_file, int pageNo, double x_user, double y_user)
 {
   pdf_obj *page_tree, *contents;
-  int depth = 0, top = -1;
-  const char *clip_path, *end_path;
-  char *save_path, *temp;
-  pdf_tmatrix M;
-  double stack[6];
+  struct clip_state st;
+  const char *clip_path;
+  int error;
   pdf_file *pf;
   
   pf = texpdf_open(NULL, image_file);
   if (!pf)
     return -1;
 
-  texpdf_dev_currentmatrix(&M);
-  texpdf_invertmatrix(&M);
-  M.e += x_user; M.f += y_user;
+  st.p = p;
+  st.depth = 0;
+  texpdf_dev_currentmatrix(&st.M);
+  texpdf_invertmatrix(&st.M);
+  st.M.e += x_user; st.M.f += y_user;
   page_tree = texpdf_get_page_obj (pf, pageNo, NULL, NULL);
   if (!page_tree) {
     texpdf_close(pf);
@@ -634,217 +757,15 @@ texpdf_copy_clip (pdf_doc *p, FILE *image_file, int pageNo, double x_user, doubl
 
   texpdf_doc_add_page_content(p, " ", 1);
 
-  save_path = malloc(pdf_stream_length(contents) + 1);
-  strncpy(save_path, (const char *) pdf_stream_dataptr(contents),  pdf_stream_length(contents));
-  clip_path = save_path;
-  end_path = clip_path + pdf_stream_length(contents);
-  depth = 0;
-
-  for (; clip_path < end_path; clip_path++) {
-    int color_dimen = 0;	/* silence uninitialized warning */
-    char *token;
-    texpdf_skip_white(&clip_path, end_path);
-    if (clip_path == end_path)
-      break;
-    if (depth > 1) {
-      if (*clip_path == 'q')
-        depth++;
-      if (*clip_path == 'Q')
-	depth--;
-      texpdf_parse_ident(&clip_path, end_path);
-      continue;
-    } else if (*clip_path == '-'
-	    || *clip_path == '+'
-	    || *clip_path == '.'
-	    || isdigit((unsigned char)*clip_path)) {
-      stack[++top] = strtod(clip_path, &temp);
-      clip_path = temp;
-    } else if (*clip_path == '[') {
-      /* Ignore, but put a dummy value on the stack (in case of d operator) */
-      texpdf_parse_pdf_array(&clip_path, end_path, pf);
-      stack[++top] = 0;
-    } else if (*clip_path == '/') {
-      if  (strncmp("/DeviceGray",	clip_path, 11) == 0
-	|| strncmp("/Indexed",		clip_path, 8)  == 0
-	|| strncmp("/CalGray",		clip_path, 8)  == 0) {
-	color_dimen = 1;
-	continue;
-      }
-      else if  (strncmp("/DeviceRGB",	clip_path, 10) == 0
-	|| strncmp("/CalRGB",		clip_path, 7)  == 0
-	|| strncmp("/Lab",		clip_path, 4)  == 0) {
-	color_dimen = 3;
-	continue;
-      }
-      else if  (strncmp("/DeviceCMYK",	clip_path, 11) == 0) {
-	color_dimen = 4;
-	continue;
-      }
-      else {
-        clip_path++;
-        texpdf_parse_ident(&clip_path, end_path);
-	texpdf_skip_white(&clip_path, end_path);
-	token = texpdf_parse_ident(&clip_path, end_path);
-        if (strcmp(token, "gs") == 0) {
-	  continue;
-	}
-        return -1;
-      }
-    } else {
-      int j;
-      pdf_tmatrix T;
-      pdf_coord  p0, p1, p2, p3;
-
-      token = texpdf_parse_ident(&clip_path, end_path);
-      for (j = 0; j < sizeof(pdf_operators) / sizeof(pdf_operators[0]); j++)
-        if (strcmp(token, pdf_operators[j].token) == 0)
-	  break;
-      if (j == sizeof(pdf_operators) / sizeof(pdf_operators[0])) {
-        return -1;
-      }
-      switch (pdf_operators[j].opcode) {
-	case  0:
-	case -1:
-	case -2:
-	case -3:
-	case -4:
-	  /* Just pop the stack and do nothing. */
-	  top += pdf_operators[j].opcode;
-	  if (top < -1)
-	    return -1;
-	  break;
-	case OP_SETCOLOR:
-	  top -= color_dimen;
-	  if (top < -1)
-	    return -1;
-	  break;
-	case OP_CLOSEandCLIP:
-	  texpdf_dev_closepath();
-	case OP_CLIP:
-#if 0
-	  texpdf_dev_clip();
-#else
-	  texpdf_dev_flushpath(p, 'W', PDF_FILL_RULE_NONZERO);
-#endif
-	  break;
-	case OP_CONCATMATRIX:
-	  if (top < 5)
-	    return -1;
-	  T.f = stack[top--];
-	  T.e = stack[top--];
-	  T.d = stack[top--];
-	  T.c = stack[top--];
-	  T.b = stack[top--];
-	  T.a = stack[top--];
-	  pdf_concatmatrix(&M, &T);
-	  break;
-	case OP_SETCOLORSPACE:
-	  /* Do nothing. */
-	  break;
-	case OP_RECTANGLE:
-	  if (top < 3)
-	    return -1;
-	  p1.y = stack[top--];
-	  p1.x = stack[top--];
-	  p0.y = stack[top--];
-	  p0.x = stack[top--];
-	  if (M.b == 0 && M.c == 0) {
-	    pdf_tmatrix M0;
-	    M0.a = M.a; M0.b = M.b; M0.c = M.c; M0.d = M.d;
-	    M0.e = 0; M0.f = 0;
-	    texpdf_dev_transform(&p0, &M);
-	    texpdf_dev_transform(&p1, &M0);
-	    texpdf_dev_rectadd(p, p0.x, p0.y, p1.x, p1.y);
-	  } else {
-	    p2.x = p0.x + p1.x; p2.y = p0.y + p1.y;
-	    p3.x = p0.x; p3.y = p0.y + p1.y;
-	    p1.x += p0.x; p1.y = p0.y;
-	    texpdf_dev_transform(&p0, &M);
-	    texpdf_dev_transform(&p1, &M);
-	    texpdf_dev_transform(&p2, &M);
-	    texpdf_dev_transform(&p3, &M);
-	    texpdf_dev_moveto(p0.x, p0.y);
-	    texpdf_dev_lineto(p1.x, p1.y);
-	    texpdf_dev_lineto(p2.x, p2.y);
-	    texpdf_dev_lineto(p3.x, p3.y);
-	    texpdf_dev_closepath();
-	  }
-	  break;
-	case OP_CURVETO:
-	  if (top < 5)
-	    return -1;
-	  p0.y = stack[top--];
-	  p0.x = stack[top--];
-	  texpdf_dev_transform(&p0, &M);
-	  p1.y = stack[top--];
-	  p1.x = stack[top--];
-	  texpdf_dev_transform(&p1, &M);
-	  p2.y = stack[top--];
-	  p2.x = stack[top--];
-	  texpdf_dev_transform(&p2, &M);
-	  texpdf_dev_curveto(p2.x, p2.y, p1.x, p1.y, p0.x, p0.y);
-	  break;
-	case OP_CLOSEPATH:
-	  texpdf_dev_closepath();
-	  break;
-	case OP_LINETO:
-	  if (top < 1)
-	    return -1;
-	  p0.y = stack[top--];
-	  p0.x = stack[top--];
-	  texpdf_dev_transform(&p0, &M);
-	  texpdf_dev_lineto(p0.x, p0.y);
-	  break;
-	case OP_MOVETO:
-	  if (top < 1)
-	    return -1;
-	  p0.y = stack[top--];
-	  p0.x = stack[top--];
-	  texpdf_dev_transform(&p0, &M);
-	  texpdf_dev_moveto(p0.x, p0.y);
-	  break;
-	case OP_NOOP:
-	  texpdf_doc_add_page_content(p, " n", 2);
-	  break;
-	case OP_GSAVE:
-	  depth++;
-	  break;
-	case OP_GRESTORE:
-	  depth--;
-	  break;
-	case OP_CURVETO1:
-	  if (top < 3)
-	    return -1;
-	  p0.y = stack[top--];
-	  p0.x = stack[top--];
-	  texpdf_dev_transform(&p0, &M);
-	  p1.y = stack[top--];
-	  p1.x = stack[top--];
-	  texpdf_dev_transform(&p1, &M);
-	  texpdf_dev_vcurveto(p1.x, p1.y, p0.x, p0.y);
-	  break;
-	case OP_CURVETO2:
-	  if (top < 3)
-	    return -1;
-	  p0.y = stack[top--];
-	  p0.x = stack[top--];
-	  texpdf_dev_transform(&p0, &M);
-	  p1.y = stack[top--];
-	  p1.x = stack[top--];
-	  texpdf_dev_transform(&p1, &M);
-	  texpdf_dev_ycurveto(p1.x, p1.y, p0.x, p0.y);
-	  break;
-	default:
-	  return -1;
-      }
-    }
-  }
-  free(save_path);
+  clip_path = (const char *) pdf_stream_dataptr(contents);
+  error = texpdf_scan_content(clip_path,
+                              clip_path + pdf_stream_length(contents),
+                              clip_op, &st);
 
   texpdf_release_obj(contents);
   texpdf_close(pf);
 
-  return 0;
+  return error < 0 ? -1 : 0;
 }
 
 #if 0
@@ -45,3 +45,207 @@ void *renew (void *mem, size_t size)
     return NULL;
   }
 }
+
+/*
+ * Region allocator.
+ *
+ * Every allocation is preceded by a pointer to the chunk it lives in,
+ * so texpdf_arena_free() does not need to know the arena.
+ */
+#define ARENA_ALIGN    (sizeof(double) > sizeof(void *) ? sizeof(double) : sizeof(void *))
+#define ALIGN_UP(n)    (((n) + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1))
+#define CHUNK_HEAD     ALIGN_UP(sizeof(struct mem_chunk))
+#define ALLOC_HEAD     ALIGN_UP(sizeof(struct mem_chunk *))
+#define ARENA_FREE_MAX 8
+
+struct mem_chunk
+{
+  mem_arena        *arena;  /* NULL once the arena has been destroyed */
+  struct mem_chunk *prev;   /* links in the list of retired chunks */
+  struct mem_chunk *next;
+  size_t            size;   /* usable bytes following the header */
+  size_t            used;
+  long              live;   /* allocations not yet freed */
+};
+
+struct mem_arena
+{
+  size_t            chunk_size;
+  struct mem_chunk *current;
+  struct mem_chunk *retired; /* chunks still holding live allocations */
+  struct mem_chunk *free;    /* empty chunks kept for reuse */
+  int               num_free;
+};
+
+mem_arena *
+texpdf_arena_new (size_t chunk_size)
+{
+  mem_arena *arena;
+
+  arena = NEW(1, mem_arena);
+  arena->chunk_size = ALIGN_UP(chunk_size);
+  arena->current    = NULL;
+  arena->retired    = NULL;
+  arena->free       = NULL;
+  arena->num_free   = 0;
+
+  return arena;
+}
+
+static struct mem_chunk *
+arena_get_chunk (mem_arena *arena, size_t size)
+{
+  struct mem_chunk *chunk;
+
+  if (size <= arena->chunk_size && arena->free) {
+    chunk = arena->free;
+    arena->free = chunk->next;
+    arena->num_free--;
+  } else {
+    if (size < arena->chunk_size)
+      size = arena->chunk_size;
+    chunk = (struct mem_chunk *) new(CHUNK_HEAD + size);
+    chunk->size = size;
+  }
+  chunk->arena = arena;
+  chunk->prev  = chunk->next = NULL;
+  chunk->used  = 0;
+  chunk->live  = 0;
+
+  return chunk;
+}
+
+/* Return an empty chunk to the free list, or to the system. */
+static void
+arena_recycle_chunk (mem_arena *arena, struct mem_chunk *chunk)
+{
+  if (chunk->size == arena->chunk_size &&
+      arena->num_free < ARENA_FREE_MAX) {
+    chunk->used = 0;
+    chunk->prev = NULL;
+    chunk->next = arena->free;
+    arena->free = chunk;
+    arena->num_free++;
+  } else {
+    RELEASE(chunk);
+  }
+}
+
+static void
+arena_retire_chunk (mem_arena *arena, struct mem_chunk *chunk)
+{
+  if (chunk->live == 0) {
+    arena_recycle_chunk(arena, chunk);
+  } else {
+    chunk->prev = NULL;
+    chunk->next = arena->retired;
+    if (arena->retired)
+      arena->retired->prev = chunk;
+    arena->retired = chunk;
+  }
+}
+
+void *
+texpdf_arena_alloc (mem_arena *arena, size_t size)
+{
+  struct mem_chunk *chunk;
+  size_t  need = ALLOC_HEAD + ALIGN_UP(size);
+  char   *p;
+
+  ASSERT(arena);
+
+  chunk = arena->current;
+  if (!chunk || chunk->used + need > chunk->size) {
+    if (need > arena->chunk_size) {
+      /* Oversized request: give it a chunk of its own. */
+      chunk = arena_get_chunk(arena, need);
+      p = (char *) chunk + CHUNK_HEAD;
+      chunk->used = need;
+      chunk->live = 1;
+      arena_retire_chunk(arena, chunk);
+      *(struct mem_chunk **) p = chunk;
+      return p + ALLOC_HEAD;
+    }
+    if (chunk)
+      arena_retire_chunk(arena, chunk);
+    chunk = arena->current = arena_get_chunk(arena, arena->chunk_size);
+  }
+
+  p = (char *) chunk + CHUNK_HEAD + chunk->used;
+  chunk->used += need;
+  chunk->live++;
+  *(struct mem_chunk **) p = chunk;
+
+  return p + ALLOC_HEAD;
+}
+
+void
+texpdf_arena_free (void *p)
+{
+  struct mem_chunk *chunk;
+  mem_arena        *arena;
+
+  if (!p)
+    return;
+
+  chunk = *(struct mem_chunk **) ((char *) p - ALLOC_HEAD);
+  ASSERT(chunk->live > 0);
+  if (--chunk->live > 0)
+    return;
+
+  arena = chunk->arena;
+  if (!arena) {
+    /* Orphaned by texpdf_arena_destroy() */
+    RELEASE(chunk);
+  } else if (chunk == arena->current) {
+    chunk->used = 0;
+  } else {
+    if (chunk->prev)
+      chunk->prev->next = chunk->next;
+    else
+      arena->retired = chunk->next;
+    if (chunk->next)
+      chunk->next->prev = chunk->prev;
+    arena_recycle_chunk(arena, chunk);
+  }
+}
+
+/*
+ * Start a new region. Chunks are recycled as soon as everything
+ * allocated in them has been freed, so this is O(1).
+ */
+void
+texpdf_arena_reset (mem_arena *arena)
+{
+  ASSERT(arena);
+
+  if (arena->current) {
+    if (arena->current->live == 0)
+      arena->current->used = 0;
+    else {
+      arena_retire_chunk(arena, arena->current);
+      arena->current = NULL;
+    }
+  }
+}
+
+void
+texpdf_arena_destroy (mem_arena *arena)
+{
+  struct mem_chunk *chunk, *next;
+
+  if (!arena)
+    return;
+
+  texpdf_arena_reset(arena);
+  if (arena->current)
+    RELEASE(arena->current);
+  /* Live allocations keep their chunk until they are freed. */
+  for (chunk = arena->retired; chunk; chunk = chunk->next)
+    chunk->arena = NULL;
+  for (chunk = arena->free; chunk; chunk = next) {
+    next = chunk->next;
+    RELEASE(chunk);
+  }
+  RELEASE(arena);
+}
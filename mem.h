@@ -32,4 +32,21 @@ extern void *renew (void *p, size_t size);
 #define RENEW(p,n,type) (type *) renew(p,(n)*sizeof(type))
 #define RELEASE(p)      free(p)
 
+/* Region allocator for short-lived objects.
+ *
+ * Memory is handed out from large chunks by bumping a pointer.
+ * Each chunk counts its live allocations; a chunk that has been
+ * retired (filled up, or left behind by texpdf_arena_reset) is
+ * recycled as soon as its last allocation is freed. Allocations
+ * that outlive a reset are therefore safe, they merely pin their
+ * chunk.
+ */
+typedef struct mem_arena mem_arena;
+
+extern mem_arena *texpdf_arena_new     (size_t chunk_size);
+extern void       texpdf_arena_destroy (mem_arena *arena);
+extern void      *texpdf_arena_alloc   (mem_arena *arena, size_t size);
+extern void       texpdf_arena_free    (void *p);
+extern void       texpdf_arena_reset   (mem_arena *arena);
+
 #endif /* _MEM_H_ */
@@ -63,16 +63,16 @@ static void os_error(void)
   ERROR ("io:  An OS command failed that should not have.\n");
 }
 
-void seek_absolute (FILE *file, long pos) 
+void seek_absolute (FILE *file, off_t pos) 
 {
-  if (fseek(file, pos, SEEK_SET)) {
+  if (fseeko(file, pos, SEEK_SET)) {
     os_error();
   }
 }
 
-void seek_relative (FILE *file, long pos)
+void seek_relative (FILE *file, off_t pos)
 {
-  if (fseek(file, pos, SEEK_CUR)) {
+  if (fseeko(file, pos, SEEK_CUR)) {
     os_error();
   }
 }
@@ -80,23 +80,23 @@ void seek_relative (FILE *file, long pos)
 
 void seek_end (FILE *file) 
 {
-  if (fseek(file, 0L, SEEK_END)) {
+  if (fseeko(file, (off_t)0, SEEK_END)) {
     os_error();
   }
 }
 
-long tell_position (FILE *file) 
+off_t tell_position (FILE *file) 
 {
-  long size;
-  if ((size = ftell (file)) < 0) {
+  off_t size;
+  if ((size = ftello (file)) < 0) {
     os_error();
   }
   return size;
 }
 
-long file_size (FILE *file)
+off_t file_size (FILE *file)
 {
-  long size;
+  off_t size;
   /* Seek to end */
   seek_end (file);
   size = tell_position (file);
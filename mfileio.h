@@ -40,14 +40,14 @@ int mfclose (FILE *file, const char *function, int line);
 #define MFCLOSE(file) fclose(file)
 #endif
 
-extern void seek_absolute (FILE *file, long pos);
-extern void seek_relative (FILE *file, long pos);
+extern void seek_absolute (FILE *file, off_t pos);
+extern void seek_relative (FILE *file, off_t pos);
 
 extern void seek_end (FILE *file);
 
-extern long tell_position (FILE *file);
+extern off_t tell_position (FILE *file);
 
-extern long file_size (FILE *file);
+extern off_t file_size (FILE *file);
 
 #define xseek_absolute(file, pos, name) fseeko (file, (off_t)(pos), SEEK_SET)
 #define xseek_relative(file, pos, name) fseeko (file, (off_t)(pos), SEEK_CUR)
@@ -118,13 +118,14 @@ p_itoa (long value, char *buf)
 
 /* NOTE: Acrobat 5 and prior uses 16.16 fixed point representation for
  * real numbers.
+ *
+ * This runs for nearly every number in a content stream, so digits are
+ * generated here. sprintf() is only used for integer parts that do not
+ * fit in a long, or that are not finite.
  */
 static int
 p_dtoa (double value, int prec, char *buf)
 {
-  const long p[10] = { 1, 10, 100, 1000, 10000,
-		                   100000, 1000000, 10000000,
-                       100000000, 1000000000 };
   double i, f;
   long   g;
   char  *c = buf;
@@ -139,15 +140,20 @@ p_dtoa (double value, int prec, char *buf)
   }
 
   f = modf(value, &i);
-  g = (long) (f * p[prec] + 0.5);
+  g = (long) (f * ten_pow[prec] + 0.5);
 
-  if (g == p[prec]) {
+  if (g == (long) ten_pow[prec]) {
     g  = 0;
     i += 1;
   }
 
   if (i) {
-    int m = sprintf(c, "%.0f", i);
+    int m;
+
+    if (i < 2147483648.0)
+      m = p_itoa((long) i, c);
+    else
+      m = sprintf(c, "%.0f", i);
     c += m;
     n += m;
   } else if (g == 0) {
@@ -158,22 +164,20 @@ p_dtoa (double value, int prec, char *buf)
   if (g) {
     int j = prec;
 
+    /* Drop trailing zeros */
+    while (g % 10 == 0) {
+      g /= 10;
+      j--;
+    }
     *c++ = '.';
-
+    n += 1 + j;
     while (j--) {
       c[j] = (g % 10) + '0';
       g /= 10;
     }
-    c += prec - 1;
-    n += 1 + prec;
-
-    while (*c == '0') {
-      c--;
-      n--;
-    }
   }
 
-  *(++c) = 0;
+  buf[n] = 0;
 
   return n;
 }
@@ -344,7 +348,8 @@ static struct {
   /* Dvipdfmx does compression of text by doing text positioning
    * in relative motion and uses string array [(foo) -250 (bar)]
    * with kerning (negative kern is used for white space as suited
-   * for TeX). This is offset within current string.
+   * for TeX). This is offset of the current text position from the
+   * reference point, and stays valid after the array is closed.
    */
   spt_t     offset;
 
@@ -354,12 +359,13 @@ static struct {
   spt_t     ref_x;
   spt_t     ref_y;
 
-  /* Using text raise and leading is highly recommended for
-   * text extraction to work properly. But not implemented yet.
-   * We can't do consice output for \TeX without this.
+  /* Text rise (Ts) set within the current line, and the line
+   * displacement last set by TD so that T* can repeat it. The rise
+   * is always zero outside text objects. A zero leading means none
+   * has been set in this text object.
    */
-  spt_t     raise;    /* unused */
-  spt_t     leading;  /* unused */
+  spt_t     raise;
+  spt_t     leading;
 
   /* This is not always text matrix but rather font matrix.
    * We do not use horizontal scaling in PDF text state parameter
@@ -395,6 +401,19 @@ static struct {
    * Set to 1 if font is composite (Type0) font.
    */
   int       is_mb;
+
+  /* Set if the current text position is known to be at offset
+   * from the reference point, so that a string may be continued
+   * from there without a Td.
+   */
+  int       at_offset;
+
+  /* Set once a TJ array has been started since the last BT or Tm.
+   * Td moves from the start of the line, not from where the text
+   * shown since then ended, so a zero move may only be dropped when
+   * nothing has been shown.
+   */
+  int       shown;
 } text_state = {
   -1,            /* font   */
   0,             /* offset */
@@ -408,7 +427,9 @@ static struct {
 
   /* internal */
   0,    /* force_reset   */
-  0     /* is_mb         */
+  0,    /* is_mb         */
+  0,    /* at_offset     */
+  0     /* shown         */
 };
 
 #define PDF_FONTTYPE_SIMPLE    1
@@ -542,6 +563,8 @@ dev_set_text_matrix (pdf_doc *p, spt_t xpos, spt_t ypos, double slant, double ex
 
   text_state.ref_x = xpos;
   text_state.ref_y = ypos;
+  text_state.offset = 0;
+  text_state.shown  = 0;
   text_state.matrix.slant  = slant;
   text_state.matrix.extend = extend;
   text_state.matrix.rotate = rotate;
@@ -576,7 +599,10 @@ reset_text_state (pdf_doc *p)
   text_state.ref_x = 0;
   text_state.ref_y = 0;
   text_state.offset   = 0;
+  text_state.leading  = 0;
   text_state.force_reset = 0;
+  text_state.at_offset   = 1;
+  text_state.shown       = 0;
 }
 
 static void
@@ -592,8 +618,17 @@ text_mode (pdf_doc *p)
     reset_text_state(p);
     break;
   }
-  motion_state      = TEXT_MODE;
-  text_state.offset = 0;
+  motion_state = TEXT_MODE;
+}
+
+/* Text rise is only used within a line; reset it before moving on. */
+static void
+reset_text_rise (pdf_doc *p)
+{
+  if (text_state.raise != 0) {
+    texpdf_doc_add_page_content(p, " 0 Ts", 5);  /* op: Ts */
+    text_state.raise = 0;
+  }
 }
 
 void
@@ -606,8 +641,13 @@ texpdf_graphics_mode (pdf_doc *p)
     texpdf_doc_add_page_content(p, text_state.is_mb ? ">]TJ" : ")]TJ", 4);  /* op: TJ */
     /* continue */
   case TEXT_MODE:
+    reset_text_rise(p);
     texpdf_doc_add_page_content(p, " ET", 3);  /* op: ET */
     text_state.force_reset =  0;
+    /*
+     * Tf survives ET, but raw content added between text objects
+     * may select another font or restore the graphics state.
+     */
     text_state.font_id     = -1;
     break;
   }
@@ -617,9 +657,10 @@ texpdf_graphics_mode (pdf_doc *p)
 static void
 start_string (pdf_doc *p, spt_t xpos, spt_t ypos, double slant, double extend, int rotate)
 {
-  spt_t delx, dely, error_delx, error_dely;
-  spt_t desired_delx, desired_dely;
-  int   len = 0;
+  spt_t  delx, dely, error_delx = 0, error_dely = 0;
+  spt_t  desired_delx = 0, desired_dely = 0;
+  double move_x, move_y;
+  int    len = 0;
 
   delx = xpos - text_state.ref_x;
   dely = ypos - text_state.ref_y;
@@ -766,18 +807,39 @@ start_string (pdf_doc *p, spt_t xpos, spt_t ypos, double slant, double extend, i
     error_dely = -error_dely;
     break;
   }
-  texpdf_doc_add_page_content(p, format_buffer, len);  /* op: */
   /*
-   * dvipdfm wrongly using "TD" in place of "Td".
-   * The TD operator set leading, but we are not using T* etc.
+   * The move is written with TD so that it also sets the leading.
+   * The next line with the same displacement then only needs T*,
+   * and nothing is needed when the text does not move at all and
+   * is still at the start of the line.
    */
-  texpdf_doc_add_page_content(p, text_state.is_mb ? " Td[<" : " Td[(", 5);  /* op: Td */
+  move_x = dround_at(spt2bpt(desired_delx), dev_unit.precision);
+  move_y = dround_at(spt2bpt(desired_dely), dev_unit.precision);
+  if (move_x == 0.0 && move_y == 0.0 && !text_state.shown) {
+    len = 0;
+  } else if (move_x == 0.0 && text_state.leading != 0 &&
+             move_y == dround_at(spt2bpt(text_state.leading), dev_unit.precision)) {
+    len = 0;
+    format_buffer[len++] = ' ';
+    format_buffer[len++] = 'T';
+    format_buffer[len++] = '*';
+  } else {
+    format_buffer[len++] = ' ';
+    format_buffer[len++] = 'T';
+    format_buffer[len++] = 'D';
+    text_state.leading = desired_dely;
+  }
+  format_buffer[len++] = '[';
+  format_buffer[len++] = text_state.is_mb ? '<' : '(';
+  texpdf_doc_add_page_content(p, format_buffer, len);  /* op: TD T* */
 
   /* Error correction */
   text_state.ref_x = xpos - error_delx;
   text_state.ref_y = ypos - error_dely;
 
-  text_state.offset   = 0;
+  text_state.offset    = 0;
+  text_state.at_offset = 1;
+  text_state.shown     = 1;
 }
 
 static void
@@ -790,10 +852,13 @@ string_mode (pdf_doc *p, spt_t xpos, spt_t ypos, double slant, double extend, in
     reset_text_state(p);
     /* continue */
   case TEXT_MODE:
+    reset_text_rise(p);
     if (text_state.force_reset) {
       dev_set_text_matrix(p, xpos, ypos, slant, extend, rotate);
       texpdf_doc_add_page_content(p, text_state.is_mb ? "[<" : "[(", 2);  /* op: */
       text_state.force_reset = 0;
+      text_state.at_offset   = 1;
+      text_state.shown       = 1;
     } else {
       start_string(p, xpos, ypos, slant, extend, rotate);
     }
@@ -837,6 +902,10 @@ dev_set_font (pdf_doc *doc, int font_id)
 
   text_state.is_mb = (font->format == PDF_FONTTYPE_COMPOSITE) ? 1 : 0;
 
+  /* The current position was advanced in the old writing mode. */
+  if (text_state.font_id < 0 || CURRENTFONT()->wmode != font->wmode)
+    text_state.at_offset = 0;
+
   vert_font  = font->wmode ? 1 : 0;
   if (dev_param.autorotate) {
     vert_dir = text_state.dir_mode;
@@ -926,8 +995,22 @@ texpdf_dev_get_font_wmode (int font_id)
   return 0;
 }
 
-static unsigned char sbuf0[FORMAT_BUF_SIZE];
-static unsigned char sbuf1[FORMAT_BUF_SIZE];
+/*
+ * Scratch buffers for converted strings. They grow to the longest
+ * string seen and are kept until texpdf_close_device().
+ */
+static unsigned char *sbuf0 = NULL, *sbuf1 = NULL;
+static int            sbuf0_size = 0, sbuf1_size = 0;
+
+static unsigned char *
+sbuf_reserve (unsigned char **buf, int *size, int need)
+{
+  if (need > *size) {
+    *size = MAX(need, 2 * *size);
+    *buf  = RENEW(*buf, *size, unsigned char);
+  }
+  return *buf;
+}
 
 static int
 handle_multibyte_string (struct dev_font *font,
@@ -942,8 +1025,8 @@ handle_multibyte_string (struct dev_font *font,
   if (ctype == -1 && font->cff_charsets) { /* freetype glyph indexes */
     /* Convert freetype glyph indexes to CID. */
     const unsigned char *inbuf = p;
-    unsigned char *outbuf = sbuf0;
-    for (i = 0; i < length; i += 2) {
+    unsigned char *outbuf = sbuf_reserve(&sbuf0, &sbuf0_size, length);
+    for (i = 0; i + 1 < length; i += 2) {
       unsigned int gid;
       gid = *inbuf++ << 8;
       gid += *inbuf++;
@@ -960,10 +1043,7 @@ handle_multibyte_string (struct dev_font *font,
   /* _FIXME_ */
   else if (font->is_unicode) { /* UCS-4 */
     if (ctype == 1) {
-      if (length * 4 >= FORMAT_BUF_SIZE) {
-        WARN("Too long string...");
-        return -1;
-      }
+      sbuf_reserve(&sbuf1, &sbuf1_size, length * 4);
       for (i = 0; i < length; i++) {
         sbuf1[i*4  ] = font->ucs_group;
         sbuf1[i*4+1] = font->ucs_plane;
@@ -974,10 +1054,7 @@ handle_multibyte_string (struct dev_font *font,
     } else if (ctype == 2) {
       int len = 0;
 
-      if (length * 2 >= FORMAT_BUF_SIZE) {
-        WARN("Too long string...");
-        return -1;
-      }
+      sbuf_reserve(&sbuf1, &sbuf1_size, length * 2 + 4);
       for (i = 0; i < length; i += 2, len += 4) {
         sbuf1[len  ] = font->ucs_group;
         if ((p[i] & 0xf8) == 0xd8) {
@@ -1004,10 +1081,7 @@ handle_multibyte_string (struct dev_font *font,
     /* Omega workaround...
      * Translate single-byte chars to double byte code space.
      */
-    if (length * 2 >= FORMAT_BUF_SIZE) {
-      WARN("Too long string...");
-      return -1;
-    }
+    sbuf_reserve(&sbuf1, &sbuf1_size, length * 2);
     for (i = 0; i < length; i++) {
       sbuf1[i*2  ] = (font->mapc & 0xff);
       sbuf1[i*2+1] = p[i];
@@ -1030,12 +1104,19 @@ handle_multibyte_string (struct dev_font *font,
     unsigned char *outbuf;
     long           inbytesleft, outbytesleft;
     CMap          *cmap;
+    int            size;
 
+    /*
+     * Every code consumes at least one byte and yields at most
+     * OUTBYTES_MAX bytes, or two for an undefined one, so this is
+     * enough to decode the whole string in one pass.
+     */
     cmap         = texpdf_CMap_cache_get(font->enc_id);
+    size         = length * MAX(CMap_get_profile(cmap, CMAP_PROF_TYPE_OUTBYTES_MAX), 2);
     inbuf        = p;
-    outbuf       = sbuf0;
+    outbuf       = sbuf_reserve(&sbuf0, &sbuf0_size, MAX(size, 1));
     inbytesleft  = length;
-    outbytesleft = FORMAT_BUF_SIZE;
+    outbytesleft = size;
 
     texpdf_CMap_decode(cmap,
                 &inbuf, &inbytesleft, &outbuf, &outbytesleft);
@@ -1043,7 +1124,7 @@ handle_multibyte_string (struct dev_font *font,
       WARN("CMap conversion failed. (%d bytes remains)", inbytesleft);
       return -1;
     }
-    length  = FORMAT_BUF_SIZE - outbytesleft;
+    length  = size - outbytesleft;
     p       = sbuf0;
   }
 
@@ -1083,6 +1164,138 @@ void texpdf_dev_pop_coord(void)
   if (num_dev_coords > 0) num_dev_coords--;
 }
 
+/*
+ * Move to XPOS, YPOS for the next string of FONT. This starts a new
+ * text object or string if the distance is too large; otherwise it
+ * appends a kern to BUF. BUF holds LEN bytes of pending string output
+ * and is flushed before anything else is written. Returns the new
+ * length of BUF.
+ */
+static int
+dev_string_position (pdf_doc *p, struct dev_font *font,
+                     spt_t xpos, spt_t ypos, char *buf, int len)
+{
+  spt_t kern, delh, delv;
+  int   rise;
+
+  /*
+   * Kern is in units of character units, i.e., 1000 = 1 em.
+   *
+   * Positive kern means kerning (reduce excess white space).
+   *
+   * The following formula is of the form a*x/b where a, x, and b are signed long
+   * integers.  Since in integer arithmetic (a*x) could overflow and a*(x/b) would
+   * not be accurate, we use floating point arithmetic rather than trying to do
+   * this all with integer arithmetic.
+   *
+   * 1000.0 / (font->extend * font->sptsize) is caluculated each times...
+   * Is accuracy really a matter? Character widths are always rounded to integer
+   * (in 1000 units per em) but dvipdfmx does not take into account of this...
+   */
+
+  if (text_state.dir_mode==0) {
+    /* Left-to-right */
+    delh = text_state.ref_x + text_state.offset - xpos;
+    delv = ypos - text_state.ref_y;
+  } else if (text_state.dir_mode==1) {
+    /* Top-to-bottom */
+    delh = ypos - text_state.ref_y + text_state.offset;
+    delv = xpos - text_state.ref_x;
+  } else {
+    /* Bottom-to-top */
+    delh = ypos + text_state.ref_y + text_state.offset;
+    delv = xpos + text_state.ref_x;
+  }
+
+  /* White-space more than 3em is not considered as a part of single text.
+   * So we will break string mode in that case.
+   * Dvipdfmx spend most of time processing strings with kern = 0 (but far
+   * more times in font handling).
+   * You may want to use pre-calculated value for WORD_SPACE_MAX.
+   * More text compression may be possible by replacing kern with space char
+   * when -kern is equal to space char width.
+   */
+#define WORD_SPACE_MAX(f) (spt_t) (3.0 * (f)->extend * (f)->sptsize)
+
+  /*
+   * Small vertical shifts of upright, unslanted horizontal text are
+   * made with text rise instead of starting a new line, as long as
+   * they stay within an em of the line.
+   */
+  rise = labs(delv - text_state.raise) > dev_unit.min_bp_val;
+  if (rise &&
+      (text_state.dir_mode != 0 ||
+       text_state.matrix.rotate != TEXT_WMODE_HH ||
+       text_state.matrix.slant  != 0.0 ||
+       labs(delv) >= font->sptsize)) {
+    rise = -1;
+  }
+
+  if (motion_state == GRAPHICS_MODE ||
+      text_state.force_reset ||
+      !text_state.at_offset ||
+      rise < 0 ||
+      labs(delh) > WORD_SPACE_MAX(font)) {
+    if (len > 0)
+      texpdf_doc_add_page_content(p, buf, len);
+    len = 0;
+    text_mode(p);
+    string_mode(p, xpos, ypos,
+                font->slant, font->extend, text_state.matrix.rotate);
+    return len;
+  }
+
+  /* Inaccucary introduced by rounding of character width appears within
+   * single text block. There are point_size/1000 rounding error per character.
+   * If you really care about accuracy, you should compensate this here too.
+   */
+  kern = (spt_t) (1000.0 / font->extend * delh / font->sptsize);
+  if (kern != 0) {
+    /*
+     * Same issues as earlier. Use floating point for simplicity.
+     * This routine needs to be fast, so we don't call sprintf() or strcpy().
+     */
+    text_state.offset -=
+      (spt_t) (kern * font->extend * (font->sptsize / 1000.0));
+  }
+
+  if (motion_state == STRING_MODE && !rise) {
+    if (kern != 0) {
+      buf[len++] = text_state.is_mb ? '>' : ')';
+      len += p_itoa(font->wmode ? -kern : kern, buf + len);
+      buf[len++] = text_state.is_mb ? '<' : '(';
+    }
+    return len;
+  }
+
+  /*
+   * Otherwise a new array is started where the last one ended, or
+   * where the text state was last set, with no Td in between.
+   */
+  if (motion_state == STRING_MODE) {
+    buf[len++] = text_state.is_mb ? '>' : ')';
+    buf[len++] = ']';
+    buf[len++] = 'T';
+    buf[len++] = 'J';
+  }
+  if (rise) {
+    buf[len++] = ' ';
+    len += dev_sprint_bp(buf + len, delv, NULL);
+    buf[len++] = ' ';
+    buf[len++] = 'T';
+    buf[len++] = 's';
+    text_state.raise = delv;
+  }
+  buf[len++] = '[';
+  if (kern != 0)
+    len += p_itoa(font->wmode ? -kern : kern, buf + len);
+  buf[len++] = text_state.is_mb ? '<' : '(';
+  motion_state     = STRING_MODE;
+  text_state.shown = 1;
+
+  return len;
+}
+
 /*
  * ctype:
 #ifdef XETEX
@@ -1105,10 +1318,7 @@ texpdf_dev_set_string (pdf_doc *p, spt_t xpos, spt_t ypos,
   struct dev_font *font;
   struct dev_font *real_font;
   const unsigned char *str_ptr; /* Pointer to the reencoded string. */
-  int              length, i, len = 0;
-  spt_t            kern, delh, delv;
-  spt_t            text_xorigin;
-  spt_t            text_yorigin;
+  int              length, i, len;
 
   if (font_id < 0 || font_id >= num_dev_fonts) {
     ERROR("Invalid font: %d (%d)", font_id, num_dev_fonts);
@@ -1129,9 +1339,6 @@ texpdf_dev_set_string (pdf_doc *p, spt_t xpos, spt_t ypos,
   else
     real_font = font;
 
-  text_xorigin = text_state.ref_x;
-  text_yorigin = text_state.ref_y;
-
   str_ptr = instr_ptr;
   length  = instr_len;
 
@@ -1158,98 +1365,142 @@ texpdf_dev_set_string (pdf_doc *p, spt_t xpos, spt_t ypos,
     ypos -= bpt2spt(dev_coords[num_dev_coords-1].y);
   }
 
-  /*
-   * Kern is in units of character units, i.e., 1000 = 1 em.
-   *
-   * Positive kern means kerning (reduce excess white space).
-   *
-   * The following formula is of the form a*x/b where a, x, and b are signed long
-   * integers.  Since in integer arithmetic (a*x) could overflow and a*(x/b) would
-   * not be accurate, we use floating point arithmetic rather than trying to do
-   * this all with integer arithmetic.
-   *
-   * 1000.0 / (font->extend * font->sptsize) is caluculated each times...
-   * Is accuracy really a matter? Character widths are always rounded to integer
-   * (in 1000 units per em) but dvipdfmx does not take into account of this...
-   */
+  len = dev_string_position(p, font, xpos, ypos, format_buffer, 0);
 
-  if (text_state.dir_mode==0) {
-    /* Left-to-right */
-    delh = text_xorigin + text_state.offset - xpos;
-    delv = ypos - text_yorigin;
-  } else if (text_state.dir_mode==1) {
-    /* Top-to-bottom */
-    delh = ypos - text_yorigin + text_state.offset;
-    delv = xpos - text_xorigin;
-  } else {
-    /* Bottom-to-top */
-    delh = ypos + text_yorigin + text_state.offset;
-    delv = xpos + text_xorigin;
-  }
+  /* Long strings are written out in as many pieces as format_buffer needs. */
+  i = 0;
+  do {
+    int n;
 
-  /* White-space more than 3em is not considered as a part of single text.
-   * So we will break string mode in that case.
-   * Dvipdfmx spend most of time processing strings with kern = 0 (but far
-   * more times in font handling).
-   * You may want to use pre-calculated value for WORD_SPACE_MAX.
-   * More text compression may be possible by replacing kern with space char
-   * when -kern is equal to space char width.
-   */
-#define WORD_SPACE_MAX(f) (spt_t) (3.0 * (f)->extend * (f)->sptsize)
+    if (text_state.is_mb) {
+      n    = MIN(length - i, (FORMAT_BUF_SIZE - len) / 2);
+      len += pdfobj_hex_str(format_buffer + len,
+                            FORMAT_BUF_SIZE - len, str_ptr + i, n);
+    } else {
+      n    = MIN(length - i, (FORMAT_BUF_SIZE - len) / 4);
+      len += pdfobj_escape_str(format_buffer + len,
+                               FORMAT_BUF_SIZE - len, str_ptr + i, n);
+    }
+    texpdf_doc_add_page_content(p, format_buffer, len);  /* op: */
+    i  += n;
+    len = 0;
+  } while (i < length);
 
-  if (text_state.force_reset ||
-      labs(delv) > dev_unit.min_bp_val ||
-      labs(delh) > WORD_SPACE_MAX(font)) {
-    text_mode(p);
-    kern = 0;
-  } else {
-    kern = (spt_t) (1000.0 / font->extend * delh / font->sptsize);
+  text_state.offset += width;
+}
+
+/*
+ * A glyph run only switches fonts and updates used_chars once. All
+ * positioning goes through dev_string_position(), as it does for
+ * texpdf_dev_set_string(), so the output is the same. The run is
+ * collected in format_buffer and written when the buffer is nearly
+ * full or the text has to be repositioned.
+ */
+#define GLYPH_OUTPUT_MAX 64  /* kern, rise and one glyph */
+
+void
+texpdf_dev_set_glyphs (pdf_doc *p, spt_t xpos, spt_t ypos,
+                       const unsigned short *glyphs,
+                       const spt_t *advances, const spt_t *offsets,
+                       int num_glyphs, int font_id)
+{
+  static const char hex[] = "0123456789abcdef";
+  struct dev_font *font;
+  struct dev_font *real_font;
+  int              i, len = 0;
+
+  if (font_id < 0 || font_id >= num_dev_fonts) {
+    ERROR("Invalid font: %d (%d)", font_id, num_dev_fonts);
+    return;
   }
 
-  /* Inaccucary introduced by rounding of character width appears within
-   * single text block. There are point_size/1000 rounding error per character.
-   * If you really care about accuracy, you should compensate this here too.
+  /*
+   * Simple fonts need the byte handling of texpdf_dev_set_string().
+   * Without XETEX, it also runs glyph ids through the encoding CMap of
+   * a composite font, which only leaves them alone for Identity CMaps.
    */
-  if (motion_state != STRING_MODE)
-    string_mode(p, xpos, ypos,
-                font->slant, font->extend, text_state.matrix.rotate);
-  else if (kern != 0) {
-    /*
-     * Same issues as earlier. Use floating point for simplicity.
-     * This routine needs to be fast, so we don't call sprintf() or strcpy().
-     */
-    text_state.offset -= 
-      (spt_t) (kern * font->extend * (font->sptsize / 1000.0));
-    format_buffer[len++] = text_state.is_mb ? '>' : ')';
-    if (font->wmode)
-      len += p_itoa(-kern, format_buffer + len);
-    else {
-      len += p_itoa( kern, format_buffer + len);
+  font = GET_FONT(font_id);
+  if (font->format != PDF_FONTTYPE_COMPOSITE
+#ifndef XETEX
+      || (font->enc_id >= 0 &&
+          CMap_get_type(texpdf_CMap_cache_get(font->enc_id)) != CMAP_TYPE_IDENTITY)
+#endif
+      ) {
+    for (i = 0; i < num_glyphs; i++) {
+      unsigned char code[2];
+      int    length = 0;
+      spt_t  x = xpos, y = ypos;
+
+      if (font->format == PDF_FONTTYPE_COMPOSITE) {
+        code[length++] = glyphs[i] >> 8;
+        code[length++] = glyphs[i] & 0xff;
+      } else if (glyphs[i] > 0xff) {
+        WARN("Glyph %u out of range for simple font (font_id=%d)",
+             glyphs[i], font_id);
+      } else {
+        code[length++] = glyphs[i] & 0xff;
+      }
+      if (length > 0) {
+        if (offsets) {
+          x += offsets[2*i];
+          y += offsets[2*i+1];
+        }
+        texpdf_dev_set_string(p, x, y, code, length, advances[i], font_id, -1);
+      }
+      if (text_state.dir_mode)
+        ypos -= advances[i];
+      else
+        xpos += advances[i];
     }
-    format_buffer[len++] = text_state.is_mb ? '<' : '(';
-    texpdf_doc_add_page_content(p, format_buffer, len);  /* op: */
-    len = 0;
+    return;
   }
 
-  if (text_state.is_mb) {
-    if (FORMAT_BUF_SIZE - len < 2 * length)
-      ERROR("Buffer overflow...");
-    for (i = 0; i < length; i++) {
-      int first, second;
+  if (font_id != text_state.font_id) {
+    dev_set_font(p, font_id);
+  }
+  font = CURRENTFONT();
 
-      first  = (str_ptr[i] >> 4) & 0x0f;
-      second = str_ptr[i] & 0x0f;
-      format_buffer[len++] = ((first >= 10)  ? first  + 'W' : first  + '0');
-      format_buffer[len++] = ((second >= 10) ? second + 'W' : second + '0');
-    }
-  } else {
-    len += pdfobj_escape_str(format_buffer + len,
-                             FORMAT_BUF_SIZE - len, str_ptr, length);
+  if (font->real_font_index >= 0)
+    real_font = GET_FONT(font->real_font_index);
+  else
+    real_font = font;
+
+  if (num_dev_coords > 0) {
+    xpos -= bpt2spt(dev_coords[num_dev_coords-1].x);
+    ypos -= bpt2spt(dev_coords[num_dev_coords-1].y);
   }
-  /* I think if you really care about speed, you should avoid memcopy here. */
-  texpdf_doc_add_page_content(p, format_buffer, len);  /* op: */
 
-  text_state.offset += width;
+  for (i = 0; i < num_glyphs; i++) {
+    unsigned int cid = glyphs[i];
+    spt_t        x = xpos, y = ypos;
+
+    if (font->cff_charsets)
+      cid = cff_charsets_lookup_cid(font->cff_charsets, cid);
+    if (real_font->used_chars != NULL)
+      add_to_used_chars2(real_font->used_chars, cid);
+
+    if (offsets) {
+      x += offsets[2*i];
+      y += offsets[2*i+1];
+    }
+    if (len > FORMAT_BUF_SIZE - GLYPH_OUTPUT_MAX) {
+      texpdf_doc_add_page_content(p, format_buffer, len);  /* op: */
+      len = 0;
+    }
+    len = dev_string_position(p, font, x, y, format_buffer, len);
+    format_buffer[len++] = hex[(cid >> 12) & 0x0f];
+    format_buffer[len++] = hex[(cid >>  8) & 0x0f];
+    format_buffer[len++] = hex[(cid >>  4) & 0x0f];
+    format_buffer[len++] = hex[ cid        & 0x0f];
+
+    text_state.offset += advances[i];
+    if (text_state.dir_mode)
+      ypos -= advances[i];
+    else
+      xpos += advances[i];
+  }
+  if (len > 0)
+    texpdf_doc_add_page_content(p, format_buffer, len);  /* op: */
 }
 
 void
@@ -1302,6 +1553,10 @@ texpdf_close_device (void)
     RELEASE(dev_fonts);
   }
   if (dev_coords) RELEASE(dev_coords);
+  if (sbuf0) RELEASE(sbuf0);
+  if (sbuf1) RELEASE(sbuf1);
+  sbuf0 = sbuf1 = NULL;
+  sbuf0_size = sbuf1_size = 0;
   texpdf_dev_clear_gstates();
 }
 
@@ -156,6 +156,23 @@ extern void   texpdf_dev_set_string (pdf_doc *p, spt_t xpos, spt_t ypos,
 				  spt_t text_width,
 				  int   font_id, int ctype);
 
+/** Output a run of glyphs to the page
+
+Sets `num_glyphs` glyphs of `font_id` as `texpdf_dev_set_string` would
+if called once for each glyph with ctype -1, but in a single pass that
+writes one `TJ` array. The first glyph is placed at `xpos`, `ypos`.
+After each glyph the pen moves by `advances[i]` along the text
+direction. `advances` are scaled like `text_width` above. If
+`offsets` is not NULL, it holds an x and a y displacement for each
+glyph (`2 * num_glyphs` values) that is added to the pen position.
+
+*/
+
+extern void   texpdf_dev_set_glyphs (pdf_doc *p, spt_t xpos, spt_t ypos,
+				  const unsigned short *glyphs,
+				  const spt_t *advances, const spt_t *offsets,
+				  int num_glyphs, int font_id);
+
 /** Output a line to the page
 
 This outputs a line in the current stoke and fill colors (see pdfcolor.h).
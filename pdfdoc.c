@@ -35,6 +35,7 @@
 #define PDFDOC_PAGES_ALLOC_SIZE   128u
 #define PDFDOC_ARTICLE_ALLOC_SIZE 16
 #define PDFDOC_BEAD_ALLOC_SIZE    16
+#define PDFDOC_ARENA_CHUNK_SIZE   65536u
 
 /* XXX Need to eliminate statics if this is going to be reentrant! */
 static int verbose = 0;
@@ -129,7 +130,8 @@ pdf_doc_init_catalog (pdf_doc *p)
   p->root.threads    = NULL;
   
   p->root.dict = texpdf_new_dict();
-  texpdf_set_root(p->root.dict);
+  if (!p->update.file)
+    texpdf_set_root(p->root.dict);
 
   return;
 }
@@ -211,6 +213,7 @@ doc_resize_page_entries (pdf_doc *p, long size)
       p->pages.entries[i].content_refs[3] = NULL; /* global eop */
       p->pages.entries[i].annots    = NULL;
       p->pages.entries[i].beads     = NULL;
+      p->pages.entries[i].parent_ref = NULL;
     }
     p->pages.max_entries = size;
   }
@@ -266,6 +269,7 @@ texpdf_doc_set_bop_content (pdf_doc *p, const char *content, unsigned length)
 
   if (length > 0) {
     p->pages.bop = texpdf_new_stream(STREAM_COMPRESS);
+    texpdf_stream_set_class(p->pages.bop, STREAM_CLASS_CONTENT);
     texpdf_add_stream(p->pages.bop, content, length);
   } else {
     p->pages.bop = NULL;
@@ -284,6 +288,7 @@ texpdf_doc_set_eop_content (pdf_doc *p, const char *content, unsigned length)
 
   if (length > 0) {
     p->pages.eop = texpdf_new_stream(STREAM_COMPRESS);
+    texpdf_stream_set_class(p->pages.eop, STREAM_CLASS_CONTENT);
     texpdf_add_stream(p->pages.eop, content, length);
   } else {
     p->pages.eop = NULL;
@@ -351,7 +356,8 @@ static void
 pdf_doc_init_docinfo (pdf_doc *p)
 {
   p->info = texpdf_new_dict();
-  texpdf_set_info(p->info);
+  if (!p->update.file)
+    texpdf_set_info(p->info);
 
   return;
 }
@@ -467,6 +473,12 @@ texpdf_doc_add_page_resource (pdf_doc *p, const char *category,
     WARN("Passed non indirect reference...");
     resource_ref = texpdf_ref_obj(resource_ref); /* leak */
   }
+  /*
+   * Resource dicts are written and released when the page or form is
+   * finished, so they can come from the page arena. Fonts, images and
+   * other objects referred to here are long-lived and do not.
+   */
+  texpdf_obj_set_arena(p->arena);
   resources = texpdf_doc_get_page_resources(p, category);
   duplicate = texpdf_lookup_dict(resources, resource_name);
   if (duplicate && pdf_compare_reference(duplicate, resource_ref)) {
@@ -477,6 +489,7 @@ texpdf_doc_add_page_resource (pdf_doc *p, const char *category,
   } else {
     texpdf_add_dict(resources, texpdf_new_name(resource_name), resource_ref);
   }
+  texpdf_obj_set_arena(NULL);
 
   return;
 }
@@ -487,6 +500,10 @@ doc_flush_page (pdf_doc *p, pdf_page *page, pdf_obj *parent_ref)
   pdf_obj *contents_array;
   int      count;
 
+  /* When updating, the file holds on to the page until it is closed */
+  if (!p->update.file)
+    texpdf_obj_set_arena(p->arena);
+
   texpdf_add_dict(page->page_obj,
                texpdf_new_name("Type"), texpdf_new_name("Page"));
   texpdf_add_dict(page->page_obj,
@@ -570,6 +587,9 @@ doc_flush_page (pdf_doc *p, pdf_page *page, pdf_obj *parent_ref)
   page->annots   = NULL;
   page->beads    = NULL;
 
+  texpdf_obj_set_arena(NULL);
+  texpdf_arena_reset(p->arena);
+
   return;
 }
 
@@ -705,11 +725,20 @@ pdf_doc_close_page_tree (pdf_doc *p)
   }
 
   /*
-   * Connect page tree to root node.
+   * Connect page tree to root node, or replaced pages to their parents.
    */
-  page_tree_root = build_page_tree(p, FIRSTPAGE(p), PAGECOUNT(p), NULL);
-  texpdf_merge_dict (p->root.pages, page_tree_root);
-  texpdf_release_obj(page_tree_root);
+  if (p->update.file) {
+    for (page_no = 1; page_no <= PAGECOUNT(p); page_no++) {
+      pdf_page *page = doc_get_page_entry(p, page_no);
+
+      doc_flush_page(p, page, page->parent_ref);
+      page->parent_ref = NULL;
+    }
+  } else {
+    page_tree_root = build_page_tree(p, FIRSTPAGE(p), PAGECOUNT(p), NULL);
+    texpdf_merge_dict (p->root.pages, page_tree_root);
+    texpdf_release_obj(page_tree_root);
+  }
 
   /* They must be after build_page_tree() */
   if (p->pages.bop) {
@@ -724,16 +753,18 @@ pdf_doc_close_page_tree (pdf_doc *p)
   }
 
   /* Create media box at root node and let the other pages inherit it. */
-  mediabox = texpdf_new_array();
-  texpdf_add_array(mediabox, texpdf_new_number(ROUND(p->pages.mediabox.llx, 0.01)));
-  texpdf_add_array(mediabox, texpdf_new_number(ROUND(p->pages.mediabox.lly, 0.01)));
-  texpdf_add_array(mediabox, texpdf_new_number(ROUND(p->pages.mediabox.urx, 0.01)));
-  texpdf_add_array(mediabox, texpdf_new_number(ROUND(p->pages.mediabox.ury, 0.01)));
-  texpdf_add_dict(p->root.pages, texpdf_new_name("MediaBox"), mediabox);
+  if (!p->update.file) {
+    mediabox = texpdf_new_array();
+    texpdf_add_array(mediabox, texpdf_new_number(ROUND(p->pages.mediabox.llx, 0.01)));
+    texpdf_add_array(mediabox, texpdf_new_number(ROUND(p->pages.mediabox.lly, 0.01)));
+    texpdf_add_array(mediabox, texpdf_new_number(ROUND(p->pages.mediabox.urx, 0.01)));
+    texpdf_add_array(mediabox, texpdf_new_number(ROUND(p->pages.mediabox.ury, 0.01)));
+    texpdf_add_dict(p->root.pages, texpdf_new_name("MediaBox"), mediabox);
 
-  texpdf_add_dict(p->root.dict,
-               texpdf_new_name("Pages"),
-               texpdf_ref_obj (p->root.pages));
+    texpdf_add_dict(p->root.dict,
+                 texpdf_new_name("Pages"),
+                 texpdf_ref_obj (p->root.pages));
+  }
   texpdf_release_obj(p->root.pages);
   p->root.pages  = NULL;
 
@@ -800,141 +831,51 @@ pdf_doc_close_page_tree (pdf_doc *p)
 pdf_obj *
 texpdf_doc_get_page (pdf_file *pf, long page_no, long *count_p,
 		  pdf_rect *bbox, pdf_obj **resources_p) {
-  pdf_obj *page_tree = NULL;
-  pdf_obj *resources = NULL, *box = NULL, *rotate = NULL;
-  pdf_obj *catalog;
-
-  catalog = pdf_file_get_catalog(pf);
-
-  page_tree = pdf_deref_obj(texpdf_lookup_dict(catalog, "Pages"));
-
-  if (!PDF_OBJ_DICTTYPE(page_tree))
-    goto error;
-
-  {
-    long count;
-    pdf_obj *tmp = pdf_deref_obj(texpdf_lookup_dict(page_tree, "Count"));
-    if (!PDF_OBJ_NUMBERTYPE(tmp)) {
-      if (tmp)
-	texpdf_release_obj(tmp);
-      goto error;
-    }
-    count = texpdf_number_value(tmp);
-    texpdf_release_obj(tmp);
-    if (count_p)
-      *count_p = count;
-    if (page_no <= 0 || page_no > count) {
-	WARN("Page %ld does not exist.", page_no);
-	goto error_silent;
-      }
-  }
+  pdf_obj *page_obj = NULL;
+  pdf_obj *resources = NULL, *box = NULL;
+  const pdf_file_page *page;
+  long count;
 
   /*
-   * Seek correct page. Get MediaBox, CropBox and Resources.
-   * (Note that these entries can be inherited.)
+   * The page index of PF has MediaBox, CropBox, Rotate and Resources
+   * already resolved. (Note that these entries can be inherited.)
    */
-  {
-    pdf_obj *media_box = NULL, *crop_box = NULL, *kids, *tmp;
-    int depth = PDF_OBJ_MAX_DEPTH;
-    long page_idx = page_no-1, kids_length = 1, i = 0;
-
-    while (--depth && i != kids_length) {
-      if ((tmp = pdf_deref_obj(texpdf_lookup_dict(page_tree, "MediaBox")))) {
-	if (media_box)
-	  texpdf_release_obj(media_box);
-	media_box = tmp;
-      }
-
-      if ((tmp = pdf_deref_obj(texpdf_lookup_dict(page_tree, "CropBox")))) {
-	if (crop_box)
-	  texpdf_release_obj(crop_box);
-	crop_box = tmp;
-      }
-
-      if ((tmp = pdf_deref_obj(texpdf_lookup_dict(page_tree, "Rotate")))) {
-	if (rotate)
-	  texpdf_release_obj(rotate);
-	rotate = tmp;
-      }
-
-      if ((tmp = pdf_deref_obj(texpdf_lookup_dict(page_tree, "Resources")))) {
-	if (resources)
-	  texpdf_release_obj(resources);
-	resources = tmp;
-      }
-
-      kids = pdf_deref_obj(texpdf_lookup_dict(page_tree, "Kids"));
-      if (!kids)
-	break;
-      else if (!PDF_OBJ_ARRAYTYPE(kids)) {
-	texpdf_release_obj(kids);
-	goto error;
-      }
-      kids_length = texpdf_array_length(kids);
-
-      for (i = 0; i < kids_length; i++) {
-	long count;
-
-	texpdf_release_obj(page_tree);
-	page_tree = pdf_deref_obj(texpdf_get_array(kids, i));
-	if (!PDF_OBJ_DICTTYPE(page_tree))
-	  goto error;
-
-	tmp = pdf_deref_obj(texpdf_lookup_dict(page_tree, "Count"));
-	if (PDF_OBJ_NUMBERTYPE(tmp)) {
-	  /* Pages object */
-	  count = texpdf_number_value(tmp);
-	  texpdf_release_obj(tmp);
-	} else if (!tmp)
-	  /* Page object */
-	  count = 1;
-	else {
-	  texpdf_release_obj(tmp);
-	  goto error;
-	}
-
-	if (page_idx < count)
-	  break;
-
-	page_idx -= count;
-      }
-      
-      texpdf_release_obj(kids);
-    }
+  count = pdf_file_get_page_count(pf);
+  if (count < 0)
+    goto error;
+  if (count_p)
+    *count_p = count;
+  if (page_no <= 0 || page_no > count) {
+    WARN("Page %ld does not exist.", page_no);
+    goto error_silent;
+  }
+  page = pdf_file_get_page(pf, page_no - 1);
+  if (!page)
+    goto error;
 
-    if (!depth || kids_length == i) {
-      if (media_box)
-	texpdf_release_obj(media_box);
-     if (crop_box)
-	texpdf_release_obj(crop_box);
-      goto error;
-    }
+  page_obj = pdf_deref_obj(page->ref);
+  if (!PDF_OBJ_DICTTYPE(page_obj))
+    goto error;
 
-    if (crop_box)
-      box = crop_box;
-    else
-      if (!(box = pdf_deref_obj(texpdf_lookup_dict(page_tree, "ArtBox"))) &&
-	  !(box = pdf_deref_obj(texpdf_lookup_dict(page_tree, "TrimBox"))) &&
-	  !(box = pdf_deref_obj(texpdf_lookup_dict(page_tree, "BleedBox"))) &&
-	  media_box) {
-	  box = media_box;
-	  media_box = NULL;
-      }
-    if (media_box)
-      texpdf_release_obj(media_box);
-  }
+  if (page->crop_box)
+    box = texpdf_link_obj(page->crop_box);
+  else
+    if (!(box = pdf_deref_obj(texpdf_lookup_dict(page_obj, "ArtBox"))) &&
+	!(box = pdf_deref_obj(texpdf_lookup_dict(page_obj, "TrimBox"))) &&
+	!(box = pdf_deref_obj(texpdf_lookup_dict(page_obj, "BleedBox"))) &&
+	page->media_box)
+      box = texpdf_link_obj(page->media_box);
 
   if (!PDF_OBJ_ARRAYTYPE(box) || texpdf_array_length(box) != 4 ||
-      !PDF_OBJ_DICTTYPE(resources))
+      !PDF_OBJ_DICTTYPE(page->resources))
     goto error;
+  resources = texpdf_link_obj(page->resources);
 
-  if (PDF_OBJ_NUMBERTYPE(rotate)) {
-    if (texpdf_number_value(rotate))
+  if (PDF_OBJ_NUMBERTYPE(page->rotate)) {
+    if (texpdf_number_value(page->rotate))
       WARN("<< /Rotate %d >> found. (Not supported yet)", 
-	   (int) texpdf_number_value(rotate));
-    texpdf_release_obj(rotate);
-    rotate = NULL;
-  } else if (rotate)
+	   (int) texpdf_number_value(page->rotate));
+  } else if (page->rotate)
     goto error;
 
   {
@@ -965,19 +906,17 @@ texpdf_doc_get_page (pdf_file *pf, long page_no, long *count_p,
   else if (resources)
     texpdf_release_obj(resources);
 
-  return page_tree;
+  return page_obj;
 
  error:
   WARN("Cannot parse document. Broken PDF file?");
  error_silent:
   if (box)
     texpdf_release_obj(box);
-  if (rotate)
-    texpdf_release_obj(rotate);
   if (resources)
     texpdf_release_obj(resources);
-  if (page_tree)
-    texpdf_release_obj(page_tree);
+  if (page_obj)
+    texpdf_release_obj(page_obj);
 
   return NULL;
 }
@@ -1996,6 +1935,68 @@ texpdf_doc_get_reference (pdf_doc *p, const char *category)
   return ref;
 }
 
+/* Get the media box of a page of the file being updated */
+static int
+doc_update_mediabox (pdf_doc *p, long page_no, pdf_rect *mediabox)
+{
+  const pdf_file_page *page = pdf_file_get_page(p->update.file, page_no - 1);
+  double   v[4];
+  int      i;
+
+  if (!page || !PDF_OBJ_ARRAYTYPE(page->media_box) ||
+      texpdf_array_length(page->media_box) != 4)
+    return -1;
+  for (i = 0; i < 4; i++) {
+    pdf_obj *value = pdf_deref_obj(texpdf_get_array(page->media_box, i));
+
+    if (!PDF_OBJ_NUMBERTYPE(value)) {
+      texpdf_release_obj(value);
+      return -1;
+    }
+    v[i] = texpdf_number_value(value);
+    texpdf_release_obj(value);
+  }
+  mediabox->llx = v[0]; mediabox->lly = v[1];
+  mediabox->urx = v[2]; mediabox->ury = v[3];
+
+  return 0;
+}
+
+/*
+ * Make PAGE take the place of the page chosen by texpdf_doc_replace_page()
+ * in the file being updated: it gets the object number, the parent and,
+ * unless set already, the media box of that page.
+ */
+static void
+doc_replace_page (pdf_doc *p, pdf_page *page)
+{
+  const pdf_file_page *old;
+  pdf_obj *old_dict;
+
+  if (!p->update.page_no)
+    ERROR("No page to replace. Call texpdf_doc_replace_page() first.");
+  if (page->page_ref)
+    ERROR("Page replacing page %ld was referred to before it began.",
+          p->update.page_no);
+
+  old = pdf_file_get_page(p->update.file, p->update.page_no - 1);
+  old_dict = pdf_deref_obj(old->ref);
+  page->parent_ref = texpdf_link_obj(texpdf_lookup_dict(old_dict, "Parent"));
+  texpdf_release_obj(old_dict);
+  if (!page->parent_ref)
+    ERROR("Page %ld of the file being updated has no parent.", p->update.page_no);
+
+  if (!(page->flags & USE_MY_MEDIABOX) &&
+      doc_update_mediabox(p, p->update.page_no, &page->cropbox) == 0)
+    page->flags |= USE_MY_MEDIABOX;
+
+  page->page_obj = texpdf_new_dict();
+  texpdf_update_obj(old->ref, texpdf_link_obj(page->page_obj));
+  page->page_ref = texpdf_ref_obj(page->page_obj);
+
+  p->update.page_no = 0;
+}
+
 static void
 pdf_doc_new_page (pdf_doc *p)
 {
@@ -2009,14 +2010,17 @@ pdf_doc_new_page (pdf_doc *p)
    * This is confusing. pdf_doc_finish_page() have increased page count!
    */
   currentpage = LASTPAGE(p);
-  /* Was this page already instantiated by a forward reference to it? */
-  if (!currentpage->page_ref) {
+  if (p->update.file) {
+    doc_replace_page(p, currentpage);
+  } else if (!currentpage->page_ref) {
+    /* Not yet instantiated by a forward reference to it */
     currentpage->page_obj = texpdf_new_dict();
     currentpage->page_ref = texpdf_ref_obj(currentpage->page_obj);
   }
 
   currentpage->background = NULL;
   currentpage->contents   = texpdf_new_stream(STREAM_COMPRESS);
+  texpdf_stream_set_class(currentpage->contents, STREAM_CLASS_CONTENT);
   currentpage->resources  = texpdf_new_dict();
 
   currentpage->annots = NULL;
@@ -2095,6 +2099,7 @@ pdf_doc_finish_page (pdf_doc *p)
      * ProcSet is obsolete in PDF-1.4 but recommended for compatibility.
      */
 
+    texpdf_obj_set_arena(p->arena);
     procset = texpdf_new_array ();
     texpdf_add_array(procset, texpdf_new_name("PDF"));
     texpdf_add_array(procset, texpdf_new_name("Text"));
@@ -2102,6 +2107,7 @@ pdf_doc_finish_page (pdf_doc *p)
     texpdf_add_array(procset, texpdf_new_name("ImageB"));
     texpdf_add_array(procset, texpdf_new_name("ImageI"));
     texpdf_add_dict(currentpage->resources, texpdf_new_name("ProcSet"), procset);
+    texpdf_obj_set_arena(NULL);
 
     texpdf_add_dict(currentpage->page_obj,
                  texpdf_new_name("Resources"),
@@ -2156,8 +2162,10 @@ doc_fill_page_background (pdf_doc *p)
   currentpage = LASTPAGE(p);
   ASSERT(currentpage);
 
-  if (!currentpage->background)
+  if (!currentpage->background) {
     currentpage->background = texpdf_new_stream(STREAM_COMPRESS);
+    texpdf_stream_set_class(currentpage->background, STREAM_CLASS_CONTENT);
+  }
 
   saved_content = currentpage->contents;
   currentpage->contents = currentpage->background;
@@ -2196,6 +2204,7 @@ texpdf_doc_end_page (pdf_doc *p)
   doc_fill_page_background(p);
 
   pdf_doc_finish_page(p);
+  texpdf_arena_reset(p->arena);
 
   return;
 }
@@ -2240,6 +2249,8 @@ texpdf_open_document (const char *filename,
   pdf_init(p);
   pdf_out_init(filename, do_encryption);
 
+  p->arena = texpdf_arena_new(PDFDOC_ARENA_CHUNK_SIZE);
+
   pdf_doc_init_catalog(p);
 
   p->opt.annot_grow = annot_grow_amount;
@@ -2285,6 +2296,54 @@ texpdf_open_document (const char *filename,
   return p;
 }
 
+pdf_doc *
+texpdf_open_document_update (const char *filename)
+{
+  pdf_doc *p = malloc(sizeof(pdf_doc));
+  pdf_rect mediabox = { 0.0, 0.0, 0.0, 0.0 };
+
+  pdf_init(p);
+  p->update.file = texpdf_update_begin(filename);
+  doc_update_mediabox(p, 1, &mediabox);
+
+  p->arena = texpdf_arena_new(PDFDOC_ARENA_CHUNK_SIZE);
+
+  pdf_doc_init_catalog(p);
+
+  texpdf_init_resources();
+  texpdf_init_colors();
+  texpdf_init_fonts();
+  texpdf_init_images();
+
+  pdf_doc_init_docinfo(p);
+
+  pdf_doc_init_bookmarks(p, 0);
+  pdf_doc_init_articles (p);
+  pdf_doc_init_names    (p, 0);
+  pdf_doc_init_page_tree(p, mediabox.urx, mediabox.ury);
+  p->pages.mediabox = mediabox;
+
+  texpdf_doc_set_bgcolor(p, NULL);
+
+  p->pending_forms = NULL;
+
+  return p;
+}
+
+void
+texpdf_doc_replace_page (pdf_doc *p, long page_no)
+{
+  ASSERT(p);
+
+  if (!p->update.file)
+    ERROR("No file is being updated.");
+  if (page_no < 1 || page_no > pdf_file_get_page_count(p->update.file) ||
+      !pdf_file_get_page(p->update.file, page_no - 1))
+    ERROR("Page %ld not found in the file being updated.", page_no);
+
+  p->update.page_no = page_no;
+}
+
 void
 texpdf_doc_set_creator (pdf_doc *p, const char *creator)
 {
@@ -2319,7 +2378,14 @@ texpdf_close_document (pdf_doc *p)
 
   texpdf_close_resources(); /* Should be at last. */
 
-  pdf_out_flush();
+  if (p->update.file) {
+    texpdf_update_end();
+    p->update.file = NULL;
+  } else
+    pdf_out_flush();
+
+  texpdf_arena_destroy(p->arena);
+  p->arena = NULL;
 
   if (thumb_basename)
     RELEASE(thumb_basename);
@@ -2419,6 +2485,7 @@ texpdf_doc_begin_grabbing (pdf_doc *p, const char *ident,
   form->cropbox.ury = ref_y + cropbox->ury;
 
   form->contents  = texpdf_new_stream(STREAM_COMPRESS);
+  texpdf_stream_set_class(form->contents, STREAM_CLASS_CONTENT);
   form->resources = texpdf_new_dict();
 
   texpdf_ximage_init_form_info(&info);
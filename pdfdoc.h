@@ -42,6 +42,13 @@ extern pdf_doc* texpdf_open_document (
 				    int check_gotos);
 extern void     texpdf_close_document (pdf_doc *p);
 
+/* Incremental update of FILENAME, a file written before. Each page
+ * begun after texpdf_doc_replace_page() replaces that page of the file;
+ * texpdf_close_document() appends the new objects and a new xref
+ * section. The catalog, Info and ID of the file are kept. */
+extern pdf_doc *texpdf_open_document_update (const char *filename);
+extern void     texpdf_doc_replace_page     (pdf_doc *p, long page_no);
+
 
 /* PDF document metadata */
 extern void     texpdf_doc_set_creator   (pdf_doc *p, const char *creator);
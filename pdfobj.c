@@ -30,6 +30,18 @@
 #include <zlib.h>
 #endif /* HAVE_ZLIB */
 
+#ifdef HAVE_LIBDEFLATE
+#include <libdeflate.h>
+#endif
+
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
+
+#if defined(HAVE_SYS_MMAN_H) && defined(HAVE_MMAP)
+#include <sys/mman.h>
+#endif
+
 #define STREAM_ALLOC_SIZE      4096u
 #define ARRAY_ALLOC_SIZE       256
 #define IND_OBJECTS_ALLOC_SIZE 512
@@ -40,6 +52,8 @@
 #define OBJ_NO_ENCRYPT  (1 << 1)
 /* Objects with this flag will not be encrypted.
    This implies OBJ_NO_OBJSTM if encryption is turned on.        */
+#define OBJ_IN_ARENA    (1 << 2)
+/* Object header and fixed-size payload come from obj_arena. */
 
 /* Any of these types can be represented as follows */
 struct pdf_obj 
@@ -70,9 +84,18 @@ struct pdf_string
   unsigned short length;
 };
 
+/*
+ * Names are interned: every spelling exists once and is shared by
+ * all name objects carrying it. An atom is freed with the last name
+ * object referring to it.
+ */
 struct pdf_name
 {
-  char *name;
+  char          *name;    /* NULL for the empty name */
+  unsigned long  hash;
+  unsigned long  refs;    /* name objects using it */
+  char          *escaped; /* "/name" as written, built on first use */
+  unsigned       escaped_length;
 };
 
 struct pdf_array
@@ -82,12 +105,40 @@ struct pdf_array
   struct pdf_obj **values;
 };
 
-struct pdf_dict
+struct pdf_dict_entry
 {
   struct pdf_obj  *key;
   struct pdf_obj  *value;
-  struct pdf_dict *next;
+  struct pdf_name *atom;  /* key->data */
+};
+
+/*
+ * Entries are kept in insertion order, which is also the order in
+ * which they are written. Small dictionaries are searched linearly;
+ * once a dictionary grows beyond DICT_HASH_THRESHOLD entries, an
+ * open-addressing index into the entry vector is maintained.
+ */
+struct pdf_dict
+{
+  unsigned long          size;
+  unsigned long          max;
+  struct pdf_dict_entry *entries;
+  unsigned long         *index;      /* position + 1, or 0 if empty */
+  unsigned long          index_size; /* power of 2, or 0 */
+};
+
+/*
+ * Input files are mapped into memory where possible. Objects are
+ * parsed in place and streams refer to the mapping until modified.
+ */
+struct input_map
+{
+  const char *data;
+  off_t       size;
+  unsigned    refcount;
 };
+static void input_map_release (struct input_map *map);
+static void pdf_file_pages_free (pdf_file *pf);
 
 struct pdf_stream
 {
@@ -97,6 +148,8 @@ struct pdf_stream
   unsigned long   stream_length;
   unsigned long   max_length;
   unsigned char   _flags;
+  unsigned char   _class;         /* STREAM_CLASS_xxx */
+  struct input_map *map;          /* STREAM points into it, see stream_unshare() */
 };
 
 struct pdf_indirect
@@ -119,8 +172,27 @@ typedef struct pdf_indirect pdf_indirect;
 
 static FILE *pdf_output_file = NULL;
 
-static long pdf_output_file_position = 0;
+static off_t pdf_output_file_position = 0;
 static long pdf_output_line_position = 0;
+
+/*
+ * Everything written to pdf_output_file goes through this buffer;
+ * pdf_output_file_position counts buffered bytes too.
+ */
+#define OUTPUT_BUF_SIZE 65536
+static char output_buf[OUTPUT_BUF_SIZE];
+static long output_buf_length = 0;
+
+/*
+ * Objects whose output has to wait for a stream being compressed in
+ * the background, see pdf_flush_obj(). While "capture" is set, output
+ * for pdf_output_file is collected there instead.
+ */
+struct deferred_obj;
+static struct deferred_obj *capture = NULL;
+static void deferred_append (struct deferred_obj *d, const void *buffer, long length);
+static void deferred_flush   (int all);
+static void workers_shutdown (void);
 static long compression_saved        = 0;
 
 #define FORMAT_BUF_SIZE 4096
@@ -129,7 +201,7 @@ static char format_buffer[FORMAT_BUF_SIZE];
 typedef struct xref_entry
 {
   unsigned char  type;       /* object storage type              */
-  unsigned long  field2;     /* offset in file or object stream  */
+  off_t          field2;     /* offset in file or object stream  */
   unsigned short field3;     /* generation or index              */
   pdf_obj       *direct;     /* used for imported objects        */
   pdf_obj       *indirect;   /* used for imported objects        */
@@ -140,7 +212,7 @@ static xref_entry *output_xref;
 static unsigned long pdf_max_ind_objects;
 static unsigned long next_label;
 
-static unsigned long startxref;
+static off_t startxref;
 
 struct pdf_file
 {
@@ -149,12 +221,62 @@ struct pdf_file
   xref_entry *xref_table;
   pdf_obj    *catalog;
   long        num_obj;
-  long        file_size;
+  off_t       file_size;
   int         version;
+  off_t         *offsets;     /* sorted starts of type 1 objects */
+  long           num_offsets;
+  struct input_map *map;      /* NULL if read through FILE */
+  pdf_file_page *pages;       /* page index, see pdf_file_get_page() */
+  long           num_pages;   /* -1 if not built yet */
+  struct cache_node **cache_nodes;           /* by object number */
+  struct cache_node  *cache_head, *cache_tail;
+  pdf_cache_stats     cache_stats;
+  struct xref_section **sections;  /* lazy xref, newest first */
+  long                  num_sections;
+  char          *xref_loaded; /* NULL unless entries are loaded lazily */
 };
 
+static int xref_entry_load (pdf_file *pf, unsigned long num);
+
+#define xref_entry_ready(pf, n) \
+  (!(pf)->xref_loaded || (pf)->xref_loaded[(n)] || xref_entry_load((pf), (n)))
+
 static pdf_obj *output_stream; /* XXX needs to be re-entrant */
 
+/*
+ * Incremental update, see texpdf_update_begin(). Only the xref
+ * entries of objects written in this revision are output; all
+ * others are marked XREF_ENTRY_NONE.
+ */
+#define XREF_ENTRY_NONE 0xff
+static pdf_file     *update_file = NULL;
+static unsigned long update_size = 0; /* /Size of the file being updated */
+
+/*
+ * Linearized output, see pdf_linearize(). While the temporary file is
+ * rewritten, references into it are renumbered through lin_objs.
+ */
+struct lin_obj
+{
+  pdf_obj       *object;
+  long           page;      /* first page using it, or LIN_UNUSED/LIN_SHARED */
+  int            part;      /* part of the linearized file, 0 if none yet */
+  int            page_node; /* page or page tree node */
+  long           index;     /* position within its part */
+  unsigned long  visit;
+  unsigned long  new_label;
+  char          *bytes;     /* serialized object */
+  long           length;
+  off_t          offset;    /* not counting the hint stream */
+};
+
+static int             linearize_requested = 0;
+static int             linearize_enabled   = 0; /* for this file */
+static char           *linearize_target    = NULL; /* NULL for stdout */
+static pdf_file       *linearize_file      = NULL;
+static struct lin_obj *lin_objs            = NULL;
+static unsigned long   lin_num_objs        = 0;
+
 #define OBJSTM_MAX_OBJS  200
 /* the limit is only 100 for linearized PDF */
 
@@ -167,6 +289,9 @@ static pdf_obj *xref_stream; /* XXX needs to be re-entrant */
 /* Internal static routines */
 
 static int texpdf_check_for_pdf_version (FILE *file);
+static void pdf_file_free (pdf_file *pf);
+static void pdf_linearize (void);
+static void pdf_file_release_objects (pdf_file *pf);
 
 static void pdf_flush_obj (pdf_obj *object, FILE *file);
 static void pdf_label_obj (pdf_obj *object);
@@ -176,26 +301,26 @@ static void  set_objstm_data (pdf_obj *objstm, long *data);
 static long *get_objstm_data (pdf_obj *objstm);
 static void  release_objstm  (pdf_obj *objstm);
 
+static void pdf_out_flush_buffer (void);
 static void pdf_out_char (FILE *file, char c);
 static void pdf_out      (FILE *file, const void *buffer, long length);
 
 static pdf_obj *texpdf_new_ref  (pdf_obj *object);
-static void release_indirect (pdf_indirect *data);
+static void release_indirect (pdf_obj *object);
 static void write_indirect   (pdf_indirect *indirect, FILE *file);
 
-static void release_boolean (pdf_obj *data);
+static void release_boolean (pdf_obj *object);
 static void write_boolean   (pdf_boolean *data, FILE *file);
 
 static void write_null   (FILE *file);
 
-static void release_number (pdf_number *number);
+static void release_number (pdf_obj *object);
 static void write_number   (pdf_number *number, FILE *file);
 
 static void write_string   (pdf_string *str, FILE *file);
 static void release_string (pdf_string *str);
 
 static void write_name   (pdf_name *name, FILE *file);
-static void release_name (pdf_name *name);
 
 static void write_array   (pdf_array *array, FILE *file);
 static void release_array (pdf_array *array);
@@ -208,6 +333,241 @@ static void release_stream (pdf_stream *stream);
 
 static int  verbose = 0;
 static char compression_level = 9;
+static int  compression_class_level[STREAM_CLASS_MAX] = { -1, -1, -1, -1 };
+
+#define stream_compression_level(s) \
+  (compression_class_level[(s)->_class] >= 0 ? \
+   compression_class_level[(s)->_class] : compression_level)
+
+#ifdef HAVE_ZLIB
+static unsigned char *
+compress_zlib (const unsigned char *data, unsigned long length, int level,
+               unsigned long *compressed_length)
+{
+  uLongf         buffer_length = length + length/1000 + 14;
+  unsigned char *buffer;
+  int            status;
+
+  buffer = malloc(buffer_length);
+  if (!buffer)
+    return NULL;
+#ifdef HAVE_ZLIB_COMPRESS2
+  status = compress2(buffer, &buffer_length, data, length, level);
+#else
+  status = compress(buffer, &buffer_length, data, length);
+#endif /* HAVE_ZLIB_COMPRESS2 */
+  if (status != Z_OK) {
+    free(buffer);
+    return NULL;
+  }
+  *compressed_length = buffer_length;
+
+  return buffer;
+}
+#endif /* HAVE_ZLIB */
+
+#ifdef HAVE_LIBDEFLATE
+/*
+ * Setting up a libdeflate compressor is costly, so every thread keeps
+ * one per level for all its streams. Those of a compression thread are
+ * freed when it exits.
+ */
+#define LIBDEFLATE_LEVELS 10
+
+#ifdef HAVE_PTHREAD
+static pthread_key_t  libdeflate_key;
+static pthread_once_t libdeflate_once = PTHREAD_ONCE_INIT;
+
+static void
+libdeflate_free_compressors (void *arg)
+{
+  struct libdeflate_compressor **compressors = arg;
+  int level;
+
+  for (level = 0; level < LIBDEFLATE_LEVELS; level++) {
+    if (compressors[level])
+      libdeflate_free_compressor(compressors[level]);
+  }
+  free(compressors);
+}
+
+static void
+libdeflate_key_create (void)
+{
+  pthread_key_create(&libdeflate_key, libdeflate_free_compressors);
+}
+#else
+static struct libdeflate_compressor **libdeflate_compressors = NULL;
+#endif
+
+/* Called from compression threads too: must not call NEW() or ERROR(). */
+static struct libdeflate_compressor *
+libdeflate_compressor (int level)
+{
+  struct libdeflate_compressor **compressors;
+
+  if (level < 0 || level >= LIBDEFLATE_LEVELS)
+    return NULL;
+
+#ifdef HAVE_PTHREAD
+  pthread_once(&libdeflate_once, libdeflate_key_create);
+  compressors = pthread_getspecific(libdeflate_key);
+#else
+  compressors = libdeflate_compressors;
+#endif
+  if (!compressors) {
+    compressors = calloc(LIBDEFLATE_LEVELS, sizeof(compressors[0]));
+    if (!compressors)
+      return NULL;
+#ifdef HAVE_PTHREAD
+    if (pthread_setspecific(libdeflate_key, compressors)) {
+      free(compressors);
+      return NULL;
+    }
+#else
+    libdeflate_compressors = compressors;
+#endif
+  }
+  if (!compressors[level])
+    compressors[level] = libdeflate_alloc_compressor(level);
+
+  return compressors[level];
+}
+
+/* libdeflate: whole-buffer compressor, faster than zlib at the same level */
+static unsigned char *
+compress_libdeflate (const unsigned char *data, unsigned long length, int level,
+                     unsigned long *compressed_length)
+{
+  struct libdeflate_compressor *compressor;
+  unsigned char *buffer;
+  size_t         bound;
+
+  compressor = libdeflate_compressor(level);
+  if (!compressor)
+    return NULL;
+  bound  = libdeflate_zlib_compress_bound(compressor, length);
+  buffer = malloc(bound);
+  if (buffer) {
+    *compressed_length = libdeflate_zlib_compress(compressor, data, length,
+                                                  buffer, bound);
+    if (*compressed_length == 0) {
+      free(buffer);
+      buffer = NULL;
+    }
+  }
+
+  return buffer;
+}
+#endif /* HAVE_LIBDEFLATE */
+
+#define MAX_COMPRESS_BACKENDS 8
+static struct {
+  const char           *name;
+  texpdf_compress_func  compress;
+} compress_backends[MAX_COMPRESS_BACKENDS] = {
+#ifdef HAVE_ZLIB
+  { "zlib",       compress_zlib },
+#endif
+#ifdef HAVE_LIBDEFLATE
+  { "libdeflate", compress_libdeflate },
+#endif
+  { NULL, NULL }
+};
+static int compress_backend = 0;
+
+/* Returns the index of the new backend, or -1 if the table is full. */
+int
+texpdf_add_compression_backend (const char *name, texpdf_compress_func compress)
+{
+  int i;
+
+  ASSERT(name && compress);
+
+  for (i = 0; i < MAX_COMPRESS_BACKENDS - 1 && compress_backends[i].name; i++) {
+    if (!strcmp(compress_backends[i].name, name)) {
+      compress_backends[i].compress = compress;
+      return i;
+    }
+  }
+  if (i == MAX_COMPRESS_BACKENDS - 1)
+    return -1;
+
+  {
+    char *copy = NEW(strlen(name) + 1, char);
+
+    strcpy(copy, name);
+    compress_backends[i].name     = copy;
+    compress_backends[i].compress = compress;
+  }
+
+  return i;
+}
+
+/* Returns 0 on success and -1 if there is no backend of that name. */
+int
+texpdf_set_compression_backend (const char *name)
+{
+  int i;
+
+  for (i = 0; compress_backends[i].name; i++) {
+    if (!strcmp(compress_backends[i].name, name)) {
+      compress_backend = i;
+      return 0;
+    }
+  }
+  WARN("Unknown compression backend \"%s\".", name);
+
+  return -1;
+}
+
+void
+texpdf_set_compression_class (int stream_class, int level)
+{
+  if (stream_class < 0 || stream_class >= STREAM_CLASS_MAX)
+    ERROR("set_compression_class: invalid stream class: %d", stream_class);
+  if (level < -1 || level > 9)
+    ERROR("set_compression_class: invalid compression level: %d", level);
+
+  compression_class_level[stream_class] = level;
+}
+
+/* Background compression, see pdf_flush_obj() */
+#define COMPRESS_QUEUE_DEFAULT (64L << 20)
+static int  compression_threads   = 0;
+static long compression_queue_max = COMPRESS_QUEUE_DEFAULT;
+static int  deferred_enabled      = 0; /* threads used for this file */
+
+/*
+ * Deduplication of identical objects, see pdf_dedup_obj(). A label
+ * found to duplicate an earlier object is forwarded to that object's
+ * label in every reference written afterwards.
+ */
+#define DEDUP_MIN_LENGTH 64 /* smaller resource dicts and arrays are not worth it */
+struct label_info
+{
+  unsigned long forward;    /* label to use instead, or 0 */
+  char          referenced; /* already written as "n g R" */
+};
+
+static int  dedup_requested = 0;
+static int  dedup_enabled   = 0; /* dedup used for this file */
+static int  dedup_hashing   = 0;
+static struct ht_table   dedup_table; /* digest -> label */
+static struct label_info *label_info = NULL;
+static unsigned long      max_label_info = 0;
+
+void
+texpdf_set_object_dedup (int enabled)
+{
+  dedup_requested = enabled;
+}
+
+void
+texpdf_set_linearize (int enabled)
+{
+  linearize_requested = enabled;
+}
 
 void
 texpdf_set_compression (int level)
@@ -229,6 +589,27 @@ texpdf_set_compression (int level)
   return;
 }
 
+/*
+ * Compress streams in num_threads worker threads. Output stays the
+ * same as with serial compression; objects are still written in the
+ * order they are released, which means holding back everything that
+ * follows a stream still being compressed. max_queued bytes bounds
+ * that backlog (0 selects the default).
+ */
+void
+texpdf_set_compression_threads (int num_threads, long max_queued)
+{
+  if (num_threads < 0)
+    ERROR("set_compression_threads: invalid number of threads: %d", num_threads);
+#ifndef HAVE_PTHREAD
+  if (num_threads > 0)
+    WARN("Thread support not compiled in, compressing streams serially.");
+  num_threads = 0;
+#endif
+  compression_threads   = num_threads;
+  compression_queue_max = max_queued > 0 ? max_queued : COMPRESS_QUEUE_DEFAULT;
+}
+
 static unsigned pdf_version = PDF_VERSION_DEFAULT;
 
 void
@@ -259,14 +640,36 @@ texpdf_obj_set_verbose(void)
 }
 
 static pdf_obj *current_objstm = NULL;
+
+/* Region used for new objects, set while a page is being built. */
+static mem_arena *obj_arena = NULL;
 static int do_objstm;
 
 static void
-add_xref_entry (unsigned long label, unsigned char type, unsigned long field2, unsigned short field3)
+label_info_grow (unsigned long label)
+{
+  if (label >= max_label_info) {
+    unsigned long size = (label/IND_OBJECTS_ALLOC_SIZE+1)*IND_OBJECTS_ALLOC_SIZE;
+
+    label_info = RENEW(label_info, size, struct label_info);
+    memset(label_info + max_label_info, 0,
+           (size - max_label_info) * sizeof(struct label_info));
+    max_label_info = size;
+  }
+}
+
+static void
+add_xref_entry (unsigned long label, unsigned char type, off_t field2, unsigned short field3)
 {
   if (label >= pdf_max_ind_objects) {
+    unsigned long i = pdf_max_ind_objects;
+
     pdf_max_ind_objects = (label/IND_OBJECTS_ALLOC_SIZE+1)*IND_OBJECTS_ALLOC_SIZE;
     output_xref = RENEW(output_xref, pdf_max_ind_objects, xref_entry);
+    if (update_file) {
+      for (; i < pdf_max_ind_objects; i++)
+        output_xref[i].type = XREF_ENTRY_NONE;
+    }
   }
 
   output_xref[label].type   = type;
@@ -276,18 +679,11 @@ add_xref_entry (unsigned long label, unsigned char type, unsigned long field2, u
   output_xref[label].indirect = NULL;
 }
 
-#define BINARY_MARKER "%\344\360\355\370\n"
-void
-pdf_out_init (const char *filename, int do_encryption)
+/* Set up the trailer and per-file state for writing a PDF 1.VERSION file */
+static void
+pdf_out_begin (unsigned version, int do_encryption)
 {
-  char v;
-
-  output_xref = NULL;
-  pdf_max_ind_objects = 0;
-  add_xref_entry(0, 0, 0, 0xffff);
-  next_label = 1;
-
-  if (pdf_version >= 5) {
+  if (version >= 5) {
     xref_stream = texpdf_new_stream(STREAM_COMPRESS);
     xref_stream->flags |= OBJ_NO_ENCRYPT;
     trailer_dict = texpdf_stream_dict(xref_stream);
@@ -300,8 +696,42 @@ pdf_out_init (const char *filename, int do_encryption)
   }
 
   output_stream = NULL;
+  deferred_enabled = compression_threads > 0;
+  dedup_enabled = dedup_requested && !do_encryption;
+  if (dedup_enabled)
+    texpdf_ht_init_table(&dedup_table, free);
+}
+
+#define BINARY_MARKER "%\344\360\355\370\n"
+void
+pdf_out_init (const char *filename, int do_encryption)
+{
+  char v;
+
+  output_xref = NULL;
+  pdf_max_ind_objects = 0;
+  add_xref_entry(0, 0, 0, 0xffff);
+  next_label = 1;
+
+  pdf_out_begin(pdf_version, do_encryption);
 
-  if (filename == NULL) { /* no filename: writing to stdout */
+  linearize_enabled = linearize_requested && !do_encryption;
+  if (linearize_requested && do_encryption)
+    WARN("Linearization is not supported for encrypted output.");
+
+  if (linearize_enabled) {
+    /* Written in its final order by pdf_linearize() */
+    if (linearize_target)
+      RELEASE(linearize_target);
+    linearize_target = NULL;
+    if (filename) {
+      linearize_target = NEW(strlen(filename)+1, char);
+      strcpy(linearize_target, filename);
+    }
+    pdf_output_file = tmpfile();
+    if (!pdf_output_file)
+      ERROR("Unable to open temporary file.");
+  } else if (filename == NULL) { /* no filename: writing to stdout */
 #if defined(WIN32) && !defined(__MINGW32__)
     setmode(fileno(stdout), _O_BINARY);
 #endif
@@ -325,30 +755,83 @@ pdf_out_init (const char *filename, int do_encryption)
   doc_enc_mode = do_encryption;
 }
 
+/*
+ * Find the next run of xref entries from START on. A new file has
+ * a single subsection; an update lists only the entries written.
+ */
+static unsigned long
+xref_subsection (unsigned long start, unsigned long *count)
+{
+  unsigned long end;
+
+  if (!update_file) {
+    *count = start < next_label ? next_label - start : 0;
+    return start;
+  }
+
+  while (start < next_label && start < pdf_max_ind_objects &&
+         output_xref[start].type == XREF_ENTRY_NONE)
+    start++;
+  for (end = start; end < next_label && end < pdf_max_ind_objects &&
+         output_xref[end].type != XREF_ENTRY_NONE; end++)
+    ;
+  *count = end - start;
+
+  return start;
+}
+
+/*
+ * Link the free entries of this revision into the free list headed
+ * by entry 0, in ascending order. An update continues with the free
+ * list of the file being updated.
+ */
+static void
+xref_link_free (void)
+{
+  unsigned long i, next = 0;
+
+  if (update_file && update_file->num_obj > 0 &&
+      xref_entry_ready(update_file, 0) &&
+      update_file->xref_table[0].type == 0)
+    next = (unsigned long) update_file->xref_table[0].field2;
+
+  for (i = next_label; i-- > 1; ) {
+    if (i < pdf_max_ind_objects && output_xref[i].type == 0) {
+      output_xref[i].field2 = next;
+      next = i;
+    }
+  }
+  output_xref[0].field2 = next;
+}
+
 static void
 texpdf_dump_xref_table (void)
 {
   long length;
-  unsigned long i;
+  unsigned long i, n, start;
 
+  xref_link_free();
   pdf_out(pdf_output_file, "xref\n", 5);
 
-  length = sprintf(format_buffer, "%d %lu\n", 0, next_label);
-  pdf_out(pdf_output_file, format_buffer, length);
-
-  /*
-   * Every space counts.  The space after the 'f' and 'n' is * *essential*.
-   * The PDF spec says the lines must be 20 characters long including the
-   * end of line character.
-   */
-  for (i = 0; i < next_label; i++) {
-    unsigned char type = output_xref[i].type;
-    if (type > 1)
-      ERROR("object type %hu not allowed in xref table", type);
-    length = sprintf(format_buffer, "%010lu %05hu %c \n",
-		     output_xref[i].field2, output_xref[i].field3,
-		     type ? 'n' : 'f');
+  for (start = xref_subsection(0, &n); n > 0;
+       start = xref_subsection(start + n, &n)) {
+    length = sprintf(format_buffer, "%lu %lu\n", start, n);
     pdf_out(pdf_output_file, format_buffer, length);
+
+    /*
+     * Every space counts.  The space after the 'f' and 'n' is * *essential*.
+     * The PDF spec says the lines must be 20 characters long including the
+     * end of line character.
+     */
+    for (i = start; i < start + n; i++) {
+      unsigned char type = output_xref[i].type;
+      if (type > 1)
+        ERROR("object type %hu not allowed in xref table", type);
+      length = sprintf(format_buffer, "%010" PRId64 " %05hu %c \n",
+		       (int64_t) output_xref[i].field2, output_xref[i].field3,
+		       type ? 'n' : 'f');
+      pdf_out(pdf_output_file, format_buffer, length);
+    }
   }
 }
 
@@ -369,11 +852,12 @@ texpdf_dump_trailer_dict (void)
 static void
 texpdf_dump_xref_stream (void)
 {
-  unsigned long pos, i;
+  unsigned long i, n, start;
+  off_t    pos;
   unsigned poslen;
-  unsigned char buf[7] = {0, 0, 0, 0, 0};
+  unsigned char buf[sizeof(off_t) + 3];
 
-  pdf_obj *w;
+  pdf_obj *w, *index = NULL;
 
   /* determine the necessary size of the offset field */
   pos = startxref; /* maximal offset value */
@@ -389,21 +873,33 @@ texpdf_dump_xref_stream (void)
 
   /* We need the xref entry for the xref stream right now */
   add_xref_entry(next_label-1, 1, startxref, 0);
-
-  for (i = 0; i < next_label; i++) {
-    unsigned j;
-    unsigned short f3;
-    buf[0] = output_xref[i].type;
-    pos = output_xref[i].field2;
-    for (j = poslen; j--; ) {
-      buf[1+j] = (unsigned char) pos;
-      pos >>= 8;
+  xref_link_free();
+
+  if (update_file)
+    index = texpdf_new_array();
+  for (start = xref_subsection(0, &n); n > 0;
+       start = xref_subsection(start + n, &n)) {
+    if (index) {
+      texpdf_add_array(index, texpdf_new_number(start));
+      texpdf_add_array(index, texpdf_new_number(n));
+    }
+    for (i = start; i < start + n; i++) {
+      unsigned j;
+      unsigned short f3;
+      buf[0] = output_xref[i].type;
+      pos = output_xref[i].field2;
+      for (j = poslen; j--; ) {
+        buf[1+j] = (unsigned char) pos;
+        pos >>= 8;
+      }
+      f3 = output_xref[i].field3;
+      buf[poslen+1] = (unsigned char) (f3 >> 8);
+      buf[poslen+2] = (unsigned char) (f3);
+      texpdf_add_stream(xref_stream, &buf, poslen+3);
     }
-    f3 = output_xref[i].field3;
-    buf[poslen+1] = (unsigned char) (f3 >> 8);
-    buf[poslen+2] = (unsigned char) (f3);
-    texpdf_add_stream(xref_stream, &buf, poslen+3);
   }
+  if (index)
+    texpdf_add_dict(trailer_dict, texpdf_new_name("Index"), index);
 
   texpdf_release_obj(xref_stream);
 }
@@ -414,12 +910,21 @@ pdf_out_flush (void)
   if (pdf_output_file) {
     long length;
 
+    /* Replaced objects still cached by the file being updated */
+    if (update_file)
+      pdf_file_release_objects(update_file);
+
     /* Flush current object stream */
     if (current_objstm) {
       release_objstm(current_objstm);
       current_objstm =NULL;
     }
 
+    /* Write out everything held back for background compression */
+    deferred_flush(1);
+    workers_shutdown();
+    deferred_enabled = 0;
+
     /*
      * Label xref stream - we need the number of correct objects
      * for the xref stream dictionary (= trailer).
@@ -443,12 +948,23 @@ pdf_out_flush (void)
 
     /* Done with xref table */
     RELEASE(output_xref);
+    if (dedup_enabled) {
+      texpdf_ht_clear_table(&dedup_table);
+      if (label_info)
+        RELEASE(label_info);
+      label_info = NULL;
+      max_label_info = 0;
+      dedup_enabled = 0;
+    }
 
     pdf_out(pdf_output_file, "startxref\n", 10);
-    length = sprintf(format_buffer, "%lu\n", startxref);
+    length = sprintf(format_buffer, "%" PRId64 "\n", (int64_t) startxref);
     pdf_out(pdf_output_file, format_buffer, length);
     pdf_out(pdf_output_file, "%%EOF\n", 6);
 
+    if (linearize_enabled)
+      pdf_linearize();
+
     MESG("\n");
     if (verbose) {
       if (compression_level > 0) {
@@ -456,8 +972,14 @@ pdf_out_flush (void)
 	     pdf_version < 5 ? ". Try \"-V 5\" for better compression" : "");
       }
     }
-    MESG("%ld bytes written", pdf_output_file_position);
+    MESG("%" PRId64 " bytes written", (int64_t) pdf_output_file_position);
 
+    if (update_file) {
+      pdf_file_free(update_file);
+      update_file = NULL;
+    }
+
+    pdf_out_flush_buffer();
     MFCLOSE(pdf_output_file);
     pdf_output_file_position = 0;
     pdf_output_line_position = 0;
@@ -471,8 +993,10 @@ texpdf_error_cleanup (void)
    * This routine is the cleanup required for an abnormal exit.
    * For now, simply close the file.
    */
-  if (pdf_output_file)
+  if (pdf_output_file) {
+    pdf_out_flush_buffer();
     MFCLOSE(pdf_output_file);
+  }
 }
 
 
@@ -516,47 +1040,85 @@ texpdf_set_encrypt (pdf_obj *encrypt)
   encrypt->flags |= OBJ_NO_ENCRYPT;
 }
 
+static void
+pdf_out_flush_buffer (void)
+{
+  if (output_buf_length > 0) {
+    fwrite(output_buf, 1, output_buf_length, pdf_output_file);
+    output_buf_length = 0;
+  }
+}
+
+/* Append to pdf_output_file, bypassing redirection. */
+static void
+pdf_out_raw (const void *buffer, long length)
+{
+  if (output_buf_length + length > OUTPUT_BUF_SIZE)
+    pdf_out_flush_buffer();
+  if (length >= OUTPUT_BUF_SIZE)
+    fwrite(buffer, 1, length, pdf_output_file);
+  else {
+    memcpy(output_buf + output_buf_length, buffer, length);
+    output_buf_length += length;
+  }
+  pdf_output_file_position += length;
+}
+
 static
 void pdf_out_char (FILE *file, char c)
 {
-  if (output_stream && file ==  pdf_output_file)
+  if (file != pdf_output_file)
+    fputc(c, file);
+  else if (output_stream)
     texpdf_add_stream(output_stream, &c, 1);
   else {
-    fputc(c, file);
-    /* Keep tallys for xref table *only* if writing a pdf file. */
-    if (file == pdf_output_file) {
+    if (capture)
+      deferred_append(capture, &c, 1);
+    else {
+      if (output_buf_length == OUTPUT_BUF_SIZE)
+        pdf_out_flush_buffer();
+      output_buf[output_buf_length++] = c;
+      /* Keep tallys for xref table *only* if writing a pdf file. */
       pdf_output_file_position += 1;
-      if (c == '\n')
-        pdf_output_line_position  = 0;
-      else
-        pdf_output_line_position += 1;
     }
+    if (c == '\n')
+      pdf_output_line_position  = 0;
+    else
+      pdf_output_line_position += 1;
   }
 }
 
 static char xchar[] = "0123456789abcdef";
 
-#define pdf_out_xchar(f,c) do {\
-  pdf_out_char((f), xchar[((c) >> 4) & 0x0f]);\
-  pdf_out_char((f), xchar[(c) & 0x0f]);\
-} while (0)
+/* Two hexadecimal digits for each byte value */
+static const char hex_pairs[] =
+  "000102030405060708090a0b0c0d0e0f101112131415161718191a1b1c1d1e1f"
+  "202122232425262728292a2b2c2d2e2f303132333435363738393a3b3c3d3e3f"
+  "404142434445464748494a4b4c4d4e4f505152535455565758595a5b5c5d5e5f"
+  "606162636465666768696a6b6c6d6e6f707172737475767778797a7b7c7d7e7f"
+  "808182838485868788898a8b8c8d8e8f909192939495969798999a9b9c9d9e9f"
+  "a0a1a2a3a4a5a6a7a8a9aaabacadaeafb0b1b2b3b4b5b6b7b8b9babbbcbdbebf"
+  "c0c1c2c3c4c5c6c7c8c9cacbcccdcecfd0d1d2d3d4d5d6d7d8d9dadbdcdddedf"
+  "e0e1e2e3e4e5e6e7e8e9eaebecedeeeff0f1f2f3f4f5f6f7f8f9fafbfcfdfeff";
 
 static
 void pdf_out (FILE *file, const void *buffer, long length)
 {
-  if (output_stream && file ==  pdf_output_file)
+  if (file != pdf_output_file)
+    fwrite(buffer, 1, length, file);
+  else if (output_stream)
     texpdf_add_stream(output_stream, buffer, length);
   else {
-    fwrite(buffer, 1, length, file);
     /* Keep tallys for xref table *only* if writing a pdf file */
-    if (file == pdf_output_file) {
-      pdf_output_file_position += length;
-      pdf_output_line_position += length;
-      /* "foo\nbar\n "... */
-      if (length > 0 &&
+    if (capture)
+      deferred_append(capture, buffer, length);
+    else
+      pdf_out_raw(buffer, length);
+    pdf_output_line_position += length;
+    /* "foo\nbar\n "... */
+    if (length > 0 &&
 	((const char *)buffer)[length-1] == '\n')
-        pdf_output_line_position = 0;
-    }
+      pdf_output_line_position = 0;
   }
 }
 
@@ -586,6 +1148,17 @@ void pdf_out_white (FILE *file)
 
 #define INVALIDOBJ(o)  ((o) == NULL || (o)->type <= 0 || (o)->type > PDF_UNDEFINED)
 
+/*
+ * Objects created while an arena is active take their header and
+ * small payload from it. They are still refcounted and released as
+ * usual; the arena only saves the malloc()/free() round trips.
+ */
+void
+texpdf_obj_set_arena (mem_arena *arena)
+{
+  obj_arena = arena;
+}
+
 static pdf_obj *
 texpdf_new_obj(int type)
 {
@@ -594,17 +1167,40 @@ texpdf_new_obj(int type)
   if (type > PDF_UNDEFINED || type < 0)
     ERROR("Invalid object type: %d", type);
 
-  result = NEW(1, pdf_obj);
+  if (obj_arena) {
+    result = texpdf_arena_alloc(obj_arena, sizeof(pdf_obj));
+    result->flags = OBJ_IN_ARENA;
+  } else {
+    result = NEW(1, pdf_obj);
+    result->flags = 0;
+  }
   result->type  = type;
   result->data  = NULL;
   result->label      = 0;
   result->generation = 0;
   result->refcount   = 1;
-  result->flags      = 0;
 
   return result;
 }
 
+static void *
+obj_new_data (pdf_obj *object, size_t size)
+{
+  if (object->flags & OBJ_IN_ARENA)
+    return texpdf_arena_alloc(obj_arena, size);
+  else
+    return new(size);
+}
+
+static void
+obj_free_data (pdf_obj *object, void *data)
+{
+  if (object->flags & OBJ_IN_ARENA)
+    texpdf_arena_free(data);
+  else
+    RELEASE(data);
+}
+
 int
 texpdf_obj_typeof (pdf_obj *object)
 {
@@ -680,20 +1276,36 @@ texpdf_ref_obj (pdf_obj *object)
 }
 
 static void
-release_indirect (pdf_indirect *data)
+release_indirect (pdf_obj *object)
 {
-  RELEASE(data);
+  obj_free_data(object, object->data);
 }
 
 static void
 write_indirect (pdf_indirect *indirect, FILE *file)
 {
   long length;
+  unsigned long label = indirect->label;
 
-  ASSERT(!indirect->pf);
+  ASSERT(!indirect->pf || indirect->pf == update_file ||
+         indirect->pf == linearize_file);
 
-  length = sprintf(format_buffer, "%lu %hu R", indirect->label, indirect->generation);
-  pdf_out(file, format_buffer, length);
+  if (indirect->pf && indirect->pf == linearize_file) {
+    label = label < lin_num_objs ? lin_objs[label].new_label : 0;
+    if (!label) {
+      write_null(file);
+      return;
+    }
+  }
+  if (dedup_enabled && file == pdf_output_file) {
+    label_info_grow(label);
+    if (label_info[label].forward)
+      label = label_info[label].forward;
+    else if (!dedup_hashing)
+      label_info[label].referenced = 1;
+  }
+  length = sprintf(format_buffer, "%lu %hu R", label, indirect->generation);
+  pdf_out(file, format_buffer, length);
 }
 
 /* The undefined object is used as a placeholder in pdfnames.c
@@ -734,7 +1346,7 @@ texpdf_new_boolean (char value)
   pdf_boolean *data;
 
   result = texpdf_new_obj(PDF_BOOLEAN);
-  data   = NEW(1, pdf_boolean);
+  data   = obj_new_data(result, sizeof(pdf_boolean));
   data->value  = value;
   result->data = data;
 
@@ -742,9 +1354,9 @@ texpdf_new_boolean (char value)
 }
 
 static void
-release_boolean (pdf_obj *data)
+release_boolean (pdf_obj *object)
 {
-  RELEASE (data);
+  obj_free_data(object, object->data);
 }
 
 static void
@@ -776,7 +1388,7 @@ texpdf_new_number (double value)
   pdf_number *data;
 
   result = texpdf_new_obj(PDF_NUMBER);
-  data   = NEW(1, pdf_number);
+  data   = obj_new_data(result, sizeof(pdf_number));
   data->value  = value;
   result->data = data;
 
@@ -784,9 +1396,9 @@ texpdf_new_number (double value)
 }
 
 static void
-release_number (pdf_number *data)
+release_number (pdf_obj *object)
 {
-  RELEASE (data);
+  obj_free_data(object, object->data);
 }
 
 static void
@@ -871,6 +1483,27 @@ texpdf_string_length (pdf_obj *object)
   return (unsigned) (data->length);
 }
 
+/*
+ * How each byte is written in a literal string: as is, after a
+ * backslash, or as a three-digit octal escape.
+ */
+#define ESCAPE_NONE  0
+#define ESCAPE_CHAR  1
+#define ESCAPE_OCTAL 2
+static unsigned char escape_class[256];
+static int           escape_class_ready = 0;
+
+static void
+escape_class_init (void)
+{
+  int ch;
+
+  for (ch = 0; ch < 256; ch++)
+    escape_class[ch] = (ch < 32 || ch > 126) ? ESCAPE_OCTAL : ESCAPE_NONE;
+  escape_class['('] = escape_class[')'] = escape_class['\\'] = ESCAPE_CHAR;
+  escape_class_ready = 1;
+}
+
 /*
  * This routine escapes non printable characters and control
  * characters in an output string.
@@ -881,6 +1514,9 @@ pdfobj_escape_str (char *buffer, int bufsize, const unsigned char *s, int len)
   int result = 0;
   int i;
 
+  if (!escape_class_ready)
+    escape_class_init();
+
   for (i = 0; i < len; i++) {
     unsigned char ch;
 
@@ -888,43 +1524,44 @@ pdfobj_escape_str (char *buffer, int bufsize, const unsigned char *s, int len)
     if (result > bufsize - 4)
       ERROR("pdfobj_escape_str: Buffer overflow");
 
-    /*
-     * We always write three octal digits. Optimization only gives few Kb
-     * smaller size for most documents when zlib compressed.
-     */
-    if (ch < 32 || ch > 126) {
+    switch (escape_class[ch]) {
+    case ESCAPE_NONE:
+      buffer[result++] = ch;
+      break;
+    case ESCAPE_CHAR:
       buffer[result++] = '\\';
-#if 0
-      if (i < len - 1 && !isdigit(s[i+1]))
-	result += sprintf(buffer+result, "%o", ch);
-      else
-	result += sprintf(buffer+result, "%03o", ch);
-#endif
-      result += sprintf(buffer+result, "%03o", ch);
-    } else {
-      switch (ch) {
-      case '(':
-	buffer[result++] = '\\';
-	buffer[result++] = '(';
-	break;
-      case ')':
-	buffer[result++] = '\\';
-	buffer[result++] = ')';
-	break;
-      case '\\':
-	buffer[result++] = '\\';
-	buffer[result++] = '\\';
-	break;
-      default:
-	buffer[result++] = ch;
-	break;
-      }
+      buffer[result++] = ch;
+      break;
+    default:
+      /*
+       * We always write three octal digits. Optimization only gives few Kb
+       * smaller size for most documents when zlib compressed.
+       */
+      buffer[result++] = '\\';
+      buffer[result++] = '0' + (ch >> 6);
+      buffer[result++] = '0' + ((ch >> 3) & 7);
+      buffer[result++] = '0' + (ch & 7);
+      break;
     }
   }
 
   return result;
 }
 
+/* Write the bytes of S as hexadecimal digits, for <...> strings. */
+int
+pdfobj_hex_str (char *buffer, int bufsize, const unsigned char *s, int len)
+{
+  int i;
+
+  if (2 * len > bufsize)
+    ERROR("pdfobj_hex_str: Buffer overflow");
+  for (i = 0; i < len; i++)
+    memcpy(buffer + 2 * i, hex_pairs + 2 * s[i], 2);
+
+  return 2 * len;
+}
+
 static void
 write_string (pdf_string *str, FILE *file)
 {
@@ -950,22 +1587,28 @@ write_string (pdf_string *str, FILE *file)
    */
   if (nescc > str->length / 3) {
     pdf_out_char(file, '<');
-    for (i = 0; i < str->length; i++) {
-      pdf_out_xchar(file, s[i]);
+    for (i = 0; i < str->length; i += FORMAT_BUF_SIZE / 2) {
+      int len = str->length - i;
+
+      if (len > FORMAT_BUF_SIZE / 2)
+        len = FORMAT_BUF_SIZE / 2;
+      count = pdfobj_hex_str(wbuf, FORMAT_BUF_SIZE, &(s[i]), len);
+      pdf_out(file, wbuf, count);
     }
     pdf_out_char(file, '>');
   } else {
     pdf_out_char(file, '(');
     /*
-     * This section of code probably isn't speed critical.  Escaping the
-     * characters in the string one at a time may seem slow, but it's
-     * safe if the formatted string length exceeds FORMAT_BUF_SIZE.
-     * Occasionally you see some long strings in PDF.  pdfobj_escape_str
-     * is also used for strings of text with no kerning.  These must be
-     * handled as quickly as possible since there are so many of them.
+     * Escape the string in pieces small enough that the escaped
+     * form always fits in wbuf (at most four bytes per character).
+     * Occasionally you see some long strings in PDF.
      */ 
-    for (i = 0; i < str->length; i++) {
-      count = pdfobj_escape_str(wbuf, FORMAT_BUF_SIZE, &(s[i]), 1);
+    for (i = 0; i < str->length; i += FORMAT_BUF_SIZE / 4) {
+      int len = str->length - i;
+
+      if (len > FORMAT_BUF_SIZE / 4)
+        len = FORMAT_BUF_SIZE / 4;
+      count = pdfobj_escape_str(wbuf, FORMAT_BUF_SIZE, &(s[i]), len);
       pdf_out(file, wbuf, count);
     }
     pdf_out_char(file, ')');
@@ -1004,25 +1647,150 @@ texpdf_set_string (pdf_obj *object, unsigned char *str, unsigned length)
   }
 }
 
+/*
+ * Interned names live in an open-addressing table indexed by their
+ * cached hash. It is kept at most half full and doubles as needed,
+ * so lookups stay short however many glyph and font names are seen.
+ */
+#define NAME_TABLE_MIN 1024
+static pdf_name      **name_atoms = NULL;
+static unsigned long   name_atoms_size = 0;
+static unsigned long   num_name_atoms  = 0;
+static pdf_name        empty_name = { NULL, 5381, 0, NULL, 0 };
+
+/* Returns the hash of name and stores its length. */
+static unsigned long
+name_hash (const char *name, int *length)
+{
+  const char   *p = name;
+  unsigned long h = 5381;
+
+  while (*p)
+    h = (h << 5) + h + (unsigned char) *p++;
+  *length = p - name;
+
+  return h;
+}
+
+static void
+name_atoms_grow (void)
+{
+  pdf_name    **old = name_atoms;
+  unsigned long old_size = name_atoms_size, i;
+
+  name_atoms_size = old_size ? 2 * old_size : NAME_TABLE_MIN;
+  name_atoms = NEW(name_atoms_size, pdf_name *);
+  memset(name_atoms, 0, name_atoms_size * sizeof(pdf_name *));
+  for (i = 0; i < old_size; i++) {
+    if (old[i]) {
+      unsigned long slot = old[i]->hash & (name_atoms_size - 1);
+
+      while (name_atoms[slot])
+        slot = (slot + 1) & (name_atoms_size - 1);
+      name_atoms[slot] = old[i];
+    }
+  }
+  if (old)
+    RELEASE(old);
+}
+
+/* Returns the atom for name, creating it if create is non-zero. */
+static pdf_name *
+name_intern (const char *name, int create)
+{
+  pdf_name     *atom;
+  unsigned long hash, slot;
+  int           length;
+
+  hash = name_hash(name, &length);
+  if (length == 0)
+    return &empty_name;
+
+  if (name_atoms) {
+    slot = hash & (name_atoms_size - 1);
+    while ((atom = name_atoms[slot]) != NULL) {
+      if (atom->hash == hash && !strcmp(atom->name, name))
+        return atom;
+      slot = (slot + 1) & (name_atoms_size - 1);
+    }
+  }
+  if (!create)
+    return NULL;
+
+  if (2 * (num_name_atoms + 1) > name_atoms_size)
+    name_atoms_grow();
+
+  atom = NEW(1, pdf_name);
+  atom->name = NEW(length+1, char);
+  memcpy(atom->name, name, length + 1);
+  atom->hash    = hash;
+  atom->refs    = 0;
+  atom->escaped = NULL;
+  atom->escaped_length = 0;
+
+  slot = hash & (name_atoms_size - 1);
+  while (name_atoms[slot])
+    slot = (slot + 1) & (name_atoms_size - 1);
+  name_atoms[slot] = atom;
+  num_name_atoms++;
+
+  return atom;
+}
+
+/*
+ * Drops a reference to atom and frees it when it was the last one.
+ * Later entries of its probe run are shifted back into the hole, so
+ * that no lookup stops short of them.
+ */
+static void
+release_name (pdf_name *atom)
+{
+  unsigned long mask, hole, slot, home;
+
+  if (atom == &empty_name || --atom->refs > 0)
+    return;
+
+  mask = name_atoms_size - 1;
+  hole = atom->hash & mask;
+  while (name_atoms[hole] != atom)
+    hole = (hole + 1) & mask;
+  slot = hole;
+  for (;;) {
+    slot = (slot + 1) & mask;
+    if (!name_atoms[slot])
+      break;
+    home = name_atoms[slot]->hash & mask;
+    /* Move it unless its home lies cyclically in (hole, slot] */
+    if (hole <= slot ? (home <= hole || home > slot) : (home <= hole && home > slot)) {
+      name_atoms[hole] = name_atoms[slot];
+      hole = slot;
+    }
+  }
+  name_atoms[hole] = NULL;
+
+  RELEASE(atom->name);
+  if (atom->escaped)
+    RELEASE(atom->escaped);
+  RELEASE(atom);
+
+  if (--num_name_atoms == 0) {
+    RELEASE(name_atoms);
+    name_atoms = NULL;
+    name_atoms_size = 0;
+  }
+}
+
 /* Name does *not* include the /. */ 
 pdf_obj *
 texpdf_new_name (const char *name)
 {
   pdf_obj  *result;
-  unsigned  length;
-  pdf_name *data;
+  pdf_name *atom;
 
+  atom = name_intern(name, 1);
+  atom->refs++;
   result = texpdf_new_obj(PDF_NAME);
-  data   = NEW (1, pdf_name);
-  result->data = data;
-  length = strlen(name);
-  if (length != 0) {
-    data->name = NEW(length+1, char);
-    memcpy(data->name, name, length);
-    data->name[length] = '\0';
-  } else {
-    data->name = NULL;
-  }
+  result->data = atom;
 
   return result;
 }
@@ -1030,9 +1798,14 @@ texpdf_new_name (const char *name)
 static void
 write_name (pdf_name *name, FILE *file)
 {
-  char *s;
+  char *s, *p;
   int i, length;
 
+  if (name->escaped) {
+    pdf_out(file, name->escaped, name->escaped_length);
+    return;
+  }
+
   s      = name->name;
   length = name->name ? strlen(name->name) : 0;
   /*
@@ -1054,26 +1827,22 @@ write_name (pdf_name *name, FILE *file)
                      (c) == '{' || (c) == '}' || \
                      (c) == '%')
 #endif
-  pdf_out_char(file, '/');
+  p = name->escaped = NEW(3*length + 2, char);
+  *p++ = '/';
   for (i = 0; i < length; i++) {
     if (s[i] < '!' || s[i] > '~' || s[i] == '#' || is_delim(s[i])) {
       /*     ^ "space" is here. */
-      pdf_out_char (file, '#');
-      pdf_out_xchar(file, s[i]);
+      *p++ = '#';
+      *p++ = xchar[(s[i] >> 4) & 0x0f];
+      *p++ = xchar[s[i] & 0x0f];
     } else {
-      pdf_out_char (file, s[i]);
+      *p++ = s[i];
     }
   }
-}
+  *p = '\0';
+  name->escaped_length = p - name->escaped;
 
-static void
-release_name (pdf_name *data)
-{
-  if (data->name != NULL) {
-    RELEASE(data->name);
-    data->name = NULL;
-  }
-  RELEASE(data);
+  pdf_out(file, name->escaped, name->escaped_length);
 }
 
 char *
@@ -1296,21 +2065,22 @@ pdf_pop_array (pdf_obj *array)
 static void
 write_dict (pdf_dict *dict, FILE *file)
 {
+  unsigned long i;
+
 #if 0
   pdf_out (file, "<<\n", 3); /* dropping \n saves few kb. */
 #else
   pdf_out (file, "<<", 2);
 #endif
-  while (dict->key != NULL) {
-    pdf_write_obj(dict->key, file);
-    if (pdf_need_white(PDF_NAME, (dict->value)->type)) {
+  for (i = 0; i < dict->size; i++) {
+    pdf_write_obj(dict->entries[i].key, file);
+    if (pdf_need_white(PDF_NAME, (dict->entries[i].value)->type)) {
       pdf_out_white(file);
     }
-    pdf_write_obj(dict->value, file);
+    pdf_write_obj(dict->entries[i].value, file);
 #if 0
     pdf_out_char (file, '\n'); /* removing this saves few kb. */
 #endif
-    dict = dict->next;
   }
   pdf_out (file, ">>", 2);
 }
@@ -1323,9 +2093,11 @@ texpdf_new_dict (void)
 
   result = texpdf_new_obj(PDF_DICT);
   data   = NEW(1, pdf_dict);
-  data->key    = NULL;
-  data->value  = NULL;
-  data->next   = NULL;
+  data->size       = 0;
+  data->max        = 0;
+  data->entries    = NULL;
+  data->index      = NULL;
+  data->index_size = 0;
   result->data = data;
 
   return result;
@@ -1334,26 +2106,94 @@ texpdf_new_dict (void)
 static void
 release_dict (pdf_dict *data)
 {
-  pdf_dict *next;
+  unsigned long i;
 
-  while (data != NULL && data->key != NULL) {
-    texpdf_release_obj(data->key);
-    texpdf_release_obj(data->value);
-    data->key   = NULL;
-    data->value = NULL;
-    next = data->next;
-    RELEASE(data);
-    data = next;
+  for (i = 0; i < data->size; i++) {
+    texpdf_release_obj(data->entries[i].key);
+    texpdf_release_obj(data->entries[i].value);
   }
+  if (data->entries)
+    RELEASE(data->entries);
+  if (data->index)
+    RELEASE(data->index);
   RELEASE(data);
 }
 
-/* Array is ended by a node with NULL this pointer */
+#define DICT_ALLOC_SIZE     8
+#define DICT_HASH_THRESHOLD 8
+
+static void
+dict_index_insert (pdf_dict *data, unsigned long pos)
+{
+  unsigned long mask = data->index_size - 1;
+  unsigned long slot = data->entries[pos].atom->hash & mask;
+
+  while (data->index[slot])
+    slot = (slot + 1) & mask;
+  data->index[slot] = pos + 1;
+}
+
+/* (Re)build the hash index; it is kept at most half full. */
+static void
+dict_rehash (pdf_dict *data)
+{
+  unsigned long i;
+
+  if (data->size <= DICT_HASH_THRESHOLD) {
+    if (data->index)
+      RELEASE(data->index);
+    data->index      = NULL;
+    data->index_size = 0;
+    return;
+  }
+
+  if (data->index_size < 2 * data->size) {
+    if (data->index)
+      RELEASE(data->index);
+    if (data->index_size == 0)
+      data->index_size = 2 * DICT_HASH_THRESHOLD;
+    while (data->index_size < 2 * data->size)
+      data->index_size *= 2;
+    data->index = NEW(data->index_size, unsigned long);
+  }
+  memset(data->index, 0, data->index_size * sizeof(unsigned long));
+  for (i = 0; i < data->size; i++)
+    dict_index_insert(data, i);
+}
+
+/* Returns the position of the entry for key, or -1. */
+static long
+dict_find (pdf_dict *data, pdf_name *atom)
+{
+  unsigned long i;
+
+  if (data->index) {
+    unsigned long mask = data->index_size - 1;
+    unsigned long slot = atom->hash & mask;
+
+    while (data->index[slot]) {
+      i = data->index[slot] - 1;
+      if (data->entries[i].atom == atom)
+        return (long) i;
+      slot = (slot + 1) & mask;
+    }
+  } else {
+    for (i = 0; i < data->size; i++) {
+      if (data->entries[i].atom == atom)
+        return (long) i;
+    }
+  }
+
+  return -1;
+}
+
 /* texpdf_add_dict returns 0 if the key is new and non-zero otherwise */
 int
 texpdf_add_dict (pdf_obj *dict, pdf_obj *key, pdf_obj *value)
 {
-  pdf_dict *data, *new_node;
+  pdf_dict     *data;
+  pdf_name     *atom;
+  long          pos;
 
   TYPECHECK(dict, PDF_DICT);
   TYPECHECK(key,  PDF_NAME);
@@ -1362,28 +2202,36 @@ texpdf_add_dict (pdf_obj *dict, pdf_obj *key, pdf_obj *value)
   if (value != NULL && INVALIDOBJ(value))
     ERROR("texpdf_add_dict(): Passed invalid value");
 
+  data = dict->data;
+  atom = key->data;
+
   /* If this key already exists, simply replace the value */
-  for (data = dict->data; data->key != NULL; data = data->next) {
-    if (!strcmp(texpdf_name_value(key), texpdf_name_value(data->key))) {
-      /* Release the old value */
-      texpdf_release_obj(data->value);
-      /* Release the new key (we don't need it) */
-      texpdf_release_obj(key);
-      data->value = value;
-      return 1;
-    }
+  pos = dict_find(data, atom);
+  if (pos >= 0) {
+    /* Release the old value */
+    texpdf_release_obj(data->entries[pos].value);
+    /* Release the new key (we don't need it) */
+    texpdf_release_obj(key);
+    data->entries[pos].value = value;
+    return 1;
   }
-  /*
-   * We didn't find the key. We build a new "end" node and add
-   * the new key just before the end
-   */
-  new_node = NEW (1, pdf_dict);
-  new_node->key = NULL;
-  new_node->value = NULL;
-  new_node->next = NULL;
-  data->next  = new_node;
-  data->key   = key;
-  data->value = value;
+
+  if (data->size == data->max) {
+    data->max += data->max ? data->max : DICT_ALLOC_SIZE;
+    data->entries = RENEW(data->entries, data->max, struct pdf_dict_entry);
+  }
+  data->entries[data->size].key   = key;
+  data->entries[data->size].value = value;
+  data->entries[data->size].atom  = atom;
+  data->size++;
+
+  if (data->size > DICT_HASH_THRESHOLD) {
+    if (data->index_size < 2 * data->size)
+      dict_rehash(data);
+    else
+      dict_index_insert(data, data->size - 1);
+  }
+
   return 0;
 }
 
@@ -1391,44 +2239,11 @@ texpdf_add_dict (pdf_obj *dict, pdf_obj *key, pdf_obj *value)
 void
 texpdf_put_dict (pdf_obj *dict, const char *key, pdf_obj *value)
 {
-  pdf_dict *data;
-
-  TYPECHECK(dict, PDF_DICT);
-
   if (!key) {
     ERROR("texpdf_put_dict(): Passed invalid key.");
   }
-  /* It seems that NULL is sometimes used for null object... */
-  if (value != NULL && INVALIDOBJ(value)) {
-    ERROR("texpdf_add_dict(): Passed invalid value.");
-  }
-
-  data = dict->data;
-
-  while (data->key != NULL) {
-    if (!strcmp(key, texpdf_name_value(data->key))) {
-      texpdf_release_obj(data->value);
-      data->value = value;
-      break;
-    }
-    data = data->next;
-  }
-
-  /*
-   * If we didn't find the key, build a new "end" node and add
-   * the new key just before the end
-   */
-  if (data->key == NULL) {
-    pdf_dict *new_node;
 
-    new_node = NEW (1, pdf_dict);
-    new_node->key   = NULL;
-    new_node->value = NULL;
-    new_node->next  = NULL;
-    data->next  = new_node;
-    data->key   = texpdf_new_name(key);
-    data->value = value;
-  }
+  texpdf_add_dict(dict, texpdf_new_name(key), value);
 }
 #endif
 
@@ -1436,15 +2251,17 @@ texpdf_put_dict (pdf_obj *dict, const char *key, pdf_obj *value)
 void
 texpdf_merge_dict (pdf_obj *dict1, pdf_obj *dict2)
 {
-  pdf_dict *data;
+  pdf_dict     *data;
+  unsigned long i;
 
   TYPECHECK(dict1, PDF_DICT);
   TYPECHECK(dict2, PDF_DICT);
 
   data = dict2->data;
-  while (data->key != NULL) {
-    texpdf_add_dict(dict1, texpdf_link_obj(data->key), texpdf_link_obj(data->value));
-    data = data->next;
+  for (i = 0; i < data->size; i++) {
+    texpdf_add_dict(dict1,
+                    texpdf_link_obj(data->entries[i].key),
+                    texpdf_link_obj(data->entries[i].value));
   }
 }
 
@@ -1452,60 +2269,62 @@ int
 texpdf_foreach_dict (pdf_obj *dict,
 		  int (*proc) (pdf_obj *, pdf_obj *, void *), void *pdata)
 {
-  int       error = 0;
-  pdf_dict *data;
+  int           error = 0;
+  pdf_dict     *data;
+  unsigned long i;
 
   ASSERT(proc);
 
   TYPECHECK(dict, PDF_DICT);
 
   data = dict->data;
-  while (!error &&
-	 data->key != NULL) {
-    error = proc(data->key, data->value, pdata);
-    data = data->next;
+  /* proc() may add entries, so re-read the vector every time. */
+  for (i = 0; !error && i < data->size; i++) {
+    error = proc(data->entries[i].key, data->entries[i].value, pdata);
   }
 
   return error;
 }
 
-#define pdf_match_name(o,s) ((o) && (s) && !strcmp(((pdf_name *)(o)->data)->name, (s)))
 pdf_obj *
 texpdf_lookup_dict (pdf_obj *dict, const char *name)
 {
   pdf_dict *data;
+  pdf_name *atom;
+  long      pos;
 
   ASSERT(name);
 
   TYPECHECK(dict, PDF_DICT);
 
+  /* A name that was never interned cannot be a key. */
+  atom = name_intern(name, 0);
+  if (!atom)
+    return NULL;
+
   data = dict->data;
-  while (data->key != NULL) {
-    if (!strcmp(name, texpdf_name_value(data->key))) {
-      return data->value;
-    }
-    data = data->next;
-  }
+  pos  = dict_find(data, atom);
 
-  return NULL;
+  return pos >= 0 ? data->entries[pos].value : NULL;
 }
 
 /* Returns array of dictionary keys */
 pdf_obj *
 pdf_dict_keys (pdf_obj *dict)
 {
-  pdf_obj  *keys;
-  pdf_dict *data;
+  pdf_obj      *keys;
+  pdf_dict     *data;
+  unsigned long i;
 
   TYPECHECK(dict, PDF_DICT);
 
   keys = texpdf_new_array();
-  for (data = dict->data; (data &&
-			   data->key != NULL); data = data->next) {
+  data = dict->data;
+  for (i = 0; i < data->size; i++) {
     /* We duplicate name object rather than linking keys.
      * If we forget to free keys, broken PDF is generated.
      */
-    texpdf_add_array(keys, texpdf_new_name(texpdf_name_value(data->key)));
+    texpdf_add_array(keys, texpdf_new_name(texpdf_name_value(data->entries[i].key)));
   }
 
   return keys;
@@ -1514,22 +2333,28 @@ pdf_dict_keys (pdf_obj *dict)
 void
 texpdf_remove_dict (pdf_obj *dict, const char *name)
 {
-  pdf_dict *data, **data_p;
+  pdf_dict *data;
+  pdf_name *atom;
+  long      pos;
 
   TYPECHECK(dict, PDF_DICT);
 
-  data   = dict->data;
-  data_p = (pdf_dict **) (void *) &(dict->data);
-  while (data->key != NULL) {
-    if (pdf_match_name(data->key, name)) {
-      texpdf_release_obj(data->key);
-      texpdf_release_obj(data->value);
-      *data_p = data->next;
-      RELEASE(data);
-      break;
-    }
-    data_p = &(data->next);
-    data   = data->next;
+  if (!name || !(atom = name_intern(name, 0)))
+    return;
+
+  data = dict->data;
+  pos  = dict_find(data, atom);
+  if (pos >= 0) {
+    pdf_obj *key   = data->entries[pos].key;
+    pdf_obj *value = data->entries[pos].value;
+
+    data->size--;
+    memmove(data->entries + pos, data->entries + pos + 1,
+            (data->size - pos) * sizeof(struct pdf_dict_entry));
+    if (data->index)
+      dict_rehash(data);
+    texpdf_release_obj(key);
+    texpdf_release_obj(value);
   }
 }
 
@@ -1548,10 +2373,12 @@ texpdf_new_stream (int flags)
    */
   data->dict   = texpdf_new_dict();
   data->_flags = flags;
+  data->_class = STREAM_CLASS_DEFAULT;
   data->stream = NULL;
   data->stream_length = 0;
   data->max_length    = 0;
   data->objstm_data = NULL;
+  data->map         = NULL;
 
   result->data = data;
   result->flags |= OBJ_NO_OBJSTM;
@@ -1559,23 +2386,110 @@ texpdf_new_stream (int flags)
   return result;
 }
 
+#ifdef HAVE_ZLIB
+/*
+ * FlateDecode is the first filter to be applied to the stream.
+ * Returns the number of bytes this adds to the stream dictionary.
+ */
+static int
+stream_add_flate_filter (pdf_stream *stream)
+{
+  pdf_obj *filters     = texpdf_lookup_dict(stream->dict, "Filter");
+  pdf_obj *filter_name = texpdf_new_name("FlateDecode");
+
+  if (filters) {
+    pdf_unshift_array(filters, filter_name);
+    return strlen("/FlateDecode ");
+  } else {
+    /*
+     * Adding the filter as a name instead of a one-element array
+     * is crucial because otherwise Adobe Reader cannot read the
+     * cross-reference stream any more, cf. the PDF v1.5 Errata.
+     */
+    texpdf_add_dict(stream->dict, texpdf_new_name("Filter"), filter_name);
+    return strlen("/Filter/FlateDecode\n");
+  }
+}
+#endif /* HAVE_ZLIB */
+
+/*
+ * Large streams are deflated straight into the output instead of into
+ * a second buffer. Their /Length is then an indirect object, written
+ * by pdf_flush_obj() right after the stream.
+ */
+#define STREAM_DEFLATE_DIRECT (1UL << 20)
+#define STREAM_DEFLATE_CHUNK  16384
+
+static pdf_obj *stream_length_obj = NULL;
+
+#ifdef HAVE_ZLIB
+static void
+write_stream_deflate (pdf_stream *stream, FILE *file)
+{
+  z_stream       z;
+  unsigned char  out[STREAM_DEFLATE_CHUNK];
+  unsigned char *in        = stream->stream;
+  unsigned long  in_length = stream->stream_length;
+  unsigned long  length    = 0;
+  int            filter_length, flush, status;
+
+  ASSERT(!stream_length_obj);
+
+  filter_length = stream_add_flate_filter(stream);
+  stream_length_obj = texpdf_new_number(0);
+  texpdf_add_dict(stream->dict,
+                  texpdf_new_name("Length"), texpdf_ref_obj(stream_length_obj));
+
+  pdf_write_obj(stream->dict, file);
+  pdf_out(file, "\nstream\n", 8);
+
+  z.zalloc = Z_NULL;
+  z.zfree  = Z_NULL;
+  z.opaque = Z_NULL;
+  if (deflateInit(&z, stream_compression_level(stream)) != Z_OK)
+    ERROR("Zlib error");
+  do {
+    /* avail_in is only an uInt */
+    z.next_in  = in;
+    z.avail_in = in_length > 0x40000000UL ? 0x40000000UL : in_length;
+    in        += z.avail_in;
+    in_length -= z.avail_in;
+    flush = in_length > 0 ? Z_NO_FLUSH : Z_FINISH;
+    do {
+      z.next_out  = out;
+      z.avail_out = STREAM_DEFLATE_CHUNK;
+      status = deflate(&z, flush);
+      if (status == Z_STREAM_ERROR)
+        ERROR("Zlib error");
+      pdf_out(file, out, STREAM_DEFLATE_CHUNK - z.avail_out);
+      length += STREAM_DEFLATE_CHUNK - z.avail_out;
+    } while (z.avail_out == 0);
+  } while (flush != Z_FINISH);
+  if (status != Z_STREAM_END)
+    ERROR("Zlib error");
+  deflateEnd(&z);
+
+  compression_saved += stream->stream_length - length - filter_length;
+  texpdf_set_number(stream_length_obj, length);
+
+  pdf_out(file, "\n", 1);
+  pdf_out(file, "endstream", 9);
+}
+#endif /* HAVE_ZLIB */
+
 static void
 write_stream (pdf_stream *stream, FILE *file)
 {
   unsigned char *filtered;
   unsigned long  filtered_length;
-  unsigned long  buffer_length;
-  unsigned char *buffer;
+  int            level = stream_compression_level(stream);
 
   /*
-   * Always work from a copy of the stream. All filters read from
-   * "filtered" and leave their result in "filtered".
+   * Filters read from "filtered" and leave their result in a new
+   * buffer. The stream data itself is only copied if it has to be
+   * encrypted in place.
    */
-#if 0
-  filtered = NEW(stream->stream_length + 1, unsigned char);
-#endif
-  filtered = NEW(stream->stream_length, unsigned char);
-  memcpy(filtered, stream->stream, stream->stream_length);
+  filtered        = stream->stream;
   filtered_length = stream->stream_length;
 
 #if 0
@@ -1587,48 +2501,36 @@ write_stream (pdf_stream *stream, FILE *file)
   /* Apply compression filter if requested */
   if (stream->stream_length > 0 &&
       (stream->_flags & STREAM_COMPRESS) &&
-      compression_level > 0) {
-
-    pdf_obj *filters = texpdf_lookup_dict(stream->dict, "Filter");
-
-    buffer_length = filtered_length + filtered_length/1000 + 14;
-    buffer = NEW(buffer_length, unsigned char);
-    {
-      pdf_obj *filter_name = texpdf_new_name("FlateDecode");
-
-      if (filters)
-        /*
-         * FlateDecode is the first filter to be applied to the stream.
-         */
-        pdf_unshift_array(filters, filter_name);
-      else
-        /*
-         * Adding the filter as a name instead of a one-element array
-         * is crucial because otherwise Adobe Reader cannot read the
-         * cross-reference stream any more, cf. the PDF v1.5 Errata.
-         */
-        texpdf_add_dict(stream->dict, texpdf_new_name("Filter"), filter_name);
-    }
-#ifdef HAVE_ZLIB_COMPRESS2    
-    if (compress2(buffer, &buffer_length, filtered,
-		  filtered_length, compression_level)) {
-      ERROR("Zlib error");
-    }
-#else 
-    if (compress(buffer, &buffer_length, filtered,
-		 filtered_length)) {
-      ERROR ("Zlib error");
+      level > 0) {
+    unsigned long  buffer_length;
+    unsigned char *buffer;
+    int            filter_length;
+
+    /* Only zlib can deflate incrementally. */
+    if (stream->stream_length >= STREAM_DEFLATE_DIRECT &&
+        compress_backends[compress_backend].compress == compress_zlib &&
+        file == pdf_output_file && !enc_mode && !linearize_file) {
+      write_stream_deflate(stream, file);
+      return;
     }
-#endif /* HAVE_ZLIB_COMPRESS2 */
-    RELEASE(filtered);
-    compression_saved += filtered_length - buffer_length
-      - (filters ? strlen("/FlateDecode "): strlen("/Filter/FlateDecode\n"));
+
+    filter_length = stream_add_flate_filter(stream);
+    buffer = compress_backends[compress_backend].compress(filtered, filtered_length,
+                                                          level, &buffer_length);
+    if (!buffer)
+      ERROR("Compression failed (%s)", compress_backends[compress_backend].name);
+    compression_saved += filtered_length - buffer_length - filter_length;
 
     filtered        = buffer;
     filtered_length = buffer_length;
   }
 #endif /* HAVE_ZLIB */
 
+  if (enc_mode && filtered == stream->stream && filtered_length > 0) {
+    filtered = NEW(filtered_length, unsigned char);
+    memcpy(filtered, stream->stream, filtered_length);
+  }
+
 #if 0
   /*
    * An optional end-of-line marker preceding the "endstream" is
@@ -1654,7 +2556,8 @@ write_stream (pdf_stream *stream, FILE *file)
   if (filtered_length > 0) {
     pdf_out(file, filtered, filtered_length);
   }
-  RELEASE(filtered);
+  if (filtered != stream->stream)
+    RELEASE(filtered);
 
   /*
    * This stream length "object" gets reset every time write_stream is
@@ -1667,13 +2570,31 @@ write_stream (pdf_stream *stream, FILE *file)
   pdf_out(file, "endstream", 9);
 }
 
+void
+texpdf_stream_set_class (pdf_obj *stream, int stream_class)
+{
+  pdf_stream *data;
+
+  TYPECHECK(stream, PDF_STREAM);
+
+  if (stream_class < 0 || stream_class >= STREAM_CLASS_MAX)
+    ERROR("texpdf_stream_set_class(): invalid stream class: %d", stream_class);
+
+  data = stream->data;
+  data->_class = stream_class;
+}
+
 static void
 release_stream (pdf_stream *stream)
 {
   texpdf_release_obj(stream->dict);
   stream->dict = NULL;
 
-  if (stream->stream) {
+  if (stream->map) {
+    input_map_release(stream->map);
+    stream->map    = NULL;
+    stream->stream = NULL;
+  } else if (stream->stream) {
     RELEASE(stream->stream);
     stream->stream = NULL;
   }
@@ -1736,6 +2657,49 @@ get_objstm_data (pdf_obj *objstm) {
   return ((pdf_stream *) objstm->data)->objstm_data;
 }
 
+/* Give STREAM its own copy of data borrowed from an input file. */
+static void
+stream_unshare (pdf_stream *stream)
+{
+  unsigned char *copy;
+
+  if (!stream->map)
+    return;
+  copy = NEW(stream->stream_length, unsigned char);
+  memcpy(copy, stream->stream, stream->stream_length);
+  input_map_release(stream->map);
+  stream->map        = NULL;
+  stream->stream     = copy;
+  stream->max_length = stream->stream_length;
+}
+
+/*
+ * Like texpdf_add_stream(), but data of an empty stream that lies
+ * within the mapping of PF is referenced rather than copied.
+ */
+void
+pdf_add_stream_mapped (pdf_obj *stream, pdf_file *pf,
+                       const void *stream_data, long length)
+{
+  pdf_stream       *data;
+  struct input_map *map = pf ? pf->map : NULL;
+  const char       *p   = stream_data;
+
+  TYPECHECK(stream, PDF_STREAM);
+
+  data = stream->data;
+  if (!map || length < 1 || data->stream_length > 0 ||
+      p < map->data || p + length > map->data + map->size) {
+    texpdf_add_stream(stream, stream_data, length);
+    return;
+  }
+  map->refcount++;
+  data->map           = map;
+  data->stream        = (unsigned char *) stream_data;
+  data->stream_length = length;
+  data->max_length    = length;
+}
+
 void
 texpdf_add_stream (pdf_obj *stream, const void *stream_data, long length)
 {
@@ -1746,6 +2710,7 @@ texpdf_add_stream (pdf_obj *stream, const void *stream_data, long length)
   if (length < 1)
     return;
   data = stream->data;
+  stream_unshare(data);
   if (data->stream_length + length > data->max_length) {
     data->max_length += length + STREAM_ALLOC_SIZE;
     data->stream      = RENEW(data->stream, data->max_length, unsigned char);
@@ -1823,17 +2788,25 @@ get_decode_parms (struct decode_parms *parms, pdf_obj *dict)
   parms->columns   = 1;
 
   tmp = pdf_deref_obj(texpdf_lookup_dict(dict, "Predictor"));
-  if (tmp)
+  if (tmp) {
     parms->predictor = texpdf_number_value(tmp);
-  tmp = pdf_deref_obj(texpdf_lookup_dict(dict, "Colors"));
-  if (tmp)
+    texpdf_release_obj(tmp);
+  }
+  tmp = pdf_deref_obj(texpdf_lookup_dict(dict, "Colors"));
+  if (tmp) {
     parms->colors = texpdf_number_value(tmp);
+    texpdf_release_obj(tmp);
+  }
   tmp = pdf_deref_obj(texpdf_lookup_dict(dict, "BitsPerComponent"));
-  if (tmp)
+  if (tmp) {
     parms->bits_per_component = texpdf_number_value(tmp);
+    texpdf_release_obj(tmp);
+  }
   tmp = pdf_deref_obj(texpdf_lookup_dict(dict, "Columns"));
-  if (tmp)
+  if (tmp) {
     parms->columns = texpdf_number_value(tmp);
+    texpdf_release_obj(tmp);
+  }
 
   if (parms->bits_per_component != 1 &&
       parms->bits_per_component != 2 &&
@@ -1900,6 +2873,65 @@ filter_row_TIFF2 (unsigned char *dst, const unsigned char *src,
   return 0;
 }
 
+/* Undo PNG predictor TYPE for one row of LENGTH bytes at P into BUF;
+ * PREV is the previous decoded row (zeros for the first row).
+ */
+static int
+filter_row_PNG (unsigned char *buf, const unsigned char *prev,
+                const unsigned char *p, int type, int length,
+                int bytes_per_pixel)
+{
+  int i;
+
+  switch (type) {
+  case 0: /* Do nothing just skip first byte */
+    memcpy(buf, p, length);
+    break;
+  case 1:
+    for (i = 0; i < length; i++) {
+      int pv = i - bytes_per_pixel >= 0 ? buf[i - bytes_per_pixel] : 0;
+      buf[i] = (unsigned char)(((int) p[i] + pv) & 0xff);
+    }
+    break;
+  case 2:
+    for (i = 0; i < length; i++) {
+      buf[i] = (unsigned char)(((int) p[i] + (int) prev[i]) & 0xff);
+    }
+    break;
+  case 3:
+    for (i = 0; i < length; i++) {
+      int up   = prev[i];
+      int left = i - bytes_per_pixel >= 0 ? buf[i - bytes_per_pixel] : 0;
+      int tmp  = floor((up + left) / 2);
+      buf[i] = (unsigned char)((p[i] + tmp) & 0xff);
+    }
+    break;
+  case 4:
+    for (i = 0; i < length; i++) {
+      int a = i - bytes_per_pixel >= 0 ? buf[i - bytes_per_pixel] : 0; /* left */
+      int b = prev[i]; /* above */
+      int c = i - bytes_per_pixel >= 0 ? prev[i - bytes_per_pixel] : 0; /* upper left */
+      int q = a + b - c;
+      int qa = q - a, qb = q - b, qc = q - c;
+      qa = qa < 0 ? -qa : qa;
+      qb = qb < 0 ? -qb : qb;
+      qc = qc < 0 ? -qc : qc;
+      if (qa <= qb && qa <= qc)
+        buf[i] = (unsigned char) (((int) p[i] + a) & 0xff);
+      else if (qb <= qc)
+        buf[i] = (unsigned char) (((int) p[i] + b) & 0xff);
+      else
+        buf[i] = (unsigned char) (((int) p[i] + c) & 0xff);
+    }
+    break;
+  default:
+    WARN("Unknown PNG predictor type: %d", type);
+    return -1;
+  }
+
+  return 0;
+}
+
 /* This routine is inefficient. Length is typically 4 for Xref streams.
  * Especially, calling texpdf_add_stream() for each 4 bytes append is highly
  * inefficient.
@@ -1980,51 +3012,8 @@ filter_decoded (pdf_obj *dst, const void *src, long srclen,
           error = -1;
         }
         p++;
-        switch (type) {
-        case 0: /* Do nothing just skip first byte */
-          memcpy(buf, p, length);
-          break;
-        case 1:
-          for (i = 0; i < length; i++) {
-            int pv = i - bytes_per_pixel >= 0 ? buf[i - bytes_per_pixel] : 0;
-            buf[i] = (unsigned char)(((int) p[i] + pv) & 0xff);
-          }
-          break;
-        case 2:
-          for (i = 0; i < length; i++) {
-            buf[i] = (unsigned char)(((int) p[i] + (int) prev[i]) & 0xff);
-          }
-          break;
-        case 3:
-          for (i = 0; i < length; i++) {
-            int up   = prev[i];
-            int left = i - bytes_per_pixel >= 0 ? buf[i - bytes_per_pixel] : 0;
-            int tmp  = floor((up + left) / 2);
-            buf[i] = (unsigned char)((p[i] + tmp) & 0xff);
-          }
-          break;
-        case 4:
-          for (i = 0; i < length; i++) {
-            int a = i - bytes_per_pixel >= 0 ? buf[i - bytes_per_pixel] : 0; /* left */
-            int b = prev[i]; /* above */
-            int c = i - bytes_per_pixel >= 0 ? prev[i - bytes_per_pixel] : 0; /* upper left */
-            int q = a + b - c;
-            int qa = q - a, qb = q - b, qc = q - c;
-            qa = qa < 0 ? -qa : qa;
-            qb = qb < 0 ? -qb : qb;
-            qc = qc < 0 ? -qc : qc;
-            if (qa <= qb && qa <= qc)
-              buf[i] = (unsigned char) (((int) p[i] + a) & 0xff);
-            else if (qb <= qc)
-              buf[i] = (unsigned char) (((int) p[i] + b) & 0xff);
-            else
-              buf[i] = (unsigned char) (((int) p[i] + c) & 0xff);
-          }
-          break;
-        default:
-          WARN("Unknown PNG predictor type: %d", type);
+        if (filter_row_PNG(buf, prev, p, type, length, bytes_per_pixel))
           error = -1;
-        }
         if (!error) {
           texpdf_add_stream(dst, buf, length); /* highly inefficient */
           memcpy(prev, buf, length);
@@ -2089,6 +3078,151 @@ texpdf_add_stream_flate_filtered (pdf_obj *dst, const void *data, long len, stru
 
   return ((!error && inflateEnd(&z) == Z_OK) ? 0 : -1);
 }
+
+/* Is SRC a FlateDecode stream without predictor and with a zlib header? */
+static int
+stream_is_plain_flate (pdf_obj *src)
+{
+  pdf_obj             *dict   = texpdf_stream_dict(src), *filter, *parms;
+  const unsigned char *p      = pdf_stream_dataptr(src);
+  long                 length = pdf_stream_length(src);
+
+  filter = texpdf_lookup_dict(dict, "Filter");
+  if (PDF_OBJ_ARRAYTYPE(filter) && texpdf_array_length(filter) == 1)
+    filter = texpdf_get_array(filter, 0);
+  if (!PDF_OBJ_NAMETYPE(filter) ||
+      strcmp(texpdf_name_value(filter), "FlateDecode"))
+    return 0;
+  parms = texpdf_lookup_dict(dict, "DecodeParms");
+  if (parms && !PDF_OBJ_NULLTYPE(parms))
+    return 0;
+
+  return (length >= 6 && (p[0] & 0x0f) == Z_DEFLATED && (p[0] >> 4) <= 7 &&
+          !(p[1] & 0x20) && ((p[0] << 8) + p[1]) % 31 == 0);
+}
+
+/*
+ * Join the FlateDecode streams SRCS[0..N-1] into the empty stream DST
+ * without recompressing them, as zlib's gzjoin does: the data is only
+ * inflated to find the last block of each stream, whose BFINAL bit is
+ * cleared, and empty blocks are appended to get to a byte boundary.
+ * Returns -1, leaving DST empty, if that is not possible.
+ */
+int
+pdf_join_flate_streams (pdf_obj *dst, pdf_obj **srcs, int n)
+{
+  pdf_stream   *data;
+  unsigned long adler = 1;
+  Bytef         wbuf[WBUF_SIZE];
+  int           i;
+
+  TYPECHECK(dst, PDF_STREAM);
+
+  data = dst->data;
+  if (n < 1 || data->stream_length > 0)
+    return -1;
+  for (i = 0; i < n; i++) {
+    if (!stream_is_plain_flate(srcs[i]))
+      return -1;
+  }
+
+  for (i = 0; i < n; i++) {
+    const unsigned char *p      = pdf_stream_dataptr(srcs[i]);
+    long                 length = pdf_stream_length(srcs[i]);
+    long                 base, pos, hdr = -1, end = -1;
+    int                  mask = 0, left = 0, status;
+    unsigned char        last;
+    z_stream             z;
+
+    if (i == 0)
+      texpdf_add_stream(dst, p, 2); /* zlib header */
+    base = data->stream_length - 2;
+
+    z.zalloc = Z_NULL; z.zfree = Z_NULL; z.opaque = Z_NULL;
+    z.next_in  = (z_const Bytef *) p; z.avail_in = length;
+    if (inflateInit(&z) != Z_OK) {
+      WARN("inflateInit() failed.");
+      data->stream_length = 0;
+      return -1;
+    }
+    /* Stop at block boundaries to keep track of the last block header */
+    do {
+      z.next_out = wbuf; z.avail_out = WBUF_SIZE;
+      status = inflate(&z, Z_BLOCK);
+      if (status == Z_OK && end < 0 && (z.data_type & 128)) {
+        pos  = z.next_in - p;
+        left = z.data_type & 7; /* unused bits in p[pos-1] */
+        if (z.data_type & 64)
+          end = pos;
+        else if (left) {
+          hdr = pos - 1; mask = 0x100 >> left;
+        } else {
+          hdr = pos; mask = 1;
+        }
+      }
+    } while (status == Z_OK);
+    inflateEnd(&z);
+    if (status != Z_STREAM_END || hdr < 2 || end <= hdr) {
+      data->stream_length = 0;
+      return -1;
+    }
+    adler = i == 0 ? z.adler : adler32_combine(adler, z.adler, z.total_out);
+
+    texpdf_add_stream(dst, p + 2, end - 3);
+    last = p[end - 1];
+    if (i == n - 1) {
+      texpdf_add_stream(dst, &last, 1);
+      continue;
+    }
+    if (hdr == end - 1)
+      last &= ~mask;
+    else
+      data->stream[base + hdr] &= ~mask;
+    if (left == 0)
+      texpdf_add_stream(dst, &last, 1);
+    else {
+      last &= (0x100 >> left) - 1;
+      if (left & 1) {
+        /* Empty stored block */
+        texpdf_add_stream(dst, &last, 1);
+        if (left == 1)
+          texpdf_add_stream(dst, "\0", 1);
+        texpdf_add_stream(dst, "\0\0\377\377", 4);
+      } else {
+        /* One to three empty fixed blocks */
+        unsigned char b;
+        switch (left) {
+        case 6:
+          b = last | 0x08;
+          texpdf_add_stream(dst, &b, 1);
+          last = 0;
+          /* fall through */
+        case 4:
+          b = last | 0x20;
+          texpdf_add_stream(dst, &b, 1);
+          last = 0;
+          /* fall through */
+        case 2:
+          b = last | 0x80;
+          texpdf_add_stream(dst, &b, 1);
+          texpdf_add_stream(dst, "\0", 1);
+        }
+      }
+    }
+  }
+
+  {
+    unsigned char trailer[4];
+
+    trailer[0] = (adler >> 24) & 0xff; trailer[1] = (adler >> 16) & 0xff;
+    trailer[2] = (adler >>  8) & 0xff; trailer[3] = adler & 0xff;
+    texpdf_add_stream(dst, trailer, 4);
+  }
+  texpdf_add_dict(data->dict,
+                  texpdf_new_name("Filter"), texpdf_new_name("FlateDecode"));
+
+  return 0;
+}
 #endif
 
 int
@@ -2245,17 +3379,356 @@ pdf_write_obj (pdf_obj *object, FILE *file)
   }
 }
 
+/*
+ * Deferred output.
+ *
+ * With compression threads enabled, a compressible stream is handed
+ * to a worker when it is flushed and a placeholder is queued. Objects
+ * flushed while the queue is not empty are serialized into memory and
+ * queued behind it. The queue is written out in order as compression
+ * finishes, so file offsets (and thus the whole file) come out exactly
+ * as with serial compression. Streams of STREAM_DEFLATE_DIRECT bytes
+ * or more are never held in memory: they wait for the queue to drain
+ * and are then written directly. Every object starts right after the
+ * previous "endobj" line, so line-length decisions in pdf_out_white()
+ * do not depend on when it is actually written.
+ */
+#define COMPRESS_MIN_LENGTH 1024
+
+struct compress_job
+{
+  unsigned char *data;
+  unsigned long  length;
+  unsigned char *result;
+  unsigned long  result_length;
+  texpdf_compress_func compress;
+  int            backend; /* index into compress_backends[] */
+  int            level;
+  int            done;
+  int            error;
+  struct compress_job *next;
+};
+
+struct deferred_obj
+{
+  unsigned long  label;
+  unsigned short generation;
+  int            flags;
+  /* Plain object: its serialized form */
+  char          *bytes;
+  long           length, max_length;
+  /* Stream: dictionary and pending compression */
+  pdf_obj       *dict;
+  int            filter_length;
+  struct compress_job *job;
+  struct deferred_obj *next;
+};
+
+static struct deferred_obj *deferred_head = NULL;
+static struct deferred_obj *deferred_tail = NULL;
+static long deferred_size = 0; /* bytes held by the queue */
+
+#ifdef HAVE_PTHREAD
+static pthread_t      *workers     = NULL;
+static int             num_workers = 0;
+static int             workers_stop = 0;
+static pthread_mutex_t work_lock   = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  work_ready  = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t  work_done   = PTHREAD_COND_INITIALIZER;
+static struct compress_job *work_head = NULL, *work_tail = NULL;
+
+/* Runs in a worker thread: must not call NEW() or ERROR(). */
+static void
+compress_job_run (struct compress_job *job)
+{
+  job->result = job->compress(job->data, job->length, job->level,
+                              &job->result_length);
+  job->error  = job->result == NULL;
+  free(job->data);
+  job->data = NULL;
+}
+
+static void *
+compress_worker (void *arg)
+{
+  struct compress_job *job;
+
+  pthread_mutex_lock(&work_lock);
+  for (;;) {
+    while (!work_head && !workers_stop)
+      pthread_cond_wait(&work_ready, &work_lock);
+    if (!work_head)
+      break;
+    job = work_head;
+    work_head = job->next;
+    if (!work_head)
+      work_tail = NULL;
+    pthread_mutex_unlock(&work_lock);
+
+    compress_job_run(job);
+
+    pthread_mutex_lock(&work_lock);
+    job->done = 1;
+    pthread_cond_broadcast(&work_done);
+  }
+  pthread_mutex_unlock(&work_lock);
+
+  return arg;
+}
+
+static void
+workers_start (void)
+{
+  int i;
+
+  workers = NEW(compression_threads, pthread_t);
+  workers_stop = 0;
+  for (i = 0; i < compression_threads; i++) {
+    if (pthread_create(&workers[i], NULL, compress_worker, NULL))
+      break;
+    num_workers++;
+  }
+  if (num_workers == 0) {
+    WARN("Could not start compression threads, compressing streams serially.");
+    RELEASE(workers);
+    workers = NULL;
+    deferred_enabled = 0;
+  }
+}
+
+static void
+workers_shutdown (void)
+{
+  int i;
+
+  if (!workers)
+    return;
+
+  pthread_mutex_lock(&work_lock);
+  workers_stop = 1;
+  pthread_cond_broadcast(&work_ready);
+  pthread_mutex_unlock(&work_lock);
+  for (i = 0; i < num_workers; i++)
+    pthread_join(workers[i], NULL);
+  RELEASE(workers);
+  workers     = NULL;
+  num_workers = 0;
+}
+
+static void
+compress_job_submit (struct compress_job *job)
+{
+  pthread_mutex_lock(&work_lock);
+  job->next = NULL;
+  if (work_tail)
+    work_tail->next = job;
+  else
+    work_head = job;
+  work_tail = job;
+  pthread_cond_signal(&work_ready);
+  pthread_mutex_unlock(&work_lock);
+}
+
+static int
+compress_job_done (struct compress_job *job, int wait)
+{
+  int done;
+
+  pthread_mutex_lock(&work_lock);
+  while (wait && !job->done)
+    pthread_cond_wait(&work_done, &work_lock);
+  done = job->done;
+  pthread_mutex_unlock(&work_lock);
+
+  return done;
+}
+
+/* Queue the stream for compression if it is worth it. */
+static int
+deferred_add_stream (pdf_obj *object)
+{
+  pdf_stream          *stream = object->data;
+  struct deferred_obj *d;
+  struct compress_job *job;
+
+  if (!deferred_enabled || !compress_backends[compress_backend].compress ||
+      stream_compression_level(stream) == 0 ||
+      !(stream->_flags & STREAM_COMPRESS) ||
+      stream->stream_length < COMPRESS_MIN_LENGTH ||
+      stream->stream_length >= STREAM_DEFLATE_DIRECT)
+    return 0;
+
+  if (!workers)
+    workers_start();
+  if (!workers)
+    return 0;
+
+  stream_unshare(stream);
+  job = NEW(1, struct compress_job);
+  job->data   = stream->stream;
+  job->length = stream->stream_length;
+  job->compress = compress_backends[compress_backend].compress;
+  job->backend  = compress_backend;
+  job->level  = stream_compression_level(stream);
+  job->result = NULL;
+  job->result_length = 0;
+  job->done   = 0;
+  job->error  = 0;
+  /* The stream is about to be released; take over its data. */
+  stream->stream        = NULL;
+  stream->stream_length = 0;
+  stream->max_length    = 0;
+
+  d = NEW(1, struct deferred_obj);
+  d->label      = object->label;
+  d->generation = object->generation;
+  d->flags      = object->flags;
+  d->bytes      = NULL;
+  d->length     = d->max_length = 0;
+  d->filter_length = stream_add_flate_filter(stream);
+  d->dict       = texpdf_link_obj(stream->dict);
+  d->job        = job;
+  d->next       = NULL;
+
+  if (deferred_tail)
+    deferred_tail->next = d;
+  else
+    deferred_head = d;
+  deferred_tail = d;
+  deferred_size += job->length;
+
+  compress_job_submit(job);
+
+  return 1;
+}
+#else
+static void
+workers_shutdown (void)
+{
+}
+
+static int
+compress_job_done (struct compress_job *job, int wait)
+{
+  return 1;
+}
+
+static int
+deferred_add_stream (pdf_obj *object)
+{
+  return 0;
+}
+#endif /* HAVE_PTHREAD */
+
+static void
+deferred_append (struct deferred_obj *d, const void *buffer, long length)
+{
+  if (d->length + length > d->max_length) {
+    d->max_length += length + STREAM_ALLOC_SIZE;
+    d->bytes = RENEW(d->bytes, d->max_length, char);
+  }
+  memcpy(d->bytes + d->length, buffer, length);
+  d->length += length;
+}
+
+static void
+deferred_write (struct deferred_obj *d)
+{
+  add_xref_entry(d->label, 1, pdf_output_file_position, d->generation);
+
+  if (d->job) {
+    struct compress_job *job = d->job;
+    long length;
+
+    compress_job_done(job, 1);
+    if (job->error)
+      ERROR("Compression failed (%s)", compress_backends[job->backend].name);
+    compression_saved += job->length - job->result_length - d->filter_length;
+
+    length = sprintf(format_buffer, "%lu %hu obj\n", d->label, d->generation);
+    enc_mode = doc_enc_mode && !(d->flags & OBJ_NO_ENCRYPT);
+    texpdf_enc_set_label(d->label);
+    texpdf_enc_set_generation(d->generation);
+    pdf_out(pdf_output_file, format_buffer, length);
+    texpdf_add_dict(d->dict,
+                    texpdf_new_name("Length"), texpdf_new_number(job->result_length));
+    pdf_write_obj(d->dict, pdf_output_file);
+    pdf_out(pdf_output_file, "\nstream\n", 8);
+    if (enc_mode)
+      pdf_encrypt_data(job->result, job->result_length);
+    pdf_out(pdf_output_file, job->result, job->result_length);
+    pdf_out(pdf_output_file, "\nendstream\nendobj\n", 18);
+
+    texpdf_release_obj(d->dict);
+    free(job->result);
+    RELEASE(job);
+  } else {
+    pdf_out_raw(d->bytes, d->length);
+    RELEASE(d->bytes);
+  }
+}
+
+/*
+ * Write out queued objects whose turn has come. Waits for pending
+ * compression if all is set or if the queue has grown too large.
+ */
+static void
+deferred_flush (int all)
+{
+  struct deferred_obj *d;
+
+  while ((d = deferred_head) != NULL) {
+    if (d->job && !all && deferred_size <= compression_queue_max &&
+        !compress_job_done(d->job, 0))
+      break;
+    deferred_size -= d->job ? (long) d->job->length : d->length;
+    deferred_head = d->next;
+    if (!deferred_head)
+      deferred_tail = NULL;
+    deferred_write(d);
+    RELEASE(d);
+  }
+}
+
 /* Write the object to the file */ 
 static void
 pdf_flush_obj (pdf_obj *object, FILE *file)
 {
   long length;
 
+  if (file == pdf_output_file) {
+    if (object->type == PDF_STREAM && deferred_add_stream(object)) {
+      deferred_flush(0);
+      return;
+    }
+    /* Rather than copying a large stream into the queue, drain it first */
+    if (deferred_head && object->type == PDF_STREAM &&
+        ((pdf_stream *) object->data)->stream_length >= STREAM_DEFLATE_DIRECT)
+      deferred_flush(1);
+    if (deferred_head) {
+      struct deferred_obj *d = NEW(1, struct deferred_obj);
+
+      d->label      = object->label;
+      d->generation = object->generation;
+      d->flags      = object->flags;
+      d->bytes      = NULL;
+      d->length     = d->max_length = 0;
+      d->dict       = NULL;
+      d->job        = NULL;
+      d->next       = NULL;
+      deferred_tail->next = d;
+      deferred_tail = d;
+
+      capture = d;
+    }
+  }
+
   /*
    * Record file position
    */
-  add_xref_entry(object->label, 1,
-		 pdf_output_file_position, object->generation);
+  if (!capture)
+    add_xref_entry(object->label, 1,
+                   pdf_output_file_position, object->generation);
   length = sprintf(format_buffer, "%lu %hu obj\n", object->label, object->generation);
   enc_mode = doc_enc_mode && !(object->flags & OBJ_NO_ENCRYPT);
   texpdf_enc_set_label(object->label);
@@ -2263,6 +3736,20 @@ pdf_flush_obj (pdf_obj *object, FILE *file)
   pdf_out(file, format_buffer, length);
   pdf_write_obj(object, file);
   pdf_out(file, "\nendobj\n", 8);
+
+  if (capture) {
+    deferred_size += capture->length;
+    capture = NULL;
+  }
+  /* The /Length of a stream deflated by write_stream_deflate() */
+  if (stream_length_obj) {
+    pdf_obj *length_obj = stream_length_obj;
+
+    stream_length_obj = NULL;
+    texpdf_release_obj(length_obj);
+  }
+  if (deferred_head)
+    deferred_flush(0);
 }
 
 static long
@@ -2326,6 +3813,135 @@ release_objstm (pdf_obj *objstm)
   texpdf_release_obj(objstm);
 }
 
+/*
+ * Only data that may be shared is deduplicated: streams, and resource
+ * dicts and color space arrays that nothing modifies. Annotations,
+ * pages, outline items and other structural objects must stay
+ * distinct even when their contents are the same.
+ */
+static int
+dedup_candidate (pdf_obj *object)
+{
+  static const char *const dict_types[] = {
+    "Font", "FontDescriptor", "Encoding", "ExtGState", "Pattern",
+    "Shading", "Halftone", NULL
+  };
+  static const char *const color_spaces[] = {
+    "ICCBased", "Indexed", "Separation", "DeviceN",
+    "CalRGB", "CalGray", "Lab", NULL
+  };
+  const char *const *names;
+  pdf_obj    *name;
+  int         i;
+
+  switch (object->type) {
+  case PDF_STREAM:
+    return ((pdf_stream *) object->data)->objstm_data == NULL;
+  case PDF_DICT:
+    name  = texpdf_lookup_dict(object, "Type");
+    names = dict_types;
+    break;
+  case PDF_ARRAY:
+    name  = texpdf_array_length(object) > 0 ? texpdf_get_array(object, 0) : NULL;
+    names = color_spaces;
+    break;
+  default:
+    return 0;
+  }
+  if (!name || name->type != PDF_NAME)
+    return 0;
+  for (i = 0; names[i]; i++) {
+    if (!strcmp(texpdf_name_value(name), names[i]))
+      return 1;
+  }
+
+  return 0;
+}
+
+/*
+ * Check whether an object about to be flushed is identical to one
+ * written before. The serialized dictionary or array (plus the raw
+ * data of a stream) is hashed; if an earlier object had the same
+ * digest and nothing refers to this label yet, the label is freed
+ * and forwarded to the earlier one. Returns 1 if the object must
+ * not be written.
+ */
+static int
+pdf_dedup_obj (pdf_obj *object)
+{
+  struct deferred_obj  buf;
+  struct deferred_obj *saved_capture = capture;
+  pdf_obj       *saved_output_stream = output_stream;
+  long           saved_line_position = pdf_output_line_position;
+  int            saved_enc_mode      = enc_mode;
+  MD5_CONTEXT    md5;
+  unsigned char  digest[16];
+  unsigned long *canonical;
+
+  if (object->flags & OBJ_NO_ENCRYPT || object->generation ||
+      !dedup_candidate(object))
+    return 0;
+
+  /* Serialize into a private buffer */
+  memset(&buf, 0, sizeof(buf));
+  capture = &buf;
+  output_stream = NULL;
+  pdf_output_line_position = 0;
+  enc_mode = 0;
+  dedup_hashing = 1;
+  if (object->type == PDF_STREAM)
+    pdf_write_obj(((pdf_stream *) object->data)->dict, pdf_output_file);
+  else
+    pdf_write_obj(object, pdf_output_file);
+  dedup_hashing = 0;
+  enc_mode = saved_enc_mode;
+  pdf_output_line_position = saved_line_position;
+  output_stream = saved_output_stream;
+  capture = saved_capture;
+
+  if (object->type != PDF_STREAM && buf.length < DEDUP_MIN_LENGTH) {
+    if (buf.bytes)
+      RELEASE(buf.bytes);
+    return 0;
+  }
+
+  texpdf_MD5_init(&md5);
+  texpdf_MD5_write(&md5, (unsigned char *) buf.bytes, buf.length);
+  if (buf.bytes)
+    RELEASE(buf.bytes);
+  if (object->type == PDF_STREAM) {
+    pdf_stream   *stream = (pdf_stream *) object->data;
+    unsigned char tag[3];
+
+    /* Same data compressed differently is not the same object */
+    tag[0] = 's';
+    tag[1] = stream->_flags;
+    tag[2] = (stream->_flags & STREAM_COMPRESS) ?
+      stream_compression_level(stream) : 0;
+    texpdf_MD5_write(&md5, tag, 3);
+    texpdf_MD5_write(&md5, stream->stream, stream->stream_length);
+  }
+  texpdf_MD5_final(digest, &md5);
+
+  canonical = texpdf_ht_lookup_table(&dedup_table, digest, 16);
+  if (!canonical) {
+    canonical = NEW(1, unsigned long);
+    *canonical = object->label;
+    texpdf_ht_append_table(&dedup_table, digest, 16, canonical);
+    return 0;
+  }
+
+  /* Earlier revisions of an updated file may refer to this label */
+  label_info_grow(object->label);
+  if (label_info[object->label].referenced || object->label < update_size)
+    return 0;
+  label_info[object->label].forward = *canonical;
+  /* A free entry; xref_link_free() chains it into the free list */
+  add_xref_entry(object->label, 0, 0, 1);
+
+  return 1;
+}
+
 void
 texpdf_release_obj (pdf_obj *object)
 {
@@ -2343,7 +3959,8 @@ texpdf_release_obj (pdf_obj *object)
      * Nothing is using this object so it's okay to remove it.
      * Nonzero "label" means object needs to be written before it's destroyed.
      */
-    if (object->label && pdf_output_file != NULL) {
+    if (object->label && pdf_output_file != NULL &&
+        !(dedup_enabled && pdf_dedup_obj(object))) {
       if (!do_objstm || object->flags & OBJ_NO_OBJSTM
 	  || (doc_enc_mode && object->flags & OBJ_NO_ENCRYPT)
 	  || object->generation)
@@ -2364,12 +3981,12 @@ texpdf_release_obj (pdf_obj *object)
     }
     switch (object->type) {
     case PDF_BOOLEAN:
-      release_boolean(object->data);
+      release_boolean(object);
       break;
     case PDF_NULL:
       break;
     case PDF_NUMBER:
-      release_number(object->data);
+      release_number(object);
       break;
     case PDF_STRING:
       release_string(object->data);
@@ -2387,13 +4004,16 @@ texpdf_release_obj (pdf_obj *object)
       release_stream(object->data);
       break;
     case PDF_INDIRECT:
-      release_indirect(object->data);
+      release_indirect(object);
       break;
     }
     /* This might help detect freeing already freed objects */
     object->type = -1;
     object->data = NULL;
-    RELEASE(object);
+    if (object->flags & OBJ_IN_ARENA)
+      texpdf_arena_free(object);
+    else
+      RELEASE(object);
   }
 }
 
@@ -2420,14 +4040,14 @@ backup_line (FILE *pdf_input_file)
   return 1;
 }
 
-static long
+static off_t
 find_xref (FILE *pdf_input_file)
 {
-  long xref_pos;
-  int  tries = 10;
+  off_t xref_pos;
+  int   tries = 10;
 
   do {
-    long currentpos;
+    off_t currentpos;
 
     if (!backup_line(pdf_input_file)) {
       tries = 0;
@@ -2449,14 +4069,12 @@ find_xref (FILE *pdf_input_file)
 
   {
     const char *start, *end;
-    char *number;
+    double      value = 0.0;
 
     start = work_buffer;
     end   = start + strlen(work_buffer);
-    texpdf_skip_white(&start, end);
-    number   = texpdf_parse_number(&start, end);
-    xref_pos = (long) atof(number);
-    RELEASE(number);
+    texpdf_scan_number(&start, end, &value);
+    xref_pos = (off_t) value;
   }
 
   return xref_pos;
@@ -2497,13 +4115,35 @@ texpdf_parse_trailer (pdf_file *pf)
  * is that an object before an xref table will grab the whole table
  * :-(
  */
-static long
+static off_t
 next_object_offset (pdf_file *pf, unsigned long obj_num)
 {
-  long  next = pf->file_size;  /* Worst case */
-  long  i, curr;
+  off_t next = pf->file_size;  /* Worst case */
+  off_t curr;
+  long  i;
 
   curr = pf->xref_table[obj_num].field2;
+
+  /* Lazily loaded files are mapped, so reading to the end costs nothing */
+  if (pf->xref_loaded)
+    return next;
+
+  /* Find the first larger offset in the index built by read_xref() */
+  if (pf->offsets) {
+    long lo = 0, hi = pf->num_offsets;
+
+    while (lo < hi) {
+      long mid = lo + (hi - lo) / 2;
+      if (pf->offsets[mid] > curr)
+        hi = mid;
+      else
+        lo = mid + 1;
+    }
+    if (lo < pf->num_offsets && pf->offsets[lo] < next)
+      next = pf->offsets[lo];
+    return next;
+  }
+
   /* Check all other type 1 objects to find next one */
   for (i = 0; i < pf->num_obj; i++) {
     if (pf->xref_table[i].type == 1 &&
@@ -2515,7 +4155,8 @@ next_object_offset (pdf_file *pf, unsigned long obj_num)
   return  next;
 }
 
-#define checklabel(pf, n, g) ((n) > 0 && (n) < (pf)->num_obj && ( \
+#define checklabel(pf, n, g) ((n) > 0 && (n) < (pf)->num_obj && \
+  xref_entry_ready((pf), (n)) && ( \
   ((pf)->xref_table[(n)].type == 1 && (pf)->xref_table[(n)].field3 == (g)) || \
   ((pf)->xref_table[(n)].type == 2 && !(g))))
 
@@ -2525,13 +4166,12 @@ texpdf_new_indirect (pdf_file *pf, unsigned long obj_num, unsigned short obj_gen
   pdf_obj      *result;
   pdf_indirect *indirect;
 
-  indirect = NEW(1, pdf_indirect);
+  result   = texpdf_new_obj(PDF_INDIRECT);
+  indirect = obj_new_data(result, sizeof(pdf_indirect));
   indirect->pf         = pf;
   indirect->obj        = NULL;
   indirect->label      = obj_num;
   indirect->generation = obj_gen;
-
-  result   = texpdf_new_obj(PDF_INDIRECT);
   result->data = indirect;
 
   return result;
@@ -2539,49 +4179,39 @@ texpdf_new_indirect (pdf_file *pf, unsigned long obj_num, unsigned short obj_gen
 
 static pdf_obj *
 pdf_read_object (unsigned long obj_num, unsigned short obj_gen,
-		pdf_file *pf, long offset, long limit)
+		pdf_file *pf, off_t offset, off_t limit)
 {
-  long     length;
+  off_t    length;
   char    *buffer;
   const char *p, *endptr;
   pdf_obj *result;
 
   length = limit - offset;
 
-  if (length <= 0)
+  if (offset < 0 || length <= 0)
     return NULL;
 
-  buffer = NEW(length + 1, char);
-
-  seek_absolute(pf->file, offset);
-  fread(buffer, sizeof(char), length, pf->file);
-
-  p      = buffer;
+  if (pf->map && limit <= pf->map->size) {
+    buffer = NULL;
+    p      = pf->map->data + offset;
+  } else {
+    buffer = NEW(length + 1, char);
+    seek_absolute(pf->file, offset);
+    fread(buffer, sizeof(char), length, pf->file);
+    p      = buffer;
+  }
   endptr = p + length;
 
   /* Check for obj_num and obj_gen */
   {
     const char   *q = p; /* <== p */
-    char         *sp;
     unsigned long n, g;
 
-    texpdf_skip_white(&q, endptr);
-    sp = texpdf_parse_unsigned(&q, endptr);
-    if (!sp) {
-      RELEASE(buffer);
-      return NULL;
-    }
-    n = strtoul(sp, NULL, 10);
-    RELEASE(sp);
-
-    texpdf_skip_white(&q, endptr);
-    sp = texpdf_parse_unsigned(&q, endptr);
-    if (!sp) {
+    if (!texpdf_scan_unsigned(&q, endptr, &n) ||
+        !texpdf_scan_unsigned(&q, endptr, &g)) {
       RELEASE(buffer);
       return NULL;
     }
-    g = strtoul(sp, NULL, 10);
-    RELEASE(sp);
 
     if (obj_num && (n != obj_num || g != obj_gen)) {
       RELEASE(buffer);
@@ -2593,7 +4223,7 @@ pdf_read_object (unsigned long obj_num, unsigned short obj_gen,
 
 
   texpdf_skip_white(&p, endptr);
-  if (memcmp(p, "obj", strlen("obj"))) {
+  if (endptr - p < 3 || memcmp(p, "obj", strlen("obj"))) {
     WARN("Didn't find \"obj\".");
     RELEASE(buffer);
     return NULL;
@@ -2603,7 +4233,7 @@ pdf_read_object (unsigned long obj_num, unsigned short obj_gen,
   result = texpdf_parse_pdf_object(&p, endptr, pf);
 
   texpdf_skip_white(&p, endptr);
-  if (memcmp(p, "endobj", strlen("endobj"))) {
+  if (endptr - p < 6 || memcmp(p, "endobj", strlen("endobj"))) {
     WARN("Didn't find \"endobj\".");
     if (result)
       texpdf_release_obj(result);
@@ -2614,12 +4244,229 @@ pdf_read_object (unsigned long obj_num, unsigned short obj_gen,
   return result;
 }
 
+/*
+ * Objects read from input files are kept in xref_table[].direct. Each
+ * of them is also on an LRU list of its file and on a global one, so
+ * that the least recently used can be dropped (and read again when
+ * needed) once the cache exceeds its budget.
+ */
+struct cache_node
+{
+  pdf_file          *pf;
+  unsigned long      num;
+  long               bytes;
+  struct cache_node *prev, *next;   /* global list */
+  struct cache_node *fprev, *fnext; /* list of PF */
+};
+
+static struct cache_node *cache_head = NULL, *cache_tail = NULL;
+static long               cache_budget      = 0;
+static long               cache_file_budget = 0;
+static pdf_cache_stats    cache_stats;
+
+void
+texpdf_set_object_cache_budget (long total, long per_file)
+{
+  cache_budget      = total > 0 ? total : 0;
+  cache_file_budget = per_file > 0 ? per_file : 0;
+}
+
+void
+texpdf_get_object_cache_stats (pdf_file *pf, pdf_cache_stats *stats)
+{
+  ASSERT(stats);
+  *stats = pf ? pf->cache_stats : cache_stats;
+}
+
+/* Rough number of bytes held by OBJECT */
+static long
+cache_obj_size (pdf_obj *object)
+{
+  long size = sizeof(pdf_obj);
+  unsigned long i;
+
+  switch (object->type) {
+  case PDF_BOOLEAN:
+    size += sizeof(pdf_boolean);
+    break;
+  case PDF_NUMBER:
+    size += sizeof(pdf_number);
+    break;
+  case PDF_STRING:
+    size += sizeof(pdf_string) + ((pdf_string *) object->data)->length;
+    break;
+  case PDF_ARRAY:
+    {
+      pdf_array *data = object->data;
+
+      size += sizeof(pdf_array) + data->max * sizeof(pdf_obj *);
+      for (i = 0; i < data->size; i++) {
+        if (data->values[i])
+          size += cache_obj_size(data->values[i]);
+      }
+    }
+    break;
+  case PDF_DICT:
+    {
+      pdf_dict *data = object->data;
+
+      size += sizeof(pdf_dict) + data->max * sizeof(struct pdf_dict_entry)
+        + data->index_size * sizeof(unsigned long);
+      for (i = 0; i < data->size; i++)
+        size += sizeof(pdf_obj) + cache_obj_size(data->entries[i].value);
+    }
+    break;
+  case PDF_STREAM:
+    {
+      pdf_stream *data = object->data;
+
+      size += sizeof(pdf_stream) + cache_obj_size(data->dict);
+      if (!data->map)
+        size += data->max_length;
+      if (data->objstm_data)
+        size += 2 * (data->objstm_data[0] + 1) * sizeof(long);
+    }
+    break;
+  case PDF_INDIRECT:
+    size += sizeof(pdf_indirect);
+    break;
+  }
+
+  return size;
+}
+
+static void
+cache_unlink (struct cache_node *node)
+{
+  pdf_file *pf = node->pf;
+
+  if (node->prev)
+    node->prev->next = node->next;
+  else
+    cache_head = node->next;
+  if (node->next)
+    node->next->prev = node->prev;
+  else
+    cache_tail = node->prev;
+
+  if (node->fprev)
+    node->fprev->fnext = node->fnext;
+  else
+    pf->cache_head = node->fnext;
+  if (node->fnext)
+    node->fnext->fprev = node->fprev;
+  else
+    pf->cache_tail = node->fprev;
+}
+
+static void
+cache_link (struct cache_node *node)
+{
+  pdf_file *pf = node->pf;
+
+  node->prev = NULL;
+  node->next = cache_head;
+  if (cache_head)
+    cache_head->prev = node;
+  else
+    cache_tail = node;
+  cache_head = node;
+
+  node->fprev = NULL;
+  node->fnext = pf->cache_head;
+  if (pf->cache_head)
+    pf->cache_head->fprev = node;
+  else
+    pf->cache_tail = node;
+  pf->cache_head = node;
+}
+
+/* Forget NODE, leaving the cached object itself alone */
+static void
+cache_remove (struct cache_node *node)
+{
+  pdf_file *pf = node->pf;
+
+  cache_unlink(node);
+  pf->cache_nodes[node->num] = NULL;
+  pf->cache_stats.bytes -= node->bytes;
+  cache_stats.bytes     -= node->bytes;
+  RELEASE(node);
+}
+
+static void
+cache_evict (struct cache_node *node)
+{
+  pdf_file *pf  = node->pf;
+  pdf_obj  *obj = pf->xref_table[node->num].direct;
+
+  pf->xref_table[node->num].direct = NULL;
+  pf->cache_stats.evictions++;
+  cache_stats.evictions++;
+  cache_remove(node);
+  /* Users of the object still hold their own links */
+  texpdf_release_obj(obj);
+}
+
+static void
+cache_miss (pdf_file *pf)
+{
+  pf->cache_stats.misses++;
+  cache_stats.misses++;
+}
+
+static void
+cache_touch (pdf_file *pf, unsigned long num)
+{
+  struct cache_node *node = pf->cache_nodes[num];
+
+  pf->cache_stats.hits++;
+  cache_stats.hits++;
+  if (node) {
+    cache_unlink(node);
+    cache_link(node);
+  }
+}
+
+/* Store OBJECT as xref_table[NUM].direct and enforce the budgets */
+static void
+cache_insert (pdf_file *pf, unsigned long num, pdf_obj *object)
+{
+  struct cache_node *node;
+
+  ASSERT(!pf->xref_table[num].direct && !pf->cache_nodes[num]);
+
+  pf->xref_table[num].direct = object;
+
+  node = NEW(1, struct cache_node);
+  node->pf    = pf;
+  node->num   = num;
+  node->bytes = cache_obj_size(object);
+  cache_link(node);
+  pf->cache_nodes[num] = node;
+
+  pf->cache_stats.bytes += node->bytes;
+  if (pf->cache_stats.bytes > pf->cache_stats.peak_bytes)
+    pf->cache_stats.peak_bytes = pf->cache_stats.bytes;
+  cache_stats.bytes += node->bytes;
+  if (cache_stats.bytes > cache_stats.peak_bytes)
+    cache_stats.peak_bytes = cache_stats.bytes;
+
+  while (cache_file_budget && pf->cache_stats.bytes > cache_file_budget &&
+         pf->cache_tail != node)
+    cache_evict(pf->cache_tail);
+  while (cache_budget && cache_stats.bytes > cache_budget &&
+         cache_tail != node)
+    cache_evict(cache_tail);
+}
+
 static pdf_obj *
 read_objstm (pdf_file *pf, unsigned long num)
 {
-  unsigned long offset = pf->xref_table[num].field2;
+  off_t offset = pf->xref_table[num].field2;
   unsigned short gen = pf->xref_table[num].field3;
-  long limit = next_object_offset(pf, num), n, first, *header = NULL;
+  off_t limit = next_object_offset(pf, num);
+  long n, first, *header = NULL;
   char *data = NULL, *q;
   const char *p, *endptr;
   int i;
@@ -2685,7 +4532,9 @@ read_objstm (pdf_file *pf, unsigned long num)
     goto error;
   RELEASE(data);
   
-  return pf->xref_table[num].direct = objstm;
+  cache_insert(pf, num, objstm);
+
+  return objstm;
 
  error:
   WARN("Cannot parse object stream.");
@@ -2712,29 +4561,36 @@ texpdf_get_object (pdf_file *pf, unsigned long obj_num, unsigned short obj_gen)
   }
 
   if ((result = pf->xref_table[obj_num].direct)) {
+    cache_touch(pf, obj_num);
     return texpdf_link_obj(result);
   }
+  cache_miss(pf);
 
   if (pf->xref_table[obj_num].type == 1) {
     /* type == 1 */
-    unsigned long offset;
-    long limit;
+    off_t offset, limit;
     offset = pf->xref_table[obj_num].field2;
     limit  = next_object_offset(pf, obj_num);
     result = pdf_read_object(obj_num, obj_gen, pf, offset, limit);
   } else {
     /* type == 2 */
-    unsigned long  objstm_num = pf->xref_table[obj_num].field2;
+    unsigned long  objstm_num = (unsigned long) pf->xref_table[obj_num].field2;
     unsigned short index = pf->xref_table[obj_num].field3;
     pdf_obj *objstm;
     long *data, n, first, length;
     const char *p, *q;
 
     if (objstm_num >= pf->num_obj ||
-	pf->xref_table[objstm_num].type != 1 ||
-	!((objstm = pf->xref_table[objstm_num].direct) ||
-	  (objstm = read_objstm(pf, objstm_num))))
+	!xref_entry_ready(pf, objstm_num) ||
+	pf->xref_table[objstm_num].type != 1)
       goto error;
+    if ((objstm = pf->xref_table[objstm_num].direct))
+      cache_touch(pf, objstm_num);
+    else {
+      cache_miss(pf);
+      if (!(objstm = read_objstm(pf, objstm_num)))
+        goto error;
+    }
 
     data = get_objstm_data(objstm);
     n = *(data++);
@@ -2744,15 +4600,16 @@ texpdf_get_object (pdf_file *pf, unsigned long obj_num, unsigned short obj_gen)
       goto error;
 
     length = pdf_stream_length(objstm);
-    p = (const char *) pdf_stream_dataptr(objstm) + first + data[2*index+1];
+    p = (const char *) pdf_stream_dataptr(objstm);
     q = p + (index == n-1 ? length : first+data[2*index+3]);
+    p += first + data[2*index+1];
     result = texpdf_parse_pdf_object(&p, q, pf);
     if (!result)
       goto error;
   }
 
   /* Make sure the caller doesn't free this object */
-  pf->xref_table[obj_num].direct = texpdf_link_obj(result);
+  cache_insert(pf, obj_num, texpdf_link_obj(result));
 
   return result;
 
@@ -2821,26 +4678,137 @@ extend_xref (pdf_file *pf, long new_size)
 {
   unsigned long i;
 
-  pf->xref_table = RENEW(pf->xref_table, new_size, xref_entry);
+  pf->xref_table  = RENEW(pf->xref_table, new_size, xref_entry);
+  pf->cache_nodes = RENEW(pf->cache_nodes, new_size, struct cache_node *);
   for (i = pf->num_obj; i < new_size; i++) {
+    pf->cache_nodes[i] = NULL;
     pf->xref_table[i].direct   = NULL;
     pf->xref_table[i].indirect = NULL;
     pf->xref_table[i].type     = 0;
     pf->xref_table[i].field3 = 0;
-    pf->xref_table[i].field2 = 0L;
+    pf->xref_table[i].field2 = 0;
   }
   pf->num_obj = new_size;
 }
 
+/*
+ * Lazy xref loading, see texpdf_set_lazy_xref(). read_xref() records
+ * only where the subsections of each xref section are; the entry of
+ * an object is read from the newest section that has it when the
+ * object is first needed. Xref streams are inflated just as far as
+ * the rows asked for so far.
+ */
+static int lazy_xref = 0;
+
+void
+texpdf_set_lazy_xref (int enabled)
+{
+  lazy_xref = enabled;
+}
+
+struct xref_range
+{
+  unsigned long first, size;
+  off_t         start;  /* offset of the first entry, or its row in the stream */
+};
+
+#define XREFSTM_RAW     0
+#define XREFSTM_CHUNKED 1
+#define XREFSTM_DONE    2
+
+struct xref_section
+{
+  struct xref_range *ranges;  /* sorted by first after read_xref() */
+  long               num_ranges, max_ranges;
+  /* Xref streams only */
+  pdf_obj           *stream;  /* NULL for xref tables */
+  int                W[3], wsum;
+  int                state;
+  unsigned char     *rows;    /* decoded rows of wsum bytes */
+  long               num_rows, max_rows;
+  struct xref_decoder *decoder;
+};
+
+static struct xref_section *
+xref_section_new (pdf_file *pf)
+{
+  struct xref_section *sec;
+
+  sec = NEW(1, struct xref_section);
+  memset(sec, 0, sizeof(struct xref_section));
+  pf->sections = RENEW(pf->sections, pf->num_sections + 1,
+                       struct xref_section *);
+  pf->sections[pf->num_sections++] = sec;
+
+  return sec;
+}
+
+static void
+xref_section_add_range (struct xref_section *sec,
+                        unsigned long first, unsigned long size, off_t start)
+{
+  if (sec->num_ranges == sec->max_ranges) {
+    sec->max_ranges = sec->max_ranges ? 2 * sec->max_ranges : 4;
+    sec->ranges = RENEW(sec->ranges, sec->max_ranges, struct xref_range);
+  }
+  sec->ranges[sec->num_ranges].first = first;
+  sec->ranges[sec->num_ranges].size  = size;
+  sec->ranges[sec->num_ranges].start = start;
+  sec->num_ranges++;
+}
+
+static int
+cmp_xref_range (const void *a, const void *b)
+{
+  unsigned long x = ((const struct xref_range *) a)->first;
+  unsigned long y = ((const struct xref_range *) b)->first;
+
+  return x < y ? -1 : x > y;
+}
+
+/* Parse the 20-byte xref table entry in BUF for object NUM into E */
+static int
+parse_xref_table_entry (pdf_file *pf, char *buf, unsigned long num,
+                        xref_entry *e)
+{
+  off_t         offset = 0;
+  unsigned int  obj_gen = 0;
+  char          flag = 0;
+  char         *p = buf;
+  int           r = 0;
+
+  buf[19] = 0;
+  /* Offsets may not fit in a long, so they are not read with sscanf() */
+  while (*p == ' ')
+    p++;
+  if (*p >= '0' && *p <= '9') {
+    while (*p >= '0' && *p <= '9')
+      offset = 10 * offset + (*p++ - '0');
+    r = 1 + sscanf(p, "%05u %c", &obj_gen, &flag);
+  }
+  if ( r != 3 ||
+      ((flag != 'n' && flag != 'f') ||
+       (flag == 'n' &&
+       (offset >= pf->file_size || (offset > 0 && offset < 4))))) {
+    WARN("Invalid xref table entry [%lu]. PDF file is corrupt...", num);
+    return -1;
+  }
+  e->type   = (flag == 'n');
+  e->field2 = offset;
+  e->field3 = obj_gen;
+
+  return 0;
+}
+
+/* Read one xref table, or with SEC only record its subsections there */
 static int
-texpdf_parse_xref_table (pdf_file *pf, long xref_pos)
+texpdf_parse_xref_table (pdf_file *pf, off_t xref_pos, struct xref_section *sec)
 {
   FILE         *pdf_input_file = pf->file;
   unsigned long first, size;
-  unsigned long i, offset;
-  unsigned int  obj_gen;
-  char          flag;
-  int           r;
+  unsigned long i;
+  xref_entry    e;
+  const char   *entries;
 
   /*
    * This routine reads one xref segment. It may be called multiple times
@@ -2856,7 +4824,7 @@ texpdf_parse_xref_table (pdf_file *pf, long xref_pos)
   }
   /* Next line in file has first item and size of table */
   for (;;) {
-    unsigned long current_pos;
+    off_t current_pos;
 
     current_pos = tell_position(pdf_input_file);
     if (mfgets(work_buffer, WORK_BUFFER_SIZE, pdf_input_file) == NULL) {
@@ -2879,28 +4847,40 @@ texpdf_parse_xref_table (pdf_file *pf, long xref_pos)
       extend_xref(pf, first + size);
     }
 
+    entries = NULL;
+    if (pf->map) {
+      off_t pos = tell_position(pdf_input_file);
+
+      if (pos + 20 * (off_t) size > pf->map->size) {
+        WARN("Premature end of PDF file while parsing xref table.");
+        return -1;
+      }
+      entries = pf->map->data + pos;
+      seek_absolute(pdf_input_file, pos + 20 * (off_t) size);
+      if (sec) {
+        xref_section_add_range(sec, first, size, pos);
+        continue;
+      }
+    }
+
     for (i = first; i < first + size; i++) {
-      fread(work_buffer, sizeof(char), 20, pdf_input_file);
+      if (entries) {
+        memcpy(work_buffer, entries, 20);
+        entries += 20;
+      } else
+        fread(work_buffer, sizeof(char), 20, pdf_input_file);
+      if (parse_xref_table_entry(pf, work_buffer, i, &e) < 0)
+        return -1;
       /*
        * Don't overwrite positions that have already been set by a
        * modified xref table.  We are working our way backwards
        * through the reference table, so we only set "position" 
        * if it hasn't been set yet.
        */
-      work_buffer[19] = 0;
-      offset = 0UL; obj_gen = 0; flag = 0;
-      r = sscanf(work_buffer, "%010lu %05u %c", &offset, &obj_gen, &flag);
-      if ( r != 3 ||
-          ((flag != 'n' && flag != 'f') ||
-           (flag == 'n' &&
-           (offset >= pf->file_size || (offset > 0 && offset < 4))))) {
-        WARN("Invalid xref table entry [%lu]. PDF file is corrupt...", i);
-        return -1;
-      }
       if (!pf->xref_table[i].field2) {
-	pf->xref_table[i].type   = (flag == 'n');
-	pf->xref_table[i].field2 = offset;
-	pf->xref_table[i].field3 = obj_gen;	
+	pf->xref_table[i].type   = e.type;
+	pf->xref_table[i].field2 = e.field2;
+	pf->xref_table[i].field3 = e.field3;
       }
     }
   }
@@ -2908,10 +4888,10 @@ texpdf_parse_xref_table (pdf_file *pf, long xref_pos)
   return  1;
 }
 
-static unsigned long
-texpdf_parse_xrefstm_field (const char **p, int length, unsigned long def)
+static off_t
+texpdf_parse_xrefstm_field (const char **p, int length, off_t def)
 {
-  unsigned long val = 0;
+  off_t val = 0;
 
   if (!length)
     return def;
@@ -2924,6 +4904,22 @@ texpdf_parse_xrefstm_field (const char **p, int length, unsigned long def)
   return val;
 }
 
+static void
+texpdf_parse_xrefstm_entry (const char **p, int *W, xref_entry *e)
+{
+  e->type = (unsigned char) texpdf_parse_xrefstm_field(p, W[0], 1);
+  if (e->type > 2)
+    WARN("Unknown cross-reference stream entry type.");
+#if 0
+  /* Not sure */
+  else if (!W[1] || (e->type != 1 && !W[2]))
+    return -1;
+#endif
+
+  e->field2 = texpdf_parse_xrefstm_field(p, W[1], 0);
+  e->field3 = (unsigned short) texpdf_parse_xrefstm_field(p, W[2], 0);
+}
+
 static int
 texpdf_parse_xrefstm_subsec (pdf_file *pf,
 		      const char **p, long *length,
@@ -2939,26 +4935,13 @@ texpdf_parse_xrefstm_subsec (pdf_file *pf,
 
   e = pf->xref_table + first;
   while (size--) {
-    unsigned char  type;
-    unsigned long  field2;
-    unsigned short field3;
-
-    type = (unsigned char) texpdf_parse_xrefstm_field(p, W[0], 1);
-    if (type > 2)
-      WARN("Unknown cross-reference stream entry type.");
-#if 0
-    /* Not sure */
-    else if (!W[1] || (type != 1 && !W[2]))
-      return -1;
-#endif
-
-    field2 = (unsigned long)  texpdf_parse_xrefstm_field(p, W[1], 0);
-    field3 = (unsigned short) texpdf_parse_xrefstm_field(p, W[2], 0);
+    xref_entry entry;
 
+    texpdf_parse_xrefstm_entry(p, W, &entry);
     if (!e->field2) {
-      e->type   = type;
-      e->field2 = field2;
-      e->field3 = field3;	
+      e->type   = entry.type;
+      e->field2 = entry.field2;
+      e->field3 = entry.field3;	
       }
     e++;
   }
@@ -2966,20 +4949,22 @@ texpdf_parse_xrefstm_subsec (pdf_file *pf,
   return 0;
 }
 
+/* Read one xref stream, or with SEC only record its subsections there */
 static int
-texpdf_parse_xref_stream (pdf_file *pf, long xref_pos, pdf_obj **trailer)
+texpdf_parse_xref_stream (pdf_file *pf, off_t xref_pos, pdf_obj **trailer,
+                          struct xref_section *sec)
 {
   pdf_obj *xrefstm, *size_obj, *W_obj, *index_obj;
   unsigned long size;
-  long length;
+  long length, row = 0;
   int W[3], i, wsum = 0;
-  const char *p;
+  const char *p = NULL;
 
   xrefstm = pdf_read_object(0, 0, pf, xref_pos, pf->file_size);
   if (!PDF_OBJ_STREAMTYPE(xrefstm))
     goto error;
 
-  {
+  if (!sec) {
     pdf_obj *tmp = pdf_stream_uncompress(xrefstm);
     if (!tmp)
       goto error;
@@ -3007,7 +4992,13 @@ texpdf_parse_xref_stream (pdf_file *pf, long xref_pos, pdf_obj **trailer)
     wsum += (W[i] = (int) texpdf_number_value(tmp));
   }
 
-  p = pdf_stream_dataptr(xrefstm);
+  if (sec) {
+    if (wsum <= 0)
+      goto error;
+    memcpy(sec->W, W, sizeof(W));
+    sec->wsum = wsum;
+  } else
+    p = pdf_stream_dataptr(xrefstm);
 
   index_obj = texpdf_lookup_dict(*trailer, "Index");
   if (index_obj) {
@@ -3021,15 +5012,35 @@ texpdf_parse_xref_stream (pdf_file *pf, long xref_pos, pdf_obj **trailer)
       pdf_obj *first = texpdf_get_array(index_obj, i++);
       size_obj  = texpdf_get_array(index_obj, i++);
       if (!PDF_OBJ_NUMBERTYPE(first) ||
-	  !PDF_OBJ_NUMBERTYPE(size_obj) ||
-	  texpdf_parse_xrefstm_subsec(pf, &p, &length, W, wsum,
+	  !PDF_OBJ_NUMBERTYPE(size_obj))
+	goto error;
+      if (sec) {
+	long n = (long) texpdf_number_value(first);
+	long m = (long) texpdf_number_value(size_obj);
+
+	if (n < 0 || m < 0)
+	  goto error;
+	if (pf->num_obj < n + m)
+	  extend_xref(pf, n + m);
+	xref_section_add_range(sec, n, m, row);
+	row += m;
+      } else if (texpdf_parse_xrefstm_subsec(pf, &p, &length, W, wsum,
 			       (long) texpdf_number_value(first),
 			       (long) texpdf_number_value(size_obj)))
 	goto error;
     }
+  } else if (sec) {
+    if (pf->num_obj < (long) size)
+      extend_xref(pf, size);
+    xref_section_add_range(sec, 0, size, 0);
   } else if (texpdf_parse_xrefstm_subsec(pf, &p, &length, W, wsum, 0, size))
       goto error;
 
+  if (sec) {
+    sec->stream = xrefstm;
+    return 1;
+  }
+
   if (length)
     WARN("Garbage in xref stream.");
 
@@ -3039,6 +5050,8 @@ texpdf_parse_xref_stream (pdf_file *pf, long xref_pos, pdf_obj **trailer)
 
  error:
   WARN("Cannot parse cross-reference stream.");
+  if (sec)
+    sec->num_ranges = 0;
   if (xrefstm)
     texpdf_release_obj(xrefstm);
   if (*trailer) {
@@ -3048,122 +5061,723 @@ texpdf_parse_xref_stream (pdf_file *pf, long xref_pos, pdf_obj **trailer)
   return 0;
 }
 
-/* TODO: parse Version entry */
-static pdf_obj *
-read_xref (pdf_file *pf)
+#if HAVE_ZLIB
+#define XREF_CHUNK_ROWS 1024
+
+/* Incremental FlateDecode of an xref stream, with PNG predictors */
+struct xref_decoder
 {
-  pdf_obj *trailer = NULL, *main_trailer = NULL;
-  long     xref_pos;
+  z_stream       z;
+  int            predictor;  /* 1 or 10-15 */
+  unsigned char *raw;        /* inflated bytes of incomplete rows */
+  long           raw_len;
+  unsigned char *zero;       /* the row above the first one */
+};
 
-  if (!(xref_pos = find_xref(pf->file)))
-    goto error;
+static void
+xref_decoder_end (struct xref_section *sec)
+{
+  struct xref_decoder *d = sec->decoder;
 
-  while (xref_pos) {
-    pdf_obj *prev;
+  inflateEnd(&d->z);
+  RELEASE(d->raw);
+  RELEASE(d->zero);
+  RELEASE(d);
+  sec->decoder = NULL;
+  sec->state   = XREFSTM_DONE;
+}
 
-    int res = texpdf_parse_xref_table(pf, xref_pos);
-    if (res > 0) {
-      /* cross-reference table */
-      pdf_obj *xrefstm;
+/* Set up chunked decoding of SEC, or return 0 if the filter is not plain Flate */
+static int
+xref_decoder_new (struct xref_section *sec)
+{
+  pdf_obj *dict = texpdf_stream_dict(sec->stream), *filter, *tmp;
+  struct decode_parms  parms;
+  struct xref_decoder *d;
 
-      if (!(trailer = texpdf_parse_trailer(pf)))
-	goto error;
+  filter = texpdf_lookup_dict(dict, "Filter");
+  if (PDF_OBJ_ARRAYTYPE(filter) && texpdf_array_length(filter) == 1)
+    filter = texpdf_get_array(filter, 0);
+  if (!PDF_OBJ_NAMETYPE(filter) ||
+      strcmp(texpdf_name_value(filter), "FlateDecode"))
+    return 0;
 
-      if (!main_trailer)
-	main_trailer = texpdf_link_obj(trailer);
+  parms.predictor = 1;
+  parms.colors    = 1;
+  parms.bits_per_component = 8;
+  parms.columns   = sec->wsum;
+  tmp = texpdf_lookup_dict(dict, "DecodeParms");
+  if (PDF_OBJ_ARRAYTYPE(tmp) && texpdf_array_length(tmp) == 1)
+    tmp = texpdf_get_array(tmp, 0);
+  if (tmp && (!PDF_OBJ_DICTTYPE(tmp) || get_decode_parms(&parms, tmp)))
+    return 0;
+  if ((parms.predictor != 1 &&
+       (parms.predictor < 10 || parms.predictor > 15)) ||
+      parms.colors != 1 || parms.bits_per_component != 8 ||
+      parms.columns != sec->wsum)
+    return 0;
 
-      if ((xrefstm = texpdf_lookup_dict(trailer, "XRefStm"))) {
-	pdf_obj *new_trailer = NULL;
-	if (PDF_OBJ_NUMBERTYPE(xrefstm) &&
-	    texpdf_parse_xref_stream(pf, (long) texpdf_number_value(xrefstm),
-			      &new_trailer))
-	  texpdf_release_obj(new_trailer);
-	else
-	  WARN("Skipping hybrid reference section.");
-	/* Many PDF 1.5 xref streams use DecodeParms, which we cannot
-	   parse. This way we can use at least xref tables in hybrid
-	   documents. Or should we better stop parsing the file?
-	*/
-      }
+  d = NEW(1, struct xref_decoder);
+  memset(&d->z, 0, sizeof(z_stream));
+  if (inflateInit(&d->z) != Z_OK) {
+    RELEASE(d);
+    return 0;
+  }
+  d->z.next_in  = (Bytef *) pdf_stream_dataptr(sec->stream);
+  d->z.avail_in = (uInt) pdf_stream_length(sec->stream);
+  d->predictor  = parms.predictor;
+  d->raw     = NEW(XREF_CHUNK_ROWS * (sec->wsum + 1), unsigned char);
+  d->raw_len = 0;
+  d->zero    = NEW(sec->wsum, unsigned char);
+  memset(d->zero, 0, sec->wsum);
+  sec->decoder = d;
 
-    } else if (!res && texpdf_parse_xref_stream(pf, xref_pos, &trailer)) {
-      /* cross-reference stream */
-      if (!main_trailer)
-	main_trailer = texpdf_link_obj(trailer);
-    } else
-      goto error;
+  return 1;
+}
 
-    if ((prev = texpdf_lookup_dict(trailer, "Prev"))) {
-      if (PDF_OBJ_NUMBERTYPE(prev))
-	xref_pos = (long) texpdf_number_value(prev);
-      else
-	goto error;
-    } else
-      xref_pos = 0;
+/* Inflate SEC until it has ROWS rows or the stream ends */
+static void
+xref_decoder_run (struct xref_section *sec, long rows)
+{
+  struct xref_decoder *d = sec->decoder;
+  int  wsum = sec->wsum;
+  int  rowlen = wsum + (d->predictor >= 10);
+  long size = XREF_CHUNK_ROWS * rowlen;
 
-    texpdf_release_obj(trailer);
-  }
+  while (sec->decoder && sec->num_rows < rows) {
+    unsigned char *p;
+    int status;
 
-#if 0
-  if (!texpdf_lookup_dict(main_trailer, "Root")) {
-      WARN("Trailer doesn't have catalog. Is this a correct PDF file?");
-      goto error;
+    if (sec->num_rows + XREF_CHUNK_ROWS > sec->max_rows) {
+      sec->max_rows = MAX(2 * sec->max_rows, sec->num_rows + XREF_CHUNK_ROWS);
+      sec->rows = RENEW(sec->rows, sec->max_rows * wsum, unsigned char);
     }
-#endif
-
-  return main_trailer;
-
- error:
-  WARN("Error while parsing PDF file.");
-  if (trailer)
-    texpdf_release_obj(trailer);
-  if (main_trailer)
-    texpdf_release_obj(main_trailer);
-  return NULL;
-}
+    d->z.next_out  = d->raw + d->raw_len;
+    d->z.avail_out = size - d->raw_len;
+    status = inflate(&d->z, Z_NO_FLUSH);
+    d->raw_len = size - d->z.avail_out;
 
-static struct ht_table *pdf_files = NULL;
+    for (p = d->raw; p + rowlen <= d->raw + d->raw_len; p += rowlen) {
+      unsigned char *row = sec->rows + sec->num_rows * wsum;
 
-static pdf_file *
-pdf_file_new (FILE *file)
-{
-  pdf_file *pf;
-  ASSERT(file);
-  pf = NEW(1, pdf_file);
-  pf->file    = file;
-  pf->trailer = NULL;
-  pf->xref_table = NULL;
-  pf->catalog = NULL;
-  pf->num_obj = 0;
-  pf->version = 0;
+      if (d->predictor == 1)
+        memcpy(row, p, wsum);
+      else {
+        int type = d->predictor == 15 ? p[0] : d->predictor - 10;
 
-  seek_end(file);
-  pf->file_size = tell_position(file);
+        if (p[0] != type) {
+          WARN("Mismatched Predictor type in data stream.");
+          status = Z_DATA_ERROR;
+          break;
+        }
+        if (filter_row_PNG(row, sec->num_rows ? row - wsum : d->zero,
+                           p + 1, type, wsum, 1)) {
+          status = Z_DATA_ERROR;
+          break;
+        }
+      }
+      sec->num_rows++;
+    }
+    d->raw_len -= p - d->raw;
+    memmove(d->raw, p, d->raw_len);
 
-  return pf;
+    if (status != Z_OK) {
+      if (status != Z_STREAM_END)
+        WARN("Cannot parse cross-reference stream.");
+      xref_decoder_end(sec);
+    }
+  }
 }
+#endif /* HAVE_ZLIB */
 
-static void
-pdf_file_free (pdf_file *pf)
+/* Row ROW of the xref stream of SEC, or NULL if it has no such row */
+static const unsigned char *
+xref_stream_row (struct xref_section *sec, long row)
 {
-  unsigned long i;
-
-  if (!pf) {
+  if (sec->state == XREFSTM_RAW) {
+#if HAVE_ZLIB
+    if (xref_decoder_new(sec))
+      sec->state = XREFSTM_CHUNKED;
+    else
+#endif
+    {
+      pdf_obj *tmp;
+
+      sec->state = XREFSTM_DONE;
+      tmp = pdf_stream_uncompress(sec->stream);
+      if (!tmp) {
+        WARN("Cannot uncompress cross-reference stream.");
+        return NULL;
+      }
+      sec->num_rows = pdf_stream_length(tmp) / sec->wsum;
+      sec->rows = NEW(sec->num_rows * sec->wsum + 1, unsigned char);
+      memcpy(sec->rows, pdf_stream_dataptr(tmp), sec->num_rows * sec->wsum);
+      texpdf_release_obj(tmp);
+    }
+  }
+#if HAVE_ZLIB
+  if (row >= sec->num_rows && sec->state == XREFSTM_CHUNKED)
+    xref_decoder_run(sec, row + 1);
+#endif
+
+  return row < sec->num_rows ? sec->rows + row * sec->wsum : NULL;
+}
+
+/* Read the entry of NUM in SEC into E; 0 if SEC has none, -1 on errors */
+static int
+xref_section_entry (pdf_file *pf, struct xref_section *sec,
+                    unsigned long num, xref_entry *e)
+{
+  struct xref_range *r;
+  long lo = 0, hi = sec->num_ranges;
+
+  while (lo < hi) {
+    long mid = lo + (hi - lo) / 2;
+    if (sec->ranges[mid].first <= num)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  if (lo == 0 || num >= sec->ranges[lo - 1].first + sec->ranges[lo - 1].size)
+    return 0;
+  r = &sec->ranges[lo - 1];
+
+  if (!sec->stream) {
+    char buf[20];
+
+    memcpy(buf, pf->map->data + r->start + 20 * (num - r->first), 20);
+    if (parse_xref_table_entry(pf, buf, num, e) < 0)
+      return -1;
+  } else {
+    const char *p;
+
+    p = (const char *) xref_stream_row(sec, r->start + (num - r->first));
+    if (!p) {
+      WARN("Cannot parse cross-reference stream.");
+      return -1;
+    }
+    texpdf_parse_xrefstm_entry(&p, sec->W, e);
+  }
+
+  return 1;
+}
+
+/* Fill in the xref entry of NUM as read_xref() would have done */
+static int
+xref_entry_load (pdf_file *pf, unsigned long num)
+{
+  xref_entry *e = &pf->xref_table[num], entry;
+  long        i;
+
+  pf->xref_loaded[num] = 1;
+  for (i = 0; i < pf->num_sections && !e->field2; i++) {
+    int r = xref_section_entry(pf, pf->sections[i], num, &entry);
+
+    if (r < 0)
+      break;
+    else if (r > 0) {
+      e->type   = entry.type;
+      e->field2 = entry.field2;
+      e->field3 = entry.field3;
+    }
+  }
+
+  return 1;
+}
+
+static void
+xref_sections_free (pdf_file *pf)
+{
+  long i;
+
+  for (i = 0; i < pf->num_sections; i++) {
+    struct xref_section *sec = pf->sections[i];
+
+#if HAVE_ZLIB
+    if (sec->decoder)
+      xref_decoder_end(sec);
+#endif
+    if (sec->ranges)
+      RELEASE(sec->ranges);
+    if (sec->rows)
+      RELEASE(sec->rows);
+    if (sec->stream)
+      texpdf_release_obj(sec->stream);
+    RELEASE(sec);
+  }
+  if (pf->sections)
+    RELEASE(pf->sections);
+  pf->sections     = NULL;
+  pf->num_sections = 0;
+}
+
+/* TODO: parse Version entry */
+static int
+cmp_offset (const void *a, const void *b)
+{
+  off_t x = *(const off_t *) a, y = *(const off_t *) b;
+
+  return x < y ? -1 : x > y;
+}
+
+/* Sort the offsets of all objects stored directly in the file */
+static void
+build_offset_index (pdf_file *pf)
+{
+  long i, n = 0;
+
+  pf->offsets = NEW(pf->num_obj + 1, off_t);
+  for (i = 0; i < pf->num_obj; i++) {
+    if (pf->xref_table[i].type == 1)
+      pf->offsets[n++] = pf->xref_table[i].field2;
+  }
+  qsort(pf->offsets, n, sizeof(off_t), cmp_offset);
+  pf->num_offsets = n;
+}
+
+/* Read the xref sections of PF, or only index them if LAZY */
+static pdf_obj *
+read_xref (pdf_file *pf, int lazy)
+{
+  pdf_obj *trailer = NULL, *main_trailer = NULL;
+  off_t    xref_pos;
+  long     i;
+
+  if (!(xref_pos = find_xref(pf->file)))
+    goto error;
+
+  /* Entries are read from the map later on */
+  if (!pf->map)
+    lazy = 0;
+
+  while (xref_pos) {
+    pdf_obj *prev;
+
+    int res = texpdf_parse_xref_table(pf, xref_pos,
+                                      lazy ? xref_section_new(pf) : NULL);
+    if (res > 0) {
+      /* cross-reference table */
+      pdf_obj *xrefstm;
+
+      if (!(trailer = texpdf_parse_trailer(pf)))
+	goto error;
+
+      if (!main_trailer)
+	main_trailer = texpdf_link_obj(trailer);
+
+      if ((xrefstm = texpdf_lookup_dict(trailer, "XRefStm"))) {
+	pdf_obj *new_trailer = NULL;
+	if (PDF_OBJ_NUMBERTYPE(xrefstm) &&
+	    texpdf_parse_xref_stream(pf, (off_t) texpdf_number_value(xrefstm),
+			      &new_trailer,
+			      lazy ? xref_section_new(pf) : NULL))
+	  texpdf_release_obj(new_trailer);
+	else
+	  WARN("Skipping hybrid reference section.");
+	/* Many PDF 1.5 xref streams use DecodeParms, which we cannot
+	   parse. This way we can use at least xref tables in hybrid
+	   documents. Or should we better stop parsing the file?
+	*/
+      }
+
+    } else if (!res &&
+	       texpdf_parse_xref_stream(pf, xref_pos, &trailer,
+				 lazy ? pf->sections[pf->num_sections - 1] : NULL)) {
+      /* cross-reference stream */
+      if (!main_trailer)
+	main_trailer = texpdf_link_obj(trailer);
+    } else
+      goto error;
+
+    if ((prev = texpdf_lookup_dict(trailer, "Prev"))) {
+      if (PDF_OBJ_NUMBERTYPE(prev))
+	xref_pos = (off_t) texpdf_number_value(prev);
+      else
+	goto error;
+    } else
+      xref_pos = 0;
+
+    texpdf_release_obj(trailer);
+  }
+
+#if 0
+  if (!texpdf_lookup_dict(main_trailer, "Root")) {
+      WARN("Trailer doesn't have catalog. Is this a correct PDF file?");
+      goto error;
+    }
+#endif
+
+  if (lazy) {
+    for (i = 0; i < pf->num_sections; i++)
+      qsort(pf->sections[i]->ranges, pf->sections[i]->num_ranges,
+            sizeof(struct xref_range), cmp_xref_range);
+    pf->xref_loaded = NEW(pf->num_obj + 1, char);
+    memset(pf->xref_loaded, 0, pf->num_obj + 1);
+  } else
+    build_offset_index(pf);
+
+  return main_trailer;
+
+ error:
+  WARN("Error while parsing PDF file.");
+  if (trailer)
+    texpdf_release_obj(trailer);
+  if (main_trailer)
+    texpdf_release_obj(main_trailer);
+  return NULL;
+}
+
+static struct ht_table *pdf_files = NULL;
+
+/* Map the first SIZE bytes of FILE, or return NULL if that fails. */
+static struct input_map *
+input_map_open (FILE *file, off_t size)
+{
+#if defined(HAVE_SYS_MMAN_H) && defined(HAVE_MMAP)
+  struct input_map *map;
+  void             *data;
+
+  if (size <= 0 || (off_t) (size_t) size != size)
+    return NULL;
+  fflush(file);
+  data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fileno(file), 0);
+  if (data == MAP_FAILED)
+    return NULL;
+
+  map = NEW(1, struct input_map);
+  map->data     = data;
+  map->size     = size;
+  map->refcount = 1;
+
+  return map;
+#else
+  return NULL;
+#endif
+}
+
+static void
+input_map_release (struct input_map *map)
+{
+  if (!map || --map->refcount > 0)
+    return;
+#if defined(HAVE_SYS_MMAN_H) && defined(HAVE_MMAP)
+  munmap((void *) map->data, map->size);
+#endif
+  RELEASE(map);
+}
+
+/*
+ * Background prefetch of input files, see texpdf_prefetch_file().
+ * Objects cannot be parsed off the main thread (reference counts, the
+ * object cache and page arenas are not thread-safe), so the workers
+ * only do the I/O: they map an announced file and fault its pages in,
+ * and texpdf_open() parses from that warm map.
+ */
+#define PREFETCH_THREADS 2
+
+#define PREFETCH_QUEUED  0
+#define PREFETCH_RUNNING 1
+#define PREFETCH_DONE    2
+
+struct prefetch_job
+{
+  char       *filename;
+  int         state;
+  const char *data;     /* mapping made by the worker, or NULL */
+  off_t       size;
+  struct prefetch_job *next;
+};
+
+static struct prefetch_job *prefetch_head = NULL, *prefetch_tail = NULL;
+
+#ifdef HAVE_PTHREAD
+static pthread_t       prefetch_workers[PREFETCH_THREADS];
+static int             num_prefetch_workers = 0;
+static int             prefetch_stop = 0;
+static pthread_mutex_t prefetch_lock  = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  prefetch_ready = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t  prefetch_done  = PTHREAD_COND_INITIALIZER;
+
+/* Runs in a worker thread: must not call NEW() or ERROR(). */
+static void
+prefetch_read (struct prefetch_job *job)
+{
+  FILE *file;
+  off_t size;
+
+  if (!(file = fopen(job->filename, FOPEN_RBIN_MODE)))
+    return;
+  fseeko(file, (off_t) 0, SEEK_END);
+  size = ftello(file);
+#if defined(HAVE_SYS_MMAN_H) && defined(HAVE_MMAP)
+  if (size > 0 && (off_t) (size_t) size == size) {
+    void *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fileno(file), 0);
+
+    if (data != MAP_FAILED) {
+      volatile char sum = 0;
+      off_t i;
+
+#ifdef MADV_WILLNEED
+      madvise(data, size, MADV_WILLNEED);
+#endif
+      for (i = 0; i < size; i += 4096)
+        sum += ((const char *) data)[i];
+      job->data = data;
+      job->size = size;
+    }
+  }
+#else
+  {
+    char buf[WORK_BUFFER_SIZE];
+
+    /* Just get the file into the operating system's cache */
+    rewind(file);
+    while (fread(buf, 1, sizeof(buf), file) > 0)
+      ;
+  }
+#endif
+  fclose(file);
+}
+
+static void *
+prefetch_worker (void *arg)
+{
+  (void) arg;
+
+  pthread_mutex_lock(&prefetch_lock);
+  while (!prefetch_stop) {
+    struct prefetch_job *job;
+
+    for (job = prefetch_head; job && job->state != PREFETCH_QUEUED; job = job->next)
+      ;
+    if (!job) {
+      pthread_cond_wait(&prefetch_ready, &prefetch_lock);
+      continue;
+    }
+    job->state = PREFETCH_RUNNING;
+    pthread_mutex_unlock(&prefetch_lock);
+
+    prefetch_read(job);
+
+    pthread_mutex_lock(&prefetch_lock);
+    job->state = PREFETCH_DONE;
+    pthread_cond_broadcast(&prefetch_done);
+  }
+  pthread_mutex_unlock(&prefetch_lock);
+
+  return NULL;
+}
+#endif /* HAVE_PTHREAD */
+
+/*
+ * Start reading FILENAME in the background because it is about to be
+ * included; ident and filename are the same for included PDF files.
+ * Without thread support this does nothing.
+ */
+void
+texpdf_prefetch_file (const char *filename)
+{
+#ifdef HAVE_PTHREAD
+  struct prefetch_job *job;
+
+  if (!filename ||
+      (pdf_files && texpdf_ht_lookup_table(pdf_files, filename, strlen(filename))))
+    return;
+
+  pthread_mutex_lock(&prefetch_lock);
+  for (job = prefetch_head; job; job = job->next) {
+    if (!strcmp(job->filename, filename)) {
+      pthread_mutex_unlock(&prefetch_lock);
+      return;
+    }
+  }
+  while (num_prefetch_workers < PREFETCH_THREADS) {
+    prefetch_stop = 0;
+    if (pthread_create(&prefetch_workers[num_prefetch_workers], NULL,
+                       prefetch_worker, NULL))
+      break;
+    num_prefetch_workers++;
+  }
+  if (num_prefetch_workers == 0) {
+    pthread_mutex_unlock(&prefetch_lock);
     return;
   }
 
+  job = NEW(1, struct prefetch_job);
+  job->filename = NEW(strlen(filename) + 1, char);
+  strcpy(job->filename, filename);
+  job->state = PREFETCH_QUEUED;
+  job->data  = NULL;
+  job->size  = 0;
+  job->next  = NULL;
+  if (prefetch_tail)
+    prefetch_tail->next = job;
+  else
+    prefetch_head = job;
+  prefetch_tail = job;
+  pthread_cond_signal(&prefetch_ready);
+  pthread_mutex_unlock(&prefetch_lock);
+#endif /* HAVE_PTHREAD */
+}
+
+static void
+prefetch_job_free (struct prefetch_job *job)
+{
+#if defined(HAVE_SYS_MMAN_H) && defined(HAVE_MMAP)
+  if (job->data)
+    munmap((void *) job->data, job->size);
+#endif
+  RELEASE(job->filename);
+  RELEASE(job);
+}
+
+/*
+ * The mapping of FILENAME made by a prefetch worker, or NULL. Waits
+ * for a worker still reading the file; a file not started yet is
+ * simply read by the caller.
+ */
+static struct input_map *
+prefetch_take (const char *filename)
+{
+  struct input_map    *map = NULL;
+#ifdef HAVE_PTHREAD
+  struct prefetch_job *job, *prev = NULL;
+
+  if (!filename)
+    return NULL;
+
+  pthread_mutex_lock(&prefetch_lock);
+  for (job = prefetch_head; job; prev = job, job = job->next) {
+    if (!strcmp(job->filename, filename))
+      break;
+  }
+  if (!job) {
+    pthread_mutex_unlock(&prefetch_lock);
+    return NULL;
+  }
+  while (job->state == PREFETCH_RUNNING)
+    pthread_cond_wait(&prefetch_done, &prefetch_lock);
+  if (prev)
+    prev->next = job->next;
+  else
+    prefetch_head = job->next;
+  if (prefetch_tail == job)
+    prefetch_tail = prev;
+  pthread_mutex_unlock(&prefetch_lock);
+
+  if (job->data) {
+    map = NEW(1, struct input_map);
+    map->data     = job->data;
+    map->size     = job->size;
+    map->refcount = 1;
+    job->data = NULL;
+  }
+  prefetch_job_free(job);
+#endif /* HAVE_PTHREAD */
+
+  return map;
+}
+
+/* Stop the prefetch workers and drop files that were never opened */
+static void
+prefetch_shutdown (void)
+{
+#ifdef HAVE_PTHREAD
+  int i;
+
+  pthread_mutex_lock(&prefetch_lock);
+  prefetch_stop = 1;
+  pthread_cond_broadcast(&prefetch_ready);
+  pthread_mutex_unlock(&prefetch_lock);
+  for (i = 0; i < num_prefetch_workers; i++)
+    pthread_join(prefetch_workers[i], NULL);
+  num_prefetch_workers = 0;
+#endif /* HAVE_PTHREAD */
+
+  while (prefetch_head) {
+    struct prefetch_job *job = prefetch_head;
+
+    prefetch_head = job->next;
+    prefetch_job_free(job);
+  }
+  prefetch_tail = NULL;
+}
+
+/* MAP is a prefetched mapping of FILE, or NULL */
+static pdf_file *
+pdf_file_new (FILE *file, struct input_map *map)
+{
+  pdf_file *pf;
+  ASSERT(file);
+  pf = NEW(1, pdf_file);
+  pf->file    = file;
+  pf->trailer = NULL;
+  pf->xref_table = NULL;
+  pf->catalog = NULL;
+  pf->num_obj = 0;
+  pf->version = 0;
+  pf->offsets = NULL;
+  pf->num_offsets = 0;
+  pf->pages     = NULL;
+  pf->num_pages = -1;
+  pf->cache_nodes = NULL;
+  pf->cache_head  = pf->cache_tail = NULL;
+  memset(&pf->cache_stats, 0, sizeof(pdf_cache_stats));
+  pf->sections     = NULL;
+  pf->num_sections = 0;
+  pf->xref_loaded  = NULL;
+
+  seek_end(file);
+  pf->file_size = tell_position(file);
+  if (map && map->size != pf->file_size) {
+    input_map_release(map);  /* changed since */
+    map = NULL;
+  }
+  pf->map = map ? map : input_map_open(file, pf->file_size);
+
+  return pf;
+}
+
+/* Drop the objects cached by PF */
+static void
+pdf_file_release_objects (pdf_file *pf)
+{
+  unsigned long i;
+
+  pdf_file_pages_free(pf);
+  while (pf->cache_head)
+    cache_remove(pf->cache_head);
   for (i = 0; i < pf->num_obj; i++) {
     if (pf->xref_table[i].direct)
       texpdf_release_obj(pf->xref_table[i].direct);
     if (pf->xref_table[i].indirect)
       texpdf_release_obj(pf->xref_table[i].indirect);
+    pf->xref_table[i].direct = pf->xref_table[i].indirect = NULL;
   }
+  if (pf->catalog)
+    texpdf_release_obj(pf->catalog);
+  pf->catalog = NULL;
+}
 
+static void
+pdf_file_free (pdf_file *pf)
+{
+  if (!pf) {
+    return;
+  }
+
+  pdf_file_release_objects(pf);
   RELEASE(pf->xref_table);
+  if (pf->cache_nodes)
+    RELEASE(pf->cache_nodes);
+  if (pf->offsets)
+    RELEASE(pf->offsets);
+  xref_sections_free(pf);
+  if (pf->xref_loaded)
+    RELEASE(pf->xref_loaded);
   if (pf->trailer)
     texpdf_release_obj(pf->trailer);
-  if (pf->catalog)
-    texpdf_release_obj(pf->catalog);
+  input_map_release(pf->map);
 
   RELEASE(pf);  
 }
@@ -3179,21 +5793,231 @@ int
 texpdf_file_get_version (pdf_file *pf)
 {
   ASSERT(pf);
-  return pf->version;
+  return pf->version;
+}
+
+pdf_obj *
+pdf_file_get_trailer (pdf_file *pf)
+{
+  ASSERT(pf);
+  return texpdf_link_obj(pf->trailer);
+}
+
+pdf_obj *
+pdf_file_get_catalog (pdf_file *pf)
+{
+  ASSERT(pf);
+  return pf->catalog;
+}
+
+/*
+ * The page index is built on first use by walking the page tree once;
+ * it records every leaf page together with the values of the
+ * inheritable attributes that apply to it.
+ */
+static void
+pdf_file_pages_free (pdf_file *pf)
+{
+  long i;
+
+  for (i = 0; i < pf->num_pages; i++) {
+    pdf_file_page *page = &pf->pages[i];
+
+    texpdf_release_obj(page->ref);
+    texpdf_release_obj(page->resources);
+    texpdf_release_obj(page->media_box);
+    texpdf_release_obj(page->crop_box);
+    texpdf_release_obj(page->rotate);
+  }
+  if (pf->pages)
+    RELEASE(pf->pages);
+  pf->pages     = NULL;
+  pf->num_pages = -1;
+}
+
+/* Replace *SLOT by the value of KEY in NODE, if there is one */
+static void
+page_inherit (pdf_obj **slot, pdf_obj *node, const char *key)
+{
+  pdf_obj *value = pdf_deref_obj(texpdf_lookup_dict(node, key));
+
+  if (value) {
+    texpdf_release_obj(*slot);
+    *slot = value;
+  }
+}
+
+static void
+pdf_file_pages_add (pdf_file *pf, long *max_pages, pdf_file_page *page)
+{
+  if (pf->num_pages == *max_pages) {
+    *max_pages += 64;
+    pf->pages = RENEW(pf->pages, *max_pages, pdf_file_page);
+  }
+  pf->pages[pf->num_pages++] = *page;
+}
+
+/*
+ * PATH holds the labels of the DEPTH nodes above REF, to detect loops.
+ * A node that cannot be read takes up one page with a NULL ref, so the
+ * pages after it keep their numbers; a node already on the path is
+ * dropped, as its pages are indexed through the first reference.
+ */
+static void
+pdf_file_pages_walk (pdf_file *pf, pdf_obj *ref, const pdf_file_page *inherited,
+                     long *max_pages, unsigned long *path, int depth)
+{
+  pdf_obj      *node, *kids;
+  pdf_file_page own = { NULL, NULL, NULL, NULL, NULL };
+  long          i;
+
+  if (depth == PDF_OBJ_MAX_DEPTH) {
+    WARN("Page tree nested too deeply. Broken PDF file?");
+    pdf_file_pages_add(pf, max_pages, &own);
+    return;
+  }
+  if (PDF_OBJ_INDIRECTTYPE(ref)) {
+    for (i = 0; i < depth; i++) {
+      if (path[i] == OBJ_NUM(ref)) {
+        WARN("Loop in page tree at object %lu. Broken PDF file?", path[i]);
+        return;
+      }
+    }
+    path[depth] = OBJ_NUM(ref);
+  } else
+    path[depth] = 0;
+  node = pdf_deref_obj(ref);
+  if (!PDF_OBJ_DICTTYPE(node)) {
+    WARN("Invalid node in page tree. Broken PDF file?");
+    texpdf_release_obj(node);
+    pdf_file_pages_add(pf, max_pages, &own);
+    return;
+  }
+
+#define LINK_OR_NULL(o) ((o) ? texpdf_link_obj(o) : NULL)
+  own.resources = LINK_OR_NULL(inherited->resources);
+  own.media_box = LINK_OR_NULL(inherited->media_box);
+  own.crop_box  = LINK_OR_NULL(inherited->crop_box);
+  own.rotate    = LINK_OR_NULL(inherited->rotate);
+#undef LINK_OR_NULL
+  page_inherit(&own.resources, node, "Resources");
+  page_inherit(&own.media_box, node, "MediaBox");
+  page_inherit(&own.crop_box,  node, "CropBox");
+  page_inherit(&own.rotate,    node, "Rotate");
+
+  kids = pdf_deref_obj(texpdf_lookup_dict(node, "Kids"));
+  if (kids) {
+    if (PDF_OBJ_ARRAYTYPE(kids)) {
+      for (i = 0; i < texpdf_array_length(kids); i++)
+        pdf_file_pages_walk(pf, texpdf_get_array(kids, i), &own,
+                            max_pages, path, depth + 1);
+    } else {
+      pdf_file_page bad = { NULL, NULL, NULL, NULL, NULL };
+
+      WARN("Invalid Kids in page tree. Broken PDF file?");
+      pdf_file_pages_add(pf, max_pages, &bad);
+    }
+    texpdf_release_obj(kids);
+    texpdf_release_obj(own.resources);
+    texpdf_release_obj(own.media_box);
+    texpdf_release_obj(own.crop_box);
+    texpdf_release_obj(own.rotate);
+  } else {
+    own.ref = PDF_OBJ_INDIRECTTYPE(ref) ?
+      texpdf_link_obj(ref) : texpdf_link_obj(node);
+    pdf_file_pages_add(pf, max_pages, &own);
+  }
+  texpdf_release_obj(node);
+}
+
+static void
+pdf_file_pages_build (pdf_file *pf)
+{
+  pdf_file_page none = { NULL, NULL, NULL, NULL, NULL };
+  long          max_pages = 0;
+  unsigned long path[PDF_OBJ_MAX_DEPTH];
+  pdf_obj      *root = NULL;
+
+  if (pf->catalog)
+    root = pdf_deref_obj(texpdf_lookup_dict(pf->catalog, "Pages"));
+  if (!PDF_OBJ_DICTTYPE(root)) {
+    texpdf_release_obj(root);
+    pf->num_pages = -2; /* don't try again */
+    return;
+  }
+  texpdf_release_obj(root);
+
+  pf->num_pages = 0;
+  pdf_file_pages_walk(pf, texpdf_lookup_dict(pf->catalog, "Pages"), &none,
+                      &max_pages, path, 0);
+}
+
+long
+pdf_file_get_page_count (pdf_file *pf)
+{
+  ASSERT(pf);
+  if (pf->num_pages == -1)
+    pdf_file_pages_build(pf);
+
+  return pf->num_pages < 0 ? -1 : pf->num_pages;
 }
 
-pdf_obj *
-pdf_file_get_trailer (pdf_file *pf)
+const pdf_file_page *
+pdf_file_get_page (pdf_file *pf, long page_idx)
 {
-  ASSERT(pf);
-  return texpdf_link_obj(pf->trailer);
+  if (page_idx < 0 || page_idx >= pdf_file_get_page_count(pf) ||
+      !pf->pages[page_idx].ref)
+    return NULL;
+
+  return &pf->pages[page_idx];
 }
 
-pdf_obj *
-pdf_file_get_catalog (pdf_file *pf)
+/* Read the xref and catalog of a PDF 1.VERSION file, see read_xref() */
+static pdf_file *
+pdf_file_read (FILE *file, struct input_map *map, int version, int lazy)
 {
-  ASSERT(pf);
-  return pf->catalog;
+  pdf_file *pf;
+  pdf_obj  *new_version;
+
+  pf = pdf_file_new(file, map);
+  pf->version = version;
+
+  if (!(pf->trailer = read_xref(pf, lazy)))
+    goto error;
+
+  if (texpdf_lookup_dict(pf->trailer, "Encrypt")) {
+    WARN("PDF document is encrypted.");
+    goto error;
+  }
+
+  pf->catalog = pdf_deref_obj(texpdf_lookup_dict(pf->trailer, "Root"));
+  if (!PDF_OBJ_DICTTYPE(pf->catalog)) {
+    WARN("Cannot read PDF document catalog. Broken PDF file?");
+    goto error;
+  }
+
+  new_version = pdf_deref_obj(texpdf_lookup_dict(pf->catalog, "Version"));
+  if (new_version) {
+    unsigned int minor;
+
+    if (!PDF_OBJ_NAMETYPE(new_version) ||
+	sscanf(texpdf_name_value(new_version), "1.%u", &minor) != 1) {
+      texpdf_release_obj(new_version);
+      WARN("Illegal Version entry in document catalog. Broken PDF file?");
+      goto error;
+    }
+
+    if (pf->version < minor)
+      pf->version = minor;
+
+    texpdf_release_obj(new_version);
+  }
+
+  return pf;
+
+ error:
+  pdf_file_free(pf);
+  return NULL;
 }
 
 pdf_file *
@@ -3209,7 +6033,6 @@ texpdf_open (const char *ident, FILE *file)
   if (pf) {
     pf->file = file;
   } else {
-    pdf_obj *new_version;
     int version = texpdf_check_for_pdf_version(file);
 
     if (version < 1 || version > pdf_version) {
@@ -3217,62 +6040,823 @@ texpdf_open (const char *ident, FILE *file)
       return NULL;
     }
 
-    pf = pdf_file_new(file);
-    pf->version = version;
+    if (!(pf = pdf_file_read(file, prefetch_take(ident), version, lazy_xref)))
+      return NULL;
+
+    if (ident)
+      texpdf_ht_append_table(pdf_files, ident, strlen(ident), pf);
+  }
 
-    if (!(pf->trailer = read_xref(pf)))
-      goto error;
+  return pf;
+}
 
-    if (texpdf_lookup_dict(pf->trailer, "Encrypt")) {
-      WARN("PDF document is encrypted.");
-      goto error;
+void
+texpdf_close (pdf_file *pf)
+{
+  if (pf)
+    pf->file = NULL;
+}
+
+/*
+ * Incremental update: instead of writing a new file, append new and
+ * replaced objects to FILENAME, followed by an xref section whose
+ * /Prev points to the previous one. Objects of the existing file are
+ * read through the returned pdf_file and may be referenced directly.
+ */
+pdf_file *
+texpdf_update_begin (const char *filename)
+{
+  FILE     *file;
+  pdf_file *pf = NULL;
+  pdf_obj  *size = NULL;
+  off_t     prev = 0;
+  int       version;
+  static const char *keys[] = {"Root", "Info", "ID", NULL};
+  const char **key;
+
+  file = MFOPEN(filename, FOPEN_RBIN_MODE);
+  if (!file)
+    ERROR("Unable to open \"%s\".", filename);
+
+  version = texpdf_check_for_pdf_version(file);
+  if (version >= 1 && (pf = pdf_file_read(file, NULL, version, 0)) != NULL) {
+    seek_end(file);
+    prev = find_xref(file);
+  }
+  if (!pf || !prev ||
+      !PDF_OBJ_NUMBERTYPE(size = texpdf_lookup_dict(pf->trailer, "Size"))) {
+    if (pf)
+      pdf_file_free(pf);
+    MFCLOSE(file);
+    ERROR("Cannot update \"%s\". Broken PDF file?", filename);
+  }
+
+  update_file = pf;
+  update_size = (unsigned long) texpdf_number_value(size);
+  output_xref = NULL;
+  pdf_max_ind_objects = 0;
+  add_xref_entry(0, 0, 0, 0xffff);
+  next_label = update_size;
+
+  pdf_out_begin(pf->version, 0);
+  for (key = keys; *key; key++) {
+    pdf_obj *value = texpdf_lookup_dict(pf->trailer, *key);
+    if (value)
+      texpdf_add_dict(trailer_dict, texpdf_new_name(*key), texpdf_link_obj(value));
+  }
+  texpdf_add_dict(trailer_dict, texpdf_new_name("Prev"), texpdf_new_number(prev));
+
+  pdf_output_file = MFOPEN(filename, FOPEN_A_MODE);
+  if (!pdf_output_file)
+    ERROR("Unable to open \"%s\".", filename);
+  pdf_output_file_position = pf->file_size;
+  pdf_output_line_position = 0;
+
+  enc_mode = 0;
+  doc_enc_mode = 0;
+
+  return pf;
+}
+
+/*
+ * Replace the object of the file being updated that REF refers to.
+ * OBJECT is released; from now on it is what reading REF returns, and
+ * it is written by texpdf_update_end() at the latest.
+ */
+void
+texpdf_update_obj (pdf_obj *ref, pdf_obj *object)
+{
+  pdf_indirect *indirect;
+  unsigned long label;
+
+  if (!update_file)
+    ERROR("update_obj: No file is being updated.");
+  if (!PDF_OBJ_INDIRECTTYPE(ref))
+    ERROR("update_obj: Not a reference.");
+  indirect = (pdf_indirect *) ref->data;
+  if (indirect->pf != update_file)
+    ERROR("update_obj: Not a reference into the file being updated.");
+  if (INVALIDOBJ(object) || object->label)
+    ERROR("update_obj: Object is invalid or has a label already.");
+
+  label = indirect->label;
+  object->label      = label;
+  object->generation = indirect->generation;
+
+  if (label >= update_file->num_obj) {
+    texpdf_release_obj(object);
+    return;
+  }
+  /* Drop the replaced object from the cache and keep OBJECT out of it */
+  if (update_file->cache_nodes[label])
+    cache_remove(update_file->cache_nodes[label]);
+  if (update_file->xref_table[label].direct)
+    texpdf_release_obj(update_file->xref_table[label].direct);
+  update_file->xref_table[label].direct = object;
+}
+
+void
+texpdf_update_end (void)
+{
+  FILE *file;
+
+  if (!update_file)
+    ERROR("update_end: No file is being updated.");
+
+  file = update_file->file;
+  pdf_out_flush();
+  MFCLOSE(file);
+  update_size = 0;
+}
+
+/*
+ * Linearized ("Fast Web View") output as described in Annex F of the
+ * PDF specification. The document is first written to a temporary
+ * file as usual; pdf_out_flush() then reads it back and writes the
+ * objects in the following order: the linearization dictionary and
+ * the first-page xref (parts 2 and 3), the catalog and document-level
+ * objects (4), the hint stream (5), everything used by the first page
+ * (6), the private objects of the other pages one page at a time (7),
+ * objects shared between those pages (8) and the rest (9), followed
+ * by the main xref. Objects are renumbered on the way and object
+ * streams are not used.
+ *
+ * This roughly doubles the cost of output: every object is serialized
+ * twice and the file is written twice and read once. While the final
+ * file is written, all objects of the document are held in memory,
+ * serialized. Streams are not compressed again.
+ */
+#define LIN_UNUSED  -1
+#define LIN_SHARED  -2
+#define LIN_PARTS   10
+
+struct lin_list
+{
+  unsigned long *labels;
+  long           count, max;
+};
+
+static void
+lin_list_add (struct lin_list *list, unsigned long label)
+{
+  if (list->count >= list->max) {
+    list->max += 256;
+    list->labels = RENEW(list->labels, list->max, unsigned long);
+  }
+  list->labels[list->count++] = label;
+}
+
+static void
+lin_list_free (struct lin_list *list)
+{
+  if (list->labels)
+    RELEASE(list->labels);
+  list->labels = NULL;
+  list->count = list->max = 0;
+}
+
+static int
+lin_key_is (struct pdf_dict_entry *entry, const char *key)
+{
+  return entry->atom->name && !strcmp(entry->atom->name, key);
+}
+
+/* The object a reference into the temporary file points to, or 0 */
+static unsigned long
+lin_label (pdf_obj *ref)
+{
+  pdf_indirect *indirect;
+
+  if (!PDF_OBJ_INDIRECTTYPE(ref))
+    return 0;
+  indirect = (pdf_indirect *) ref->data;
+  if (indirect->pf != linearize_file || indirect->label >= lin_num_objs)
+    return 0;
+  if (!lin_objs[indirect->label].object)
+    lin_objs[indirect->label].object =
+      texpdf_get_object(linearize_file, indirect->label, indirect->generation);
+
+  return indirect->label;
+}
+
+/*
+ * Append the objects reachable from OBJECT to LIST. /Parent is not
+ * followed, nor are other pages unless FOLLOW_PAGES is set.
+ */
+static void
+lin_collect (pdf_obj *object, unsigned long stamp, int follow_pages,
+             struct lin_list *list)
+{
+  unsigned long i, label;
+
+  if (!object)
+    return;
+
+  switch (object->type) {
+  case PDF_INDIRECT:
+    label = lin_label(object);
+    if (!label || lin_objs[label].visit == stamp ||
+        (lin_objs[label].page_node && !follow_pages))
+      return;
+    lin_objs[label].visit = stamp;
+    lin_list_add(list, label);
+    lin_collect(lin_objs[label].object, stamp, follow_pages, list);
+    break;
+  case PDF_ARRAY:
+    {
+      pdf_array *array = (pdf_array *) object->data;
+      for (i = 0; i < array->size; i++)
+        lin_collect(array->values[i], stamp, follow_pages, list);
+    }
+    break;
+  case PDF_DICT:
+    {
+      pdf_dict *dict = (pdf_dict *) object->data;
+      for (i = 0; i < dict->size; i++) {
+        if (lin_key_is(&dict->entries[i], "Parent"))
+          continue;
+        lin_collect(dict->entries[i].value, stamp, follow_pages, list);
+      }
+    }
+    break;
+  case PDF_STREAM:
+    {
+      /* /Length is rewritten as a direct number */
+      pdf_dict *dict = (pdf_dict *) ((pdf_stream *) object->data)->dict->data;
+      for (i = 0; i < dict->size; i++) {
+        if (lin_key_is(&dict->entries[i], "Length"))
+          continue;
+        lin_collect(dict->entries[i].value, stamp, follow_pages, list);
+      }
     }
+    break;
+  }
+}
 
-    pf->catalog = pdf_deref_obj(texpdf_lookup_dict(pf->trailer, "Root"));
-    if (!PDF_OBJ_DICTTYPE(pf->catalog)) {
-      WARN("Cannot read PDF document catalog. Broken PDF file?");
-      goto error;
+/*
+ * Append the pages below the page tree node REF to PAGES in order.
+ * Inheritable attributes are copied into the pages themselves, so
+ * that every page carries what it needs.
+ */
+static const char *lin_inherited_keys[] = {
+  "Resources", "MediaBox", "CropBox", "Rotate"
+};
+#define LIN_INHERITED (sizeof(lin_inherited_keys)/sizeof(lin_inherited_keys[0]))
+
+static void
+lin_walk_pages (pdf_obj *ref, pdf_obj **inherited, struct lin_list *pages)
+{
+  pdf_obj *node, *kids, *value;
+  unsigned long label, i;
+
+  label = lin_label(ref);
+  if (!label || lin_objs[label].page_node ||
+      !PDF_OBJ_DICTTYPE(node = lin_objs[label].object))
+    return;
+  lin_objs[label].page_node = 1;
+
+  kids = texpdf_lookup_dict(node, "Kids");
+  if (PDF_OBJ_ARRAYTYPE(kids)) {
+    pdf_obj *own[LIN_INHERITED];
+
+    for (i = 0; i < LIN_INHERITED; i++) {
+      value = texpdf_lookup_dict(node, lin_inherited_keys[i]);
+      own[i] = value ? value : inherited[i];
+    }
+    for (i = 0; i < texpdf_array_length(kids); i++)
+      lin_walk_pages(texpdf_get_array(kids, i), own, pages);
+  } else {
+    for (i = 0; i < LIN_INHERITED; i++) {
+      if (inherited[i] && !texpdf_lookup_dict(node, lin_inherited_keys[i]))
+        texpdf_add_dict(node, texpdf_new_name(lin_inherited_keys[i]),
+                        texpdf_link_obj(inherited[i]));
     }
+    lin_list_add(pages, label);
+  }
+}
 
-    new_version = pdf_deref_obj(texpdf_lookup_dict(pf->catalog, "Version"));
-    if (new_version) {
-      unsigned int minor;
+static void
+lin_assign (struct lin_list *parts, unsigned long label, int part)
+{
+  lin_objs[label].part  = part;
+  lin_objs[label].index = parts[part].count;
+  lin_list_add(&parts[part], label);
+}
 
-      if (!PDF_OBJ_NAMETYPE(new_version) ||
-	  sscanf(texpdf_name_value(new_version), "1.%u", &minor) != 1) {
-	texpdf_release_obj(new_version);
-	WARN("Illegal Version entry in document catalog. Broken PDF file?");
-	goto error;
+/* Serialize OBJECT into D, as indirect object LABEL if nonzero */
+static void
+lin_serialize (pdf_obj *object, unsigned long label, struct deferred_obj *d)
+{
+  long length;
+
+  memset(d, 0, sizeof(*d));
+  capture = d;
+  pdf_output_line_position = 0;
+  enc_mode = 0;
+  if (label) {
+    length = sprintf(format_buffer, "%lu 0 obj\n", label);
+    pdf_out(pdf_output_file, format_buffer, length);
+  }
+  pdf_write_obj(object, pdf_output_file);
+  if (label)
+    pdf_out(pdf_output_file, "\nendobj\n", 8);
+  capture = NULL;
+}
+
+/* Bit-packed hint tables */
+struct lin_bits
+{
+  unsigned char *data;
+  long           length, max;
+  unsigned       acc;
+  int            count;
+};
+
+static void
+lin_bits_put (struct lin_bits *w, unsigned long value, int nbits)
+{
+  while (nbits-- > 0) {
+    w->acc = (w->acc << 1) | ((value >> nbits) & 1);
+    if (++w->count == 8) {
+      if (w->length >= w->max) {
+        w->max += 1024;
+        w->data = RENEW(w->data, w->max, unsigned char);
       }
+      w->data[w->length++] = (unsigned char) w->acc;
+      w->acc = w->count = 0;
+    }
+  }
+}
+
+/* Every item of a hint table starts on a byte boundary */
+static void
+lin_bits_flush (struct lin_bits *w)
+{
+  if (w->count > 0)
+    lin_bits_put(w, 0, 8 - w->count);
+}
+
+static int
+lin_nbits (unsigned long value)
+{
+  int n = 0;
 
-      if (pf->version < minor)
-	pf->version = minor;
+  while (value) {
+    n++;
+    value >>= 1;
+  }
 
-      texpdf_release_obj(new_version);
+  return n;
+}
+
+/*
+ * Page offset and shared object hint tables (F.4.1 and F.4.2). As
+ * required, offsets are those the objects would have without the
+ * hint stream.
+ */
+static void
+lin_hint_tables (struct lin_bits *w, long *shared_offset,
+                 struct lin_list *parts, struct lin_list *pages,
+                 struct lin_list *page_objs)
+{
+  long  npages = pages->count, i, j, k;
+  long *nobjs, *lengths, *nshared;
+  long  min_nobjs, max_nobjs, min_length, max_length;
+  long  max_nshared = 0, max_id = 0, min_glength, max_glength;
+  int   bits_nobjs, bits_length, bits_id;
+  struct lin_list *shared = &parts[8];
+
+  nobjs   = NEW(npages, long);
+  lengths = NEW(npages, long);
+  nshared = NEW(npages, long);
+
+  /* The objects of each page other than the first are contiguous in part 7 */
+  for (i = 0, k = 0; i < npages; i++) {
+    struct lin_list *objs = i ? &parts[7] : &parts[6];
+    long start = i ? k : 0;
+
+    if (i) {
+      while (k < objs->count && lin_objs[objs->labels[k]].page == i)
+        k++;
     }
+    nobjs[i]   = i ? k - start : objs->count;
+    lengths[i] = 0;
+    for (j = start; j < start + nobjs[i]; j++)
+      lengths[i] += lin_objs[objs->labels[j]].length;
+
+    nshared[i] = 0;
+    if (i) {
+      for (j = 0; j < page_objs[i].count; j++) {
+        struct lin_obj *lo = &lin_objs[page_objs[i].labels[j]];
+        long id;
+
+        if (lo->part == 6)
+          id = lo->index;
+        else if (lo->part == 8)
+          id = parts[6].count + lo->index;
+        else
+          continue;
+        nshared[i]++;
+        if (id > max_id)
+          max_id = id;
+      }
+    }
+    if (nshared[i] > max_nshared)
+      max_nshared = nshared[i];
+  }
 
-    if (ident)
-      texpdf_ht_append_table(pdf_files, ident, strlen(ident), pf);
+  min_nobjs = max_nobjs = nobjs[0];
+  min_length = max_length = lengths[0];
+  for (i = 1; i < npages; i++) {
+    if (nobjs[i] < min_nobjs) min_nobjs = nobjs[i];
+    if (nobjs[i] > max_nobjs) max_nobjs = nobjs[i];
+    if (lengths[i] < min_length) min_length = lengths[i];
+    if (lengths[i] > max_length) max_length = lengths[i];
+  }
+  bits_nobjs  = lin_nbits(max_nobjs - min_nobjs);
+  bits_length = lin_nbits(max_length - min_length);
+  bits_id     = lin_nbits(max_id);
+
+  /* Page offset hint table header */
+  lin_bits_put(w, min_nobjs, 32);
+  lin_bits_put(w, lin_objs[pages->labels[0]].offset, 32);
+  lin_bits_put(w, bits_nobjs, 16);
+  lin_bits_put(w, min_length, 32);
+  lin_bits_put(w, bits_length, 16);
+  lin_bits_put(w, 0, 32);            /* content stream offsets */
+  lin_bits_put(w, 0, 16);
+  lin_bits_put(w, min_length, 32);   /* content stream lengths */
+  lin_bits_put(w, bits_length, 16);
+  lin_bits_put(w, lin_nbits(max_nshared), 16);
+  lin_bits_put(w, bits_id, 16);
+  lin_bits_put(w, 0, 16);            /* numerators */
+  lin_bits_put(w, 4, 16);            /* denominator */
+
+  /* Per-page entries, one item at a time */
+  for (i = 0; i < npages; i++)
+    lin_bits_put(w, nobjs[i] - min_nobjs, bits_nobjs);
+  lin_bits_flush(w);
+  for (i = 0; i < npages; i++)
+    lin_bits_put(w, lengths[i] - min_length, bits_length);
+  lin_bits_flush(w);
+  for (i = 0; i < npages; i++)
+    lin_bits_put(w, nshared[i], lin_nbits(max_nshared));
+  lin_bits_flush(w);
+  for (i = 1; i < npages; i++) {
+    for (j = 0; j < page_objs[i].count; j++) {
+      struct lin_obj *lo = &lin_objs[page_objs[i].labels[j]];
+
+      if (lo->part == 6)
+        lin_bits_put(w, lo->index, bits_id);
+      else if (lo->part == 8)
+        lin_bits_put(w, parts[6].count + lo->index, bits_id);
+    }
+  }
+  lin_bits_flush(w);
+  for (i = 0; i < npages; i++)
+    lin_bits_put(w, lengths[i] - min_length, bits_length);
+  lin_bits_flush(w);
+
+  *shared_offset = w->length;
+
+  /* Shared object hint table: the first page's objects, then part 8 */
+  min_glength = max_glength = lin_objs[parts[6].labels[0]].length;
+  for (k = 6; k <= 8; k += 2) {
+    for (j = 0; j < parts[k].count; j++) {
+      long length = lin_objs[parts[k].labels[j]].length;
+      if (length < min_glength) min_glength = length;
+      if (length > max_glength) max_glength = length;
+    }
+  }
+  lin_bits_put(w, shared->count ? lin_objs[shared->labels[0]].new_label : 0, 32);
+  lin_bits_put(w, shared->count ? lin_objs[shared->labels[0]].offset : 0, 32);
+  lin_bits_put(w, parts[6].count, 32);
+  lin_bits_put(w, parts[6].count + shared->count, 32);
+  lin_bits_put(w, 0, 16);            /* one object per group */
+  lin_bits_put(w, min_glength, 32);
+  lin_bits_put(w, lin_nbits(max_glength - min_glength), 16);
+  for (k = 6; k <= 8; k += 2) {
+    for (j = 0; j < parts[k].count; j++)
+      lin_bits_put(w, lin_objs[parts[k].labels[j]].length - min_glength,
+                   lin_nbits(max_glength - min_glength));
+  }
+  lin_bits_flush(w);
+  for (k = 6; k <= 8; k += 2) {
+    for (j = 0; j < parts[k].count; j++)
+      lin_bits_put(w, 0, 1);         /* no MD5 signatures */
   }
+  lin_bits_flush(w);
 
-  return pf;
+  RELEASE(nobjs);
+  RELEASE(lengths);
+  RELEASE(nshared);
+}
 
- error:
-  pdf_file_free(pf);
-  return NULL;
+static void
+lin_out_xref_entry (off_t offset)
+{
+  long length = sprintf(format_buffer, "%010" PRId64 " %05hu n \n",
+                        (int64_t) offset, 0);
+  pdf_out(pdf_output_file, format_buffer, length);
 }
 
-void
-texpdf_close (pdf_file *pf)
+/* Copy the temporary file unchanged */
+static void
+lin_copy (FILE *tmp)
 {
-  if (pf)
-    pf->file = NULL;
+  size_t length;
+
+  rewind(tmp);
+  while ((length = fread(work_buffer, 1, WORK_BUFFER_SIZE, tmp)) > 0)
+    pdf_out(pdf_output_file, work_buffer, length);
+}
+
+static void
+pdf_linearize (void)
+{
+  FILE           *tmp = pdf_output_file;
+  pdf_file       *pf;
+  pdf_obj        *catalog, *id;
+  pdf_obj        *inherited[LIN_INHERITED];
+  struct lin_list pages, *page_objs, parts[LIN_PARTS], rest;
+  struct deferred_obj id_buf, hint;
+  struct lin_bits bits;
+  unsigned long   root_label, info_label, hint_label, label, size, i;
+  unsigned long   main_size, first_label, first_count;
+  long            header_length, dict_length, xref_length, trailer_length;
+  off_t           pos, hint_offset = 0, first_page_end = 0, main_xref;
+  off_t           main_entries, file_length;
+  long            shared_offset, j, n;
+  int             k;
+  static const char *doc_keys[] = {
+    "ViewerPreferences", "PageMode", "Threads", "OpenAction", "AcroForm", NULL
+  };
+  static const int order[] = {4, 6, 7, 8, 9};
+
+  pdf_out_flush_buffer();
+  fflush(tmp);
+  if (!(pf = pdf_file_read(tmp, NULL, pdf_version, 0)))
+    ERROR("Cannot read back temporary file for linearization.");
+
+  if (linearize_target) {
+    pdf_output_file = MFOPEN(linearize_target, FOPEN_WBIN_MODE);
+    if (!pdf_output_file)
+      ERROR("Unable to open \"%s\".", linearize_target);
+  } else {
+#if defined(WIN32) && !defined(__MINGW32__)
+    setmode(fileno(stdout), _O_BINARY);
+#endif
+    pdf_output_file = stdout;
+  }
+  pdf_output_file_position = 0;
+  pdf_output_line_position = 0;
+
+  linearize_file = pf;
+  lin_num_objs   = pf->num_obj;
+  lin_objs       = NEW(lin_num_objs, struct lin_obj);
+  memset(lin_objs, 0, lin_num_objs * sizeof(struct lin_obj));
+  for (i = 0; i < lin_num_objs; i++)
+    lin_objs[i].page = LIN_UNUSED;
+  memset(&pages, 0, sizeof(pages));
+  memset(&rest, 0, sizeof(rest));
+  memset(parts, 0, sizeof(parts));
+  for (i = 0; i < LIN_INHERITED; i++)
+    inherited[i] = NULL;
+
+  root_label = lin_label(texpdf_lookup_dict(pf->trailer, "Root"));
+  info_label = lin_label(texpdf_lookup_dict(pf->trailer, "Info"));
+  id         = texpdf_lookup_dict(pf->trailer, "ID");
+  catalog    = root_label ? lin_objs[root_label].object : NULL;
+  if (PDF_OBJ_DICTTYPE(catalog))
+    lin_walk_pages(texpdf_lookup_dict(catalog, "Pages"), inherited, &pages);
+  if (pages.count == 0) {
+    WARN("No pages found, file not linearized.");
+    lin_copy(tmp);
+    goto done;
+  }
+
+  /* Objects used by each page */
+  page_objs = NEW(pages.count, struct lin_list);
+  memset(page_objs, 0, pages.count * sizeof(struct lin_list));
+  for (j = 0; j < pages.count; j++) {
+    label = pages.labels[j];
+    lin_objs[label].visit = j + 1;
+    lin_list_add(&page_objs[j], label);
+    lin_collect(lin_objs[label].object, j + 1, 0, &page_objs[j]);
+    for (n = 0; n < page_objs[j].count; n++) {
+      struct lin_obj *lo = &lin_objs[page_objs[j].labels[n]];
+      if (lo->page == LIN_UNUSED)
+        lo->page = j;
+      else if (lo->page != j)
+        lo->page = LIN_SHARED;
+    }
+  }
+
+  /* Assign objects to parts */
+  for (n = 0; n < page_objs[0].count; n++)
+    lin_assign(parts, page_objs[0].labels[n], 6);
+  for (j = 1; j < pages.count; j++) {
+    for (n = 0; n < page_objs[j].count; n++) {
+      label = page_objs[j].labels[n];
+      if (!lin_objs[label].part)
+        lin_assign(parts, label, lin_objs[label].page == j ? 7 : 8);
+    }
+  }
+  if (!lin_objs[root_label].part)
+    lin_assign(parts, root_label, 4);
+  for (k = 0; doc_keys[k]; k++)
+    lin_collect(texpdf_lookup_dict(catalog, doc_keys[k]),
+                pages.count + 1, 0, &rest);
+  for (n = 0; n < rest.count; n++) {
+    label = rest.labels[n];
+    if (!lin_objs[label].part && lin_objs[label].page == LIN_UNUSED)
+      lin_assign(parts, label, 4);
+  }
+  rest.count = 0;
+  lin_objs[root_label].visit = pages.count + 2;
+  lin_collect(catalog, pages.count + 2, 1, &rest);
+  lin_collect(texpdf_lookup_dict(pf->trailer, "Info"), pages.count + 2, 1, &rest);
+  for (n = 0; n < rest.count; n++) {
+    label = rest.labels[n];
+    if (!lin_objs[label].part)
+      lin_assign(parts, label, 9);
+  }
+
+  /*
+   * Number the main section (parts 7 to 9) from 1 on, then the
+   * first-page section: linearization dictionary, part 4, hint
+   * stream and part 6.
+   */
+  size = 1;
+  for (k = 2; k < 5; k++) {
+    for (j = 0; j < parts[order[k]].count; j++)
+      lin_objs[parts[order[k]].labels[j]].new_label = size++;
+  }
+  main_size   = size;
+  first_label = size++;
+  for (j = 0; j < parts[4].count; j++)
+    lin_objs[parts[4].labels[j]].new_label = size++;
+  hint_label = size++;
+  for (j = 0; j < parts[6].count; j++)
+    lin_objs[parts[6].labels[j]].new_label = size++;
+  first_count = size - first_label;
+
+  for (k = 0; k < 5; k++) {
+    for (j = 0; j < parts[order[k]].count; j++) {
+      struct lin_obj *lo = &lin_objs[parts[order[k]].labels[j]];
+      struct deferred_obj d;
+
+      lin_serialize(lo->object, lo->new_label, &d);
+      lo->bytes  = d.bytes;
+      lo->length = d.length;
+    }
+  }
+  memset(&id_buf, 0, sizeof(id_buf));
+  if (id)
+    lin_serialize(id, 0, &id_buf);
+
+  /* Sizes of what precedes part 4 do not depend on the values in it */
+  header_length = sprintf(format_buffer, "%%PDF-1.%u\n%s", pdf_version, BINARY_MARKER);
+  dict_length = sprintf(format_buffer,
+                        "%lu 0 obj\n<</Linearized 1/L %10" PRId64 "/H [%10" PRId64
+                        " %10ld]/O %lu/E %10" PRId64 "/N %ld/T %10" PRId64 ">>\nendobj\n",
+                        first_label, (int64_t) 0, (int64_t) 0, 0L,
+                        lin_objs[pages.labels[0]].new_label, (int64_t) 0,
+                        pages.count, (int64_t) 0);
+  xref_length = sprintf(format_buffer, "xref\n%lu %lu\n", first_label, first_count);
+  xref_length += 20 * first_count;
+  trailer_length = sprintf(format_buffer, "trailer\n<</Size %lu/Root %lu 0 R",
+                           size, lin_objs[root_label].new_label);
+  if (info_label && lin_objs[info_label].new_label)
+    trailer_length += sprintf(format_buffer, "/Info %lu 0 R",
+                              lin_objs[info_label].new_label);
+  if (id)
+    trailer_length += 3 + id_buf.length;
+  trailer_length += sprintf(format_buffer, "/Prev %10" PRId64 ">>\nstartxref\n0\n%%%%EOF\n",
+                            (int64_t) 0);
+
+  pos = header_length + dict_length + xref_length + trailer_length;
+  for (k = 0; k < 5; k++) {
+    if (order[k] == 6)
+      hint_offset = pos;
+    for (j = 0; j < parts[order[k]].count; j++) {
+      lin_objs[parts[order[k]].labels[j]].offset = pos;
+      pos += lin_objs[parts[order[k]].labels[j]].length;
+    }
+    if (order[k] == 6)
+      first_page_end = pos;
+  }
+  main_xref = pos;
+
+  /* Hint stream */
+  memset(&bits, 0, sizeof(bits));
+  lin_hint_tables(&bits, &shared_offset, parts, &pages, page_objs);
+  memset(&hint, 0, sizeof(hint));
+  capture = &hint;
+  j = sprintf(format_buffer, "%lu 0 obj\n<</S %ld/Length %ld>>\nstream\n",
+              hint_label, shared_offset, bits.length);
+  pdf_out(pdf_output_file, format_buffer, j);
+  pdf_out(pdf_output_file, bits.data, bits.length);
+  pdf_out(pdf_output_file, "\nendstream\nendobj\n", 18);
+  capture = NULL;
+  if (bits.data)
+    RELEASE(bits.data);
+
+  first_page_end += hint.length;
+  main_xref      += hint.length;
+  main_entries    = main_xref + sprintf(format_buffer, "xref\n0 %lu", main_size);
+  file_length     = main_entries + 1 + 20 * main_size;
+  file_length    += sprintf(format_buffer, "trailer\n<</Size %lu>>\nstartxref\n%ld\n%%%%EOF\n",
+                            main_size, header_length + dict_length);
+
+  /* Header, linearization dictionary and first-page xref */
+  pdf_out(pdf_output_file, format_buffer,
+          sprintf(format_buffer, "%%PDF-1.%u\n%s", pdf_version, BINARY_MARKER));
+  pdf_out(pdf_output_file, format_buffer,
+          sprintf(format_buffer,
+                  "%lu 0 obj\n<</Linearized 1/L %10" PRId64 "/H [%10" PRId64
+                  " %10ld]/O %lu/E %10" PRId64 "/N %ld/T %10" PRId64 ">>\nendobj\n",
+                  first_label, (int64_t) file_length, (int64_t) hint_offset,
+                  (long) hint.length, lin_objs[pages.labels[0]].new_label,
+                  (int64_t) first_page_end, pages.count, (int64_t) main_entries));
+  pdf_out(pdf_output_file, format_buffer,
+          sprintf(format_buffer, "xref\n%lu %lu\n", first_label, first_count));
+  lin_out_xref_entry(header_length);
+  for (j = 0; j < parts[4].count; j++)
+    lin_out_xref_entry(lin_objs[parts[4].labels[j]].offset);
+  lin_out_xref_entry(hint_offset);
+  for (j = 0; j < parts[6].count; j++)
+    lin_out_xref_entry(lin_objs[parts[6].labels[j]].offset + hint.length);
+  pdf_out(pdf_output_file, format_buffer,
+          sprintf(format_buffer, "trailer\n<</Size %lu/Root %lu 0 R",
+                  size, lin_objs[root_label].new_label));
+  if (info_label && lin_objs[info_label].new_label)
+    pdf_out(pdf_output_file, format_buffer,
+            sprintf(format_buffer, "/Info %lu 0 R", lin_objs[info_label].new_label));
+  if (id) {
+    pdf_out(pdf_output_file, "/ID", 3);
+    pdf_out(pdf_output_file, id_buf.bytes, id_buf.length);
+  }
+  pdf_out(pdf_output_file, format_buffer,
+          sprintf(format_buffer, "/Prev %10" PRId64 ">>\nstartxref\n0\n%%%%EOF\n",
+                  (int64_t) main_xref));
+
+  /* The objects */
+  for (k = 0; k < 5; k++) {
+    for (j = 0; j < parts[order[k]].count; j++) {
+      struct lin_obj *lo = &lin_objs[parts[order[k]].labels[j]];
+
+      pdf_out(pdf_output_file, lo->bytes, lo->length);
+      RELEASE(lo->bytes);
+      lo->bytes = NULL;
+    }
+    if (order[k] == 4)
+      pdf_out(pdf_output_file, hint.bytes, hint.length);
+  }
+
+  /* Main xref */
+  pdf_out(pdf_output_file, format_buffer,
+          sprintf(format_buffer, "xref\n0 %lu\n", main_size));
+  pdf_out(pdf_output_file, "0000000000 65535 f \n", 20);
+  for (k = 2; k < 5; k++) {
+    for (j = 0; j < parts[order[k]].count; j++)
+      lin_out_xref_entry(lin_objs[parts[order[k]].labels[j]].offset + hint.length);
+  }
+  pdf_out(pdf_output_file, format_buffer,
+          sprintf(format_buffer, "trailer\n<</Size %lu>>\nstartxref\n%ld\n%%%%EOF\n",
+                  main_size, header_length + dict_length));
+  ASSERT(pdf_output_file_position == file_length);
+
+  if (hint.bytes)
+    RELEASE(hint.bytes);
+  if (id_buf.bytes)
+    RELEASE(id_buf.bytes);
+  for (j = 0; j < pages.count; j++)
+    lin_list_free(&page_objs[j]);
+  RELEASE(page_objs);
+  for (k = 0; k < LIN_PARTS; k++)
+    lin_list_free(&parts[k]);
+
+ done:
+  for (i = 0; i < lin_num_objs; i++) {
+    if (lin_objs[i].object)
+      texpdf_release_obj(lin_objs[i].object);
+  }
+  RELEASE(lin_objs);
+  lin_objs       = NULL;
+  lin_num_objs   = 0;
+  linearize_file = NULL;
+  lin_list_free(&pages);
+  lin_list_free(&rest);
+  pdf_file_free(pf);
+  fclose(tmp);
 }
 
 void
 texpdf_files_close (void)
 {
   ASSERT(pdf_files);
+  prefetch_shutdown();
   texpdf_ht_clear_table(pdf_files);
   RELEASE(pdf_files);
 }
@@ -3392,7 +6976,8 @@ pdf_import_object (pdf_obj *object)
 
   case PDF_STREAM:
     {
-      pdf_obj *stream_dict;
+      pdf_obj    *stream_dict;
+      pdf_stream *src, *dst;
 
       tmp = pdf_import_object(texpdf_stream_dict(object));
       if (!tmp)
@@ -3402,9 +6987,19 @@ pdf_import_object (pdf_obj *object)
       stream_dict = texpdf_stream_dict(imported);
       texpdf_merge_dict(stream_dict, tmp);
       texpdf_release_obj(tmp);
-      texpdf_add_stream(imported,
-		     pdf_stream_dataptr(object),
-		     pdf_stream_length(object));
+      src = object->data;
+      dst = imported->data;
+      if (src->map) {
+        /* Share the mapped data rather than copying it */
+        src->map->refcount++;
+        dst->map           = src->map;
+        dst->stream        = src->stream;
+        dst->stream_length = src->stream_length;
+        dst->max_length    = src->stream_length;
+      } else
+        texpdf_add_stream(imported,
+		       pdf_stream_dataptr(object),
+		       pdf_stream_length(object));
     }
     break;
 
@@ -24,6 +24,7 @@
 #define _PDFOBJ_H_
 
 #include <stdio.h>
+#include "mem.h"
 
 /* Here is the complete list of PDF object types */
 
@@ -42,6 +43,13 @@
 
 #define STREAM_COMPRESS (1 << 0)
 
+/* Stream classes; each class may have its own compression level. */
+#define STREAM_CLASS_DEFAULT 0
+#define STREAM_CLASS_CONTENT 1 /* page and form content streams */
+#define STREAM_CLASS_FONT    2 /* embedded font programs */
+#define STREAM_CLASS_IMAGE   3 /* image samples */
+#define STREAM_CLASS_MAX     4
+
 /* A deeper object hierarchy will be considered as (illegal) loop. */
 #define PDF_OBJ_MAX_DEPTH  30
 
@@ -60,6 +68,7 @@ extern void     texpdf_set_version   (unsigned version);
 extern unsigned texpdf_get_version   (void);
 
 extern void     texpdf_release_obj (pdf_obj *object);
+extern void     texpdf_obj_set_arena (mem_arena *arena);
 extern int      texpdf_obj_typeof  (pdf_obj *object);
 
 #define PDF_OBJ_NUMBERTYPE(o)   ((o) && texpdf_obj_typeof((o)) == PDF_NUMBER)
@@ -144,15 +153,22 @@ extern int      texpdf_foreach_dict (pdf_obj *dict,
 				  void *pdata);
 
 extern pdf_obj    *texpdf_new_stream        (int flags);
+extern void        texpdf_stream_set_class  (pdf_obj *stream, int stream_class);
 extern void        texpdf_add_stream        (pdf_obj *stream,
 					  const void *stream_data_ptr,
 					  long stream_data_len);
+extern void        pdf_add_stream_mapped (pdf_obj *stream, pdf_file *pf,
+					  const void *stream_data_ptr,
+					  long stream_data_len);
 #if HAVE_ZLIB
 extern int         texpdf_add_stream_flate  (pdf_obj *stream,
 					  const void *stream_data_ptr,
 					  long stream_data_len);
 #endif
 extern int         pdf_concat_stream     (pdf_obj *dst, pdf_obj *src);
+#if HAVE_ZLIB
+extern int         pdf_join_flate_streams (pdf_obj *dst, pdf_obj **srcs, int n);
+#endif
 extern pdf_obj    *texpdf_stream_dict       (pdf_obj *stream);
 extern long        pdf_stream_length     (pdf_obj *stream);
 #if 0
@@ -173,6 +189,26 @@ extern int         pdf_compare_reference (pdf_obj *ref1, pdf_obj *ref2);
  */
 
 extern void      texpdf_set_compression (int level);
+extern void      texpdf_set_compression_threads (int num_threads, long max_queued);
+/* Level for streams of the given class, or -1 to follow texpdf_set_compression(). */
+extern void      texpdf_set_compression_class   (int stream_class, int level);
+
+/* A compression backend returns a malloc()ed buffer holding data as a
+ * zlib (FlateDecode) stream, or NULL on failure. It may be called from
+ * several threads at once and must not call ERROR().
+ */
+typedef unsigned char *(*texpdf_compress_func) (const unsigned char *data,
+                                                 unsigned long length, int level,
+                                                 unsigned long *compressed_length);
+extern int       texpdf_add_compression_backend (const char *name,
+                                                 texpdf_compress_func compress);
+extern int       texpdf_set_compression_backend (const char *name);
+/* Write identical streams and shared resources (fonts, ExtGState, color spaces) only once (not with encryption). */
+extern void      texpdf_set_object_dedup (int enabled);
+/* Write linearized ("Fast Web View") files (not with encryption). They
+ * are written to a temporary file first and rewritten from there, which
+ * takes about twice the time and I/O of normal output. */
+extern void      texpdf_set_linearize    (int enabled);
 
 extern void      texpdf_set_info     (pdf_obj *obj);
 extern void      texpdf_set_root     (pdf_obj *obj);
@@ -183,15 +219,56 @@ extern void      texpdf_files_init    (void);
 extern void      texpdf_files_close   (void);
 extern int      texpdf_check_for_pdf     (FILE *file);
 extern pdf_file *texpdf_open          (const char *ident, FILE *file);
+/* Read FILENAME in the background because it is about to be opened. */
+extern void      texpdf_prefetch_file (const char *filename);
+/* Read xref entries of files opened later only when needed (mapped files only). */
+extern void      texpdf_set_lazy_xref (int enabled);
 extern void      texpdf_close         (pdf_file *pf);
 extern pdf_obj  *pdf_file_get_trailer (pdf_file *pf);
 extern int       texpdf_file_get_version (pdf_file *pf);
 extern pdf_obj  *pdf_file_get_catalog (pdf_file *pf);
 
+/* Leaf page of an input file, with inherited attributes resolved */
+typedef struct
+{
+  pdf_obj *ref;        /* the page object */
+  pdf_obj *resources;  /* NULL if absent */
+  pdf_obj *media_box;
+  pdf_obj *crop_box;
+  pdf_obj *rotate;
+} pdf_file_page;
+
+/* Number of leaf pages, or -1 if the page tree is unusable. */
+extern long      pdf_file_get_page_count (pdf_file *pf);
+/* Page PAGE_IDX (counted from 0), owned by PF; NULL if it is missing
+ * or its page tree node could not be read. */
+extern const pdf_file_page *pdf_file_get_page (pdf_file *pf, long page_idx);
+
+/* Cache of objects read from input files */
+typedef struct
+{
+  unsigned long hits;
+  unsigned long misses;
+  unsigned long evictions;
+  long          bytes;      /* (estimated) size of the cached objects */
+  long          peak_bytes;
+} pdf_cache_stats;
+
+/* Budgets in bytes for all files together and for each file; 0 means unlimited. */
+extern void      texpdf_set_object_cache_budget (long total, long per_file);
+/* Statistics for PF, or for all files if PF is NULL. */
+extern void      texpdf_get_object_cache_stats  (pdf_file *pf, pdf_cache_stats *stats);
+
+/* Incremental update of an existing file, used instead of pdf_out_init()/pdf_out_flush() */
+extern pdf_file *texpdf_update_begin  (const char *filename);
+extern void      texpdf_update_obj    (pdf_obj *ref, pdf_obj *object);
+extern void      texpdf_update_end    (void);
+
 extern pdf_obj *pdf_deref_obj     (pdf_obj *object);
 extern pdf_obj *pdf_import_object (pdf_obj *object);
 
 extern int      pdfobj_escape_str (char *buffer, int size, const unsigned char *s, int len);
+extern int      pdfobj_hex_str    (char *buffer, int size, const unsigned char *s, int len);
 
 extern pdf_obj *texpdf_new_indirect  (pdf_file *pf, unsigned long label, unsigned short generation);
 
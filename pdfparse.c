@@ -35,15 +35,48 @@
 #undef  is_delim
 #endif
 
-#define is_space(c) ((c) == ' '  || (c) == '\t' || (c) == '\f' || \
-		     (c) == '\r' || (c) == '\n' || (c) == '\0')
-#define is_delim(c) ((c) == '(' || (c) == '/' || \
-                     (c) == '<' || (c) == '>' || \
-		     (c) == '[' || (c) == ']' || \
-                     (c) == '%')
+/*
+ * Character classes. CC_IDENT and CC_VIDENT are the characters
+ * accepted by texpdf_parse_ident() and texpdf_parse_val_ident().
+ */
+#define CC_SPACE  (1 << 0)
+#define CC_DELIM  (1 << 1)
+#define CC_IDENT  (1 << 2)
+#define CC_VIDENT (1 << 3)
+#define S CC_SPACE
+#define D CC_DELIM
+#define I CC_IDENT
+#define V CC_VIDENT
+static const unsigned char char_class[256] = {
+  S, 0, 0, 0, 0, 0, 0, 0, 0, S, S, 0, S, S, 0, 0,
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+  S, I|V, I|V, I|V, I|V, D, I|V, I|V, D, 0, I|V, I|V, I|V, I|V, I|V, D|V,
+  I|V, I|V, I|V, I|V, I|V, I|V, I|V, I|V, I|V, I|V, I|V, I|V, D, I, D, I|V,
+  I|V, I|V, I|V, I|V, I|V, I|V, I|V, I|V, I|V, I|V, I|V, I|V, I|V, I|V, I|V, I|V,
+  I|V, I|V, I|V, I|V, I|V, I|V, I|V, I|V, I|V, I|V, I|V, D, I|V, D, I|V, I|V,
+  I|V, I|V, I|V, I|V, I|V, I|V, I|V, I|V, I|V, I|V, I|V, I|V, I|V, I|V, I|V, I|V,
+  I|V, I|V, I|V, I|V, I|V, I|V, I|V, I|V, I|V, I|V, I|V, 0, I|V, 0, I|V, 0
+  /* 0x80-0xff: 0 */
+};
+#undef S
+#undef D
+#undef I
+#undef V
+
+#define char_is(c,m) (char_class[(unsigned char) (c)] & (m))
+
+#define is_space(c) char_is((c), CC_SPACE)
+#define is_delim(c) char_is((c), CC_DELIM)
 #define PDF_TOKEN_END(p,e) ((p) >= (e) || is_space(*(p)) || is_delim(*(p)))
 
-#define istokensep(c) (is_space((c)) || is_delim((c)))
+#define istokensep(c) char_is((c), CC_SPACE|CC_DELIM)
+
+/* Exact powers of ten for converting decimal fractions */
+static const double ten_pow[] = {
+  1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+  1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+#define TEN_POW_MAX 22
 
 static struct {
   int tainted;
@@ -100,12 +133,17 @@ texpdf_skip_white (const char **start, const char *end)
    * (VT; 0x0B) character is not a white-space character in PDF spec but
    * isspace(0x0B) returns TRUE.
    */
-  while (*start < end && (is_space(**start) || **start == '%')) {
-    if (**start == '%')
-      skip_line(start, end);
+  const char *p = *start;
+
+  while (p < end) {
+    if (is_space(*p))
+      p++;
+    else if (*p == '%')
+      skip_line(&p, end);
     else
-      (*start)++;
+      break;
   }
+  *start = p;
 }
 
 
@@ -125,14 +163,15 @@ parsed_string (const char *start, const char *end)
   return result;
 }
 
-char *
-texpdf_parse_number (const char **start, const char *end)
-{
-  char *number;
-  const char *p;
+/*
+ * The texpdf_scan_xxx() functions work on the input in place; the
+ * texpdf_parse_xxx() ones below return a copy of the token instead.
+ */
 
-  texpdf_skip_white(start, end);
-  p = *start;
+/* End of the number (optional sign, digits and fraction) at P */
+static const char *
+number_end (const char *p, const char *end)
+{
   if (p < end && (*p == '+' || *p == '-'))
     p++;
   while (p < end && isdigit((unsigned char)*p))
@@ -142,6 +181,97 @@ texpdf_parse_number (const char **start, const char *end)
     while (p < end && isdigit((unsigned char)*p))
       p++;
   }
+
+  return p;
+}
+
+/* Value of the number in [P, END), which has been checked by number_end() */
+static double
+number_value (const char *p, const char *end)
+{
+  double v = 0.0;
+  int    sign = 1, nddigits = -1;
+
+  if (*p == '+' || *p == '-')
+    sign = (*p++ == '-') ? -1 : 1;
+  for (; p < end; p++) {
+    if (*p == '.')
+      nddigits = 0;
+    else {
+      v = v * 10.0 + (*p - '0');
+      if (nddigits >= 0)
+        nddigits++;
+    }
+  }
+  if (nddigits > TEN_POW_MAX)
+    v /= pow(10, nddigits);
+  else if (nddigits > 0)
+    v /= ten_pow[nddigits];
+
+  return sign * v;
+}
+
+int
+texpdf_scan_number (const char **start, const char *end, double *value)
+{
+  const char *p;
+
+  texpdf_skip_white(start, end);
+  p = number_end(*start, end);
+  if (p == *start)
+    return 0;
+  *value = number_value(*start, p);
+  *start = p;
+
+  return 1;
+}
+
+int
+texpdf_scan_unsigned (const char **start, const char *end, unsigned long *value)
+{
+  const char   *p;
+  unsigned long v = 0;
+
+  texpdf_skip_white(start, end);
+  for (p = *start; p < end && isdigit((unsigned char)*p); p++)
+    v = v * 10 + (*p - '0');
+  if (p == *start)
+    return 0;
+  *value = v;
+  *start = p;
+
+  return 1;
+}
+
+static int
+scan_gen_ident (const char **start, const char *end, const char **ident, int cls)
+{
+  const char *p;
+  int         length;
+
+  /* No texpdf_skip_white(start, end)? */
+  for (p = *start; p < end && char_is(*p, cls); p++);
+  *ident = *start;
+  length = p - *start;
+  *start = p;
+
+  return length;
+}
+
+int
+texpdf_scan_ident (const char **start, const char *end, const char **ident)
+{
+  return scan_gen_ident(start, end, ident, CC_IDENT);
+}
+
+char *
+texpdf_parse_number (const char **start, const char *end)
+{
+  char *number;
+  const char *p;
+
+  texpdf_skip_white(start, end);
+  p = number_end(*start, end);
   number = parsed_string(*start, p);
 
   *start = p;
@@ -166,38 +296,26 @@ texpdf_parse_unsigned (const char **start, const char *end)
 }
 
 static char *
-texpdf_parse_gen_ident (const char **start, const char *end, const char *valid_chars)
+texpdf_parse_gen_ident (const char **start, const char *end, int cls)
 {
-  char *ident;
-  const char *p;
+  const char *ident;
+  int         length;
 
-  /* No texpdf_skip_white(start, end)? */
-  for (p = *start; p < end; p++) {
-    if (!strchr(valid_chars, *p))
-      break;
-  }
-  ident = parsed_string(*start, p);
+  length = scan_gen_ident(start, end, &ident, cls);
 
-  *start = p;
-  return ident;
+  return parsed_string(ident, ident + length);
 }
 
 char *
 texpdf_parse_ident (const char **start, const char *end)
 {
-  static const char *valid_chars =
-    "!\"#$&'*+,-.0123456789:;=?@ABCDEFGHIJKLMNOPQRSTUVWXYZ\\^_`abcdefghijklmnopqrstuvwxyz|~";
-
-  return texpdf_parse_gen_ident(start, end, valid_chars);
+  return texpdf_parse_gen_ident(start, end, CC_IDENT);
 }
 
 char *
 texpdf_parse_val_ident (const char **start, const char *end)
 {
-  static const char *valid_chars =
-    "!\"#$&'*+,-./0123456789:;?@ABCDEFGHIJKLMNOPQRSTUVWXYZ\\^_`abcdefghijklmnopqrstuvwxyz|~";
-
-  return texpdf_parse_gen_ident(start, end, valid_chars);
+  return texpdf_parse_gen_ident(start, end, CC_VIDENT);
 }
 
 char *
@@ -253,18 +371,19 @@ texpdf_parse_pdf_number (const char **pp, const char *endptr)
         has_dot = 1;
       }
     } else if (isdigit((unsigned char)p[0])) {
-      if (has_dot) {
-        v += (p[0] - '0') / pow(10, nddigits + 1);
+      v = v * 10.0 + p[0] - '0';
+      if (has_dot)
         nddigits++;
-      } else {
-        v = v * 10.0 + p[0] - '0';
-      }
     } else {
       WARN("Could not find a numeric object.");
       return NULL;
     }
     p++;
   }
+  if (nddigits > TEN_POW_MAX)
+    v /= pow(10, nddigits);
+  else if (nddigits > 0)
+    v /= ten_pow[nddigits];
 
   *pp = p;
   return texpdf_new_number(sign * v);
@@ -327,6 +446,20 @@ texpdf_parse_pdf_name (const char **pp, const char *endptr)
   }
 
   (*pp)++;
+  /* Most names have no escapes and can be copied as they are */
+  {
+    const char *p = *pp, *ident;
+
+    len = texpdf_scan_ident(&p, endptr, &ident);
+    if (len > 0 && len <= PDF_NAME_LEN_MAX && PDF_TOKEN_END(p, endptr) &&
+        !memchr(ident, '#', len)) {
+      memcpy(name, ident, len);
+      name[len] = '\0';
+      *pp = p;
+      return texpdf_new_name(name);
+    }
+    len = 0;
+  }
   while (*pp < endptr && !istokensep(**pp)) {
     ch = pn_getc(pp, endptr);
     if (ch < 0 || ch > 0xff) {
@@ -570,6 +703,12 @@ texpdf_parse_pdf_hex_string (const char **pp, const char *endptr)
   while (p < endptr && p[0] != '>' && len < PDF_STRING_LEN_MAX) {
     int  ch;
 
+    if (p + 1 < endptr &&
+        isxdigit((unsigned char)p[0]) && isxdigit((unsigned char)p[1])) {
+      sbuf[len++] = (xtoi(p[0]) << 4) + xtoi(p[1]);
+      p += 2;
+      continue;
+    }
     texpdf_skip_white(&p, endptr);
     if (p >= endptr || p[0] == '>')
       break;
@@ -736,7 +875,8 @@ texpdf_parse_pdf_array (const char **pp, const char *endptr, pdf_file *pf)
 }
 
 static pdf_obj *
-texpdf_parse_pdf_stream (const char **pp, const char *endptr, pdf_obj *dict)
+texpdf_parse_pdf_stream (const char **pp, const char *endptr, pdf_obj *dict,
+                         pdf_file *pf)
 {
   pdf_obj *result = NULL;
   const char *p;
@@ -808,7 +948,7 @@ texpdf_parse_pdf_stream (const char **pp, const char *endptr, pdf_obj *dict)
   stream_dict = texpdf_stream_dict(result);
   texpdf_merge_dict(stream_dict, dict);
 
-  texpdf_add_stream(result, p, stream_length);
+  pdf_add_stream_mapped(result, pf, p, stream_length);
   p += stream_length;
 
   /* Check "endsteam" */
@@ -850,8 +990,8 @@ try_pdf_reference (const char *start, const char *end, const char **endptr, pdf_
   if (start > end - 5 || !isdigit((unsigned char)*start)) {
     return NULL;
   }
-  while (!is_space(*start)) {
-    if (start >= end || !isdigit((unsigned char)*start)) {
+  while (start < end && !is_space(*start)) {
+    if (!isdigit((unsigned char)*start)) {
       return NULL;
     }
     id = id * 10 + (*start - '0');
@@ -861,8 +1001,8 @@ try_pdf_reference (const char *start, const char *end, const char **endptr, pdf_
   texpdf_skip_white(&start, end);
   if (start >= end || !isdigit((unsigned char)*start))
     return NULL;
-  while (!is_space(*start)) {
-    if (start >= end || !isdigit((unsigned char)*start))
+  while (start < end && !is_space(*start)) {
+    if (!isdigit((unsigned char)*start))
       return NULL;
     gen = gen * 10 + (*start - '0');
     start++;
@@ -909,7 +1049,7 @@ texpdf_parse_pdf_object (const char **pp, const char *endptr, pdf_file *pf)
           *pp <= endptr - 15 &&
           !memcmp(*pp, "stream", 6)) {
         dict   = result;
-        result = texpdf_parse_pdf_stream(pp, endptr, dict);
+        result = texpdf_parse_pdf_stream(pp, endptr, dict, pf);
         texpdf_release_obj(dict);
       }
     }
@@ -958,3 +1098,190 @@ texpdf_parse_pdf_object (const char **pp, const char *endptr, pdf_file *pf)
   return result;
 }
 
+
+/*
+ * Content streams: texpdf_scan_content() splits [START, END) into
+ * operators and calls OP for each, with the operands in front of it.
+ * Operands are not turned into objects; numbers come with their value,
+ * everything else only with its position in the input. Inline images
+ * are reported as BI, then ID with the image dictionary entries as
+ * operands, then EI; the image data in between is skipped.
+ */
+
+/* End of the literal string at P, or NULL */
+static const char *
+skip_content_string (const char *p, const char *end)
+{
+  int depth = 0;
+
+  for (; p < end; p++) {
+    if (*p == '\\')
+      p++;
+    else if (*p == '(')
+      depth++;
+    else if (*p == ')' && --depth == 0)
+      return p + 1;
+  }
+
+  return NULL;
+}
+
+/* End of the hex string at P, or NULL */
+static const char *
+skip_content_hex (const char *p, const char *end)
+{
+  p = memchr(p, '>', end - p);
+
+  return p ? p + 1 : NULL;
+}
+
+/* End of the array or dictionary at P, including nested ones, or NULL */
+static const char *
+skip_content_composite (const char *p, const char *end)
+{
+  int depth = 0;
+
+  while (p < end) {
+    switch (*p) {
+    case '[':
+      depth++;
+      p++;
+      break;
+    case ']':
+      depth--;
+      p++;
+      break;
+    case '<':
+      if (p + 1 < end && p[1] == '<') {
+        depth++;
+        p += 2;
+      } else if (!(p = skip_content_hex(p, end)))
+        return NULL;
+      break;
+    case '>':
+      if (p + 1 >= end || p[1] != '>')
+        return NULL;
+      depth--;
+      p += 2;
+      break;
+    case '(':
+      if (!(p = skip_content_string(p, end)))
+        return NULL;
+      break;
+    case '%':
+      skip_line(&p, end);
+      break;
+    default:
+      p++;
+    }
+    if (depth == 0)
+      return p;
+  }
+
+  return NULL;
+}
+
+/* Start of the EI operator ending the inline image data at P, or NULL */
+static const char *
+skip_inline_image (const char *p, const char *end)
+{
+  for (; p + 1 < end; p++) {
+    if (p[0] == 'E' && p[1] == 'I' &&
+        (p == end - 2 || istokensep(p[2])) && is_space(p[-1]))
+      return p;
+  }
+
+  return NULL;
+}
+
+int
+texpdf_scan_content (const char *start, const char *end,
+                     pdf_content_op op, void *data)
+{
+  pdf_content_operand operands[PDF_CONTENT_OPERANDS_MAX];
+  int         num_operands = 0;
+  const char *p = start;
+
+  for (;;) {
+    const char *q = NULL, *ident;
+    double      value = 0.0;
+    int         type = PDF_UNDEFINED;
+
+    texpdf_skip_white(&p, end);
+    if (p >= end)
+      break;
+
+    switch (*p) {
+    case '/':
+      q = p + 1;
+      texpdf_scan_ident(&q, end, &ident);
+      type = PDF_NAME;
+      break;
+    case '(':
+      q = skip_content_string(p, end);
+      type = PDF_STRING;
+      break;
+    case '<':
+      if (p + 1 < end && p[1] == '<') {
+        q = skip_content_composite(p, end);
+        type = PDF_DICT;
+      } else {
+        q = skip_content_hex(p, end);
+        type = PDF_STRING;
+      }
+      break;
+    case '[':
+      q = skip_content_composite(p, end);
+      type = PDF_ARRAY;
+      break;
+    case '+': case '-': case '.':
+    case '0': case '1': case '2': case '3': case '4':
+    case '5': case '6': case '7': case '8': case '9':
+      q = number_end(p, end);
+      if (PDF_TOKEN_END(q, end) &&
+          (isdigit((unsigned char) q[-1]) ||
+           (q - p > 1 && isdigit((unsigned char) q[-2])))) {
+        value = number_value(p, q);
+        type  = PDF_NUMBER;
+      }
+      break;
+    }
+
+    if (type == PDF_UNDEFINED) {
+      int length;
+
+      q = p;
+      length = texpdf_scan_ident(&q, end, &ident);
+      if (length == 0)
+        return -1;  /* stray delimiter */
+      if ((length == 4 && !memcmp(p, "true", 4)) ||
+          (length == 5 && !memcmp(p, "false", 5)))
+        type = PDF_BOOLEAN;
+      else if (length == 4 && !memcmp(p, "null", 4))
+        type = PDF_NULL;
+      else {
+        int error = op(data, p, length, operands, num_operands);
+
+        if (error < 0)
+          return error;
+        num_operands = 0;
+        p = q;
+        if (length == 2 && !memcmp(p - 2, "ID", 2) &&
+            !(p = skip_inline_image(p, end)))
+          return -1;
+        continue;
+      }
+    }
+
+    if (!q || num_operands == PDF_CONTENT_OPERANDS_MAX)
+      return -1;
+    operands[num_operands].type   = type;
+    operands[num_operands].value  = value;
+    operands[num_operands].start  = p;
+    operands[num_operands].length = q - p;
+    num_operands++;
+    p = q;
+  }
+
+  return 0;
+}
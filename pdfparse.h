@@ -32,6 +32,11 @@ extern void texpdf_dump (const char *start, const char *end);
 extern void skip_line  (const char **start, const char *end);
 extern void texpdf_skip_white (const char **start, const char *end);
 
+/* Tokens scanned in place; these return 0 if there is none. */
+extern int   texpdf_scan_number   (const char **start, const char *end, double *value);
+extern int   texpdf_scan_unsigned (const char **start, const char *end, unsigned long *value);
+extern int   texpdf_scan_ident    (const char **start, const char *end, const char **ident);
+
 extern char *texpdf_parse_number   (const char **start, const char *end);
 extern char *texpdf_parse_unsigned (const char **start, const char *end);
 
@@ -50,4 +55,23 @@ extern pdf_obj *texpdf_parse_pdf_object  (const char **pp, const char *endptr, p
 
 extern pdf_obj *texpdf_parse_texpdf_tainted_dict (const char **pp, const char *endptr);
 
+/* Operand of a content stream operator, see texpdf_scan_content() */
+typedef struct
+{
+  int         type;    /* PDF_NUMBER, PDF_NAME, PDF_STRING, PDF_ARRAY, ... */
+  double      value;   /* for PDF_NUMBER */
+  const char *start;   /* the operand in the input */
+  int         length;
+} pdf_content_operand;
+
+#define PDF_CONTENT_OPERANDS_MAX 64
+
+/* Called for each operator; a negative return value stops the scan. */
+typedef int (*pdf_content_op) (void *data, const char *op, int length,
+                               pdf_content_operand *operands, int num_operands);
+
+/* Returns 0, -1 on syntax errors, or what OP returned to stop the scan. */
+extern int texpdf_scan_content (const char *start, const char *end,
+                                pdf_content_op op, void *data);
+
 #endif /* _PDFPARSE_H_ */
@@ -1,6 +1,7 @@
 #ifndef _PDFTYPES_H_
 #define _PDFTYPES_H_
 #include "dpxutil.h"
+#include "mem.h"
 typedef signed long spt_t;
 
 typedef struct pdf_tmatrix
@@ -71,6 +72,8 @@ typedef struct pdf_page
 
   pdf_obj  *annots;
   pdf_obj  *beads;
+
+  pdf_obj  *parent_ref; /* of the page it replaces when updating */
 } pdf_page;
 
 typedef struct pdf_olitem
@@ -150,6 +153,13 @@ typedef struct pdf_doc
   char  manual_thumb_enabled;
   char* doccreator;
   pdf_color bgcolor;
+
+  mem_arena *arena; /* Region for page-local objects */
+
+  struct {
+    struct pdf_file *file;    /* see texpdf_open_document_update() */
+    long             page_no; /* page the next page replaces */
+  } update;
 } pdf_doc;
 
 #endif
@@ -401,6 +401,7 @@ create_pk_CharProc_stream (struct pk_header_ *pkh,
   ury =  pkh->bm_voff;
 
   stream = texpdf_new_stream(STREAM_COMPRESS);
+  texpdf_stream_set_class(stream, STREAM_CLASS_FONT);
   /*
    * The following line is a "metric" for the PDF reader:
    *
@@ -232,6 +232,7 @@ png_include_image (pdf_ximage *ximage, FILE *png_file)
   }
 
   stream      = texpdf_new_stream (STREAM_COMPRESS);
+  texpdf_stream_set_class(stream, STREAM_CLASS_IMAGE);
   stream_dict = texpdf_stream_dict(stream);
 
   stream_data_ptr = (png_bytep) NEW(rowbytes*height, png_byte);
@@ -962,6 +963,7 @@ create_soft_mask (png_structp png_ptr, png_infop info_ptr,
   }
 
   smask = texpdf_new_stream(STREAM_COMPRESS);
+  texpdf_stream_set_class(smask, STREAM_CLASS_IMAGE);
   dict  = texpdf_stream_dict(smask);
   smask_data_ptr = (png_bytep) NEW(width*height, png_byte);
   texpdf_add_dict(dict, texpdf_new_name("Type"),    texpdf_new_name("XObject"));
@@ -1007,6 +1009,7 @@ strip_soft_mask (png_structp png_ptr, png_infop info_ptr,
   }
 
   smask = texpdf_new_stream(STREAM_COMPRESS);
+  texpdf_stream_set_class(smask, STREAM_CLASS_IMAGE);
   dict  = texpdf_stream_dict(smask);
   texpdf_add_dict(dict, texpdf_new_name("Type"),    texpdf_new_name("XObject"));
   texpdf_add_dict(dict, texpdf_new_name("Subtype"), texpdf_new_name("Image"));
@@ -433,6 +433,7 @@ sfnt_create_FontFile_stream (sfnt *sfont)
   ASSERT(sfont && sfont->directory);
 
   stream = texpdf_new_stream(STREAM_COMPRESS);
+  texpdf_stream_set_class(stream, STREAM_CLASS_FONT);
 
   td  = sfont->directory;
 
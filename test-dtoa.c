@@ -0,0 +1,226 @@
+/* Equivalence test and benchmark for the number formatter.
+
+Compares pdf_sprint_length() and pdf_sprint_number(), which both go
+through p_dtoa() in pdfdev.c, with the sprintf()-based p_dtoa() they
+replaced, at every precision the device supports (0 to 8):
+
+ - every 16.16 fixed-point value in [-64, 64), exhaustively;
+ - every rounding boundary k / 10^prec and the doubles next to it;
+ - the integer-part edges around 2^31 and 2^53, and infinities;
+ - a million pseudo-random doubles over all magnitudes.
+
+./test-dtoa           run the test
+./test-dtoa full      also every 16.16 value of the whole 32-bit range
+                      at precision 2 (slow)
+./test-dtoa bench     time both formatters on content-stream numbers
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include "libtexpdf.h"
+
+/* p_dtoa() as it was before digits were generated without sprintf() */
+static int
+old_dtoa (double value, int prec, char *buf)
+{
+  const long p[10] = { 1, 10, 100, 1000, 10000,
+		                   100000, 1000000, 10000000,
+                       100000000, 1000000000 };
+  double i, f;
+  long   g;
+  char  *c = buf;
+  int    n;
+
+  if (value < 0) {
+    value = -value;
+    *c++ = '-';
+    n = 1;
+  } else {
+    n = 0;
+  }
+
+  f = modf(value, &i);
+  g = (long) (f * p[prec] + 0.5);
+
+  if (g == p[prec]) {
+    g  = 0;
+    i += 1;
+  }
+
+  if (i) {
+    int m = sprintf(c, "%.0f", i);
+    c += m;
+    n += m;
+  } else if (g == 0) {
+    *(c = buf) = '0';
+    n = 1;
+  }
+
+  if (g) {
+    int j = prec;
+
+    *c++ = '.';
+
+    while (j--) {
+      c[j] = (g % 10) + '0';
+      g /= 10;
+    }
+    c += prec - 1;
+    n += 1 + prec;
+
+    while (*c == '0') {
+      c--;
+      n--;
+    }
+  }
+
+  *(++c) = 0;
+
+  return n;
+}
+
+static int  precision;
+static long num_checked, num_failed;
+
+static void
+set_precision (int prec)
+{
+  texpdf_init_device(NULL, 1.0, prec, 0);
+  texpdf_close_device();
+  precision = prec;
+}
+
+static void
+check (double value)
+{
+  char want[512], got[512];
+  int  want_len, got_len;
+
+  want_len = old_dtoa(value, precision, want);
+  if (precision == 8)
+    got_len = pdf_sprint_number(got, value);
+  else
+    got_len = pdf_sprint_length(got, value);
+  num_checked++;
+  if (want_len != got_len || strcmp(want, got)) {
+    if (num_failed++ < 20)
+      fprintf(stderr, "prec %d, %.17g: \"%s\" instead of \"%s\"\n",
+              precision, value, got, want);
+  }
+}
+
+/* Small xorshift generator, so that runs are reproducible */
+static unsigned long long rnd_state = 88172645463325252ULL;
+
+static unsigned long long
+rnd (void)
+{
+  rnd_state ^= rnd_state << 13;
+  rnd_state ^= rnd_state >> 7;
+  rnd_state ^= rnd_state << 17;
+  return rnd_state;
+}
+
+static void
+run_test (int full)
+{
+  static const double edges[] = {
+    0.0, -0.0, 0.5, -0.5, 1.0, 2147483647.0, 2147483647.5, 2147483648.0,
+    -2147483648.0, 4294967296.0, 9007199254740992.0, 1e15, 1e20, 1e300, -1e300
+  };
+  long   k, n;
+  int    prec, i;
+
+  for (prec = 0; prec <= 8; prec++) {
+    double scale = pow(10.0, prec);
+
+    set_precision(prec);
+    for (k = -64 * 65536L; k < 64 * 65536L; k++)
+      check(k / 65536.0);
+    for (k = -200000; k <= 200000; k++) {
+      double v = k / scale + k % 7;
+
+      check(v);
+      check(nextafter(v, HUGE_VAL));
+      check(nextafter(v, -HUGE_VAL));
+      check(v + 0.5 / scale);
+      check(nextafter(v + 0.5 / scale, HUGE_VAL));
+      check(nextafter(v + 0.5 / scale, -HUGE_VAL));
+    }
+    for (i = 0; i < (int) (sizeof(edges) / sizeof(edges[0])); i++) {
+      check(edges[i]);
+      check(nextafter(edges[i], HUGE_VAL));
+      check(nextafter(edges[i], -HUGE_VAL));
+    }
+    check(HUGE_VAL);
+    check(-HUGE_VAL);
+    for (n = 0; n < 1000000 / 9; n++) {
+      double v = ldexp((double) (rnd() >> 11), (int) (rnd() % 100) - 80);
+
+      check(rnd() & 1 ? -v : v);
+    }
+  }
+
+  if (full) {
+    set_precision(2);
+    for (k = -2147483647L - 1; k <= 2147483647L; k++)
+      check(k / 65536.0);
+  }
+}
+
+static double
+now (void)
+{
+  return (double) clock() / CLOCKS_PER_SEC;
+}
+
+static void
+run_bench (void)
+{
+  static double values[1 << 16];
+  char   buf[64];
+  double t, t_old, t_new;
+  long   k, sum = 0;
+  int    rep, reps = 200;
+
+  /* Coordinates and kerns as they appear in content streams */
+  for (k = 0; k < (1 << 16); k++) {
+    long sp = (long) (rnd() % (800L * 65536)) - 100L * 65536;
+
+    values[k] = k % 4 ? sp / 65536.0 : (sp % (20 * 65536)) / 65536.0;
+  }
+
+  set_precision(2);
+  t = now();
+  for (rep = 0; rep < reps; rep++)
+    for (k = 0; k < (1 << 16); k++)
+      sum += old_dtoa(values[k], 2, buf);
+  t_old = now() - t;
+  t = now();
+  for (rep = 0; rep < reps; rep++)
+    for (k = 0; k < (1 << 16); k++)
+      sum += pdf_sprint_length(buf, values[k]);
+  t_new = now() - t;
+
+  printf("sprintf-based: %.1f ns/number\n", 1e9 * t_old / reps / (1 << 16));
+  printf("p_dtoa:        %.1f ns/number\n", 1e9 * t_new / reps / (1 << 16));
+  printf("(%ld)\n", sum);
+}
+
+int
+main (int argc, char **argv)
+{
+  if (argc > 1 && !strcmp(argv[1], "bench")) {
+    run_bench();
+    return 0;
+  }
+
+  run_test(argc > 1 && !strcmp(argv[1], "full"));
+  printf("%ld numbers checked, %ld differ\n", num_checked, num_failed);
+
+  return num_failed ? 1 : 0;
+}
@@ -0,0 +1,179 @@
+/* Test for files beyond 4 GB.
+
+Writes a one-page PDF with enough uncompressed synthetic image data to
+push the last objects and the xref past 4 GB, then reads it back and
+checks that every image is found with its original contents. This is
+done for PDF 1.4 (xref table) and PDF 1.5 (xref stream).
+
+./test-largefile [file]
+
+Needs about 4.3 GB of free disk space and exits with 77 (skipped) when
+there is not enough. The file is removed afterwards.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#ifndef WIN32
+#include <sys/statvfs.h>
+#endif
+#include "libtexpdf.h"
+
+#define NUM_IMAGES    17
+#define IMAGE_WIDTH   16384
+#define IMAGE_HEIGHT  16384  /* 256 MB per image */
+#define FILE_SPACE    ((int64_t) NUM_IMAGES * IMAGE_WIDTH * IMAGE_HEIGHT + (1 << 20))
+
+static unsigned char
+pixel (int image, long row, long col)
+{
+  return (unsigned char) (image * 31 + row * 7 + col);
+}
+
+static void
+write_file (const char *filename, int version)
+{
+  pdf_rect       mediabox = { 0.0, 0.0, 612.0, 792.0 };
+  pdf_doc       *p;
+  unsigned char *line;
+  char           buf[128];
+  long           row, col;
+  int            i, len;
+
+  texpdf_set_version(version);
+  texpdf_set_compression(0);
+  p = texpdf_open_document(filename, 0, 612.0, 792.0, 0, 0, 0);
+  texpdf_init_device(p, 1.0, 2, 0);
+  texpdf_doc_set_mediabox(p, 0, &mediabox);
+  texpdf_doc_begin_page(p, 1.0, 0.0, 0.0);
+
+  line = malloc(IMAGE_WIDTH);
+  for (i = 0; i < NUM_IMAGES; i++) {
+    pdf_obj *image = texpdf_new_stream(0);
+    pdf_obj *dict  = texpdf_stream_dict(image);
+
+    texpdf_add_dict(dict, texpdf_new_name("Type"), texpdf_new_name("XObject"));
+    texpdf_add_dict(dict, texpdf_new_name("Subtype"), texpdf_new_name("Image"));
+    texpdf_add_dict(dict, texpdf_new_name("Width"), texpdf_new_number(IMAGE_WIDTH));
+    texpdf_add_dict(dict, texpdf_new_name("Height"), texpdf_new_number(IMAGE_HEIGHT));
+    texpdf_add_dict(dict, texpdf_new_name("ColorSpace"), texpdf_new_name("DeviceGray"));
+    texpdf_add_dict(dict, texpdf_new_name("BitsPerComponent"), texpdf_new_number(8));
+    for (row = 0; row < IMAGE_HEIGHT; row++) {
+      for (col = 0; col < IMAGE_WIDTH; col++)
+        line[col] = pixel(i, row, col);
+      texpdf_add_stream(image, line, IMAGE_WIDTH);
+    }
+    sprintf(buf, "Im%d", i);
+    texpdf_doc_add_page_resource(p, "XObject", buf, texpdf_ref_obj(image));
+    texpdf_release_obj(image);
+
+    len = sprintf(buf, " q 30 0 0 30 %d %d cm /Im%d Do Q", 20 + 35 * (i % 16), 20 + 35 * (i / 16), i);
+    texpdf_doc_add_page_content(p, buf, len);
+  }
+  free(line);
+
+  texpdf_doc_end_page(p);
+  texpdf_close_document(p);
+  texpdf_close_device();
+}
+
+/* Returns the number of errors found */
+static int
+check_file (const char *filename)
+{
+  FILE                *fp;
+  pdf_file            *pf;
+  const pdf_file_page *page;
+  pdf_obj             *xobjects;
+  int64_t              size;
+  int                  i, errors = 0;
+
+  if (!(fp = fopen(filename, "rb"))) {
+    fprintf(stderr, "cannot reopen %s\n", filename);
+    return 1;
+  }
+  fseeko(fp, 0, SEEK_END);
+  size = ftello(fp);
+  rewind(fp);
+  if (size <= ((int64_t) 1 << 32)) {
+    fprintf(stderr, "file is only %lld bytes\n", (long long) size);
+    errors++;
+  }
+
+  texpdf_files_init();
+  /* Keep no more than one image in memory */
+  texpdf_set_object_cache_budget(1, 0);
+  pf = texpdf_open(filename, fp);
+  if (!pf || pdf_file_get_page_count(pf) != 1 ||
+      !(page = pdf_file_get_page(pf, 0))) {
+    fprintf(stderr, "cannot read back the page of %s\n", filename);
+    texpdf_files_close();
+    fclose(fp);
+    return errors + 1;
+  }
+
+  xobjects = pdf_deref_obj(texpdf_lookup_dict(page->resources, "XObject"));
+  for (i = 0; i < NUM_IMAGES; i++) {
+    const unsigned char *data;
+    pdf_obj *image;
+    char     name[16];
+    long     row, col;
+
+    sprintf(name, "Im%d", i);
+    image = pdf_deref_obj(texpdf_lookup_dict(xobjects, name));
+    if (!PDF_OBJ_STREAMTYPE(image) ||
+        pdf_stream_length(image) != (long) IMAGE_WIDTH * IMAGE_HEIGHT) {
+      fprintf(stderr, "image %d: missing or wrong length\n", i);
+      errors++;
+    } else {
+      data = pdf_stream_dataptr(image);
+      for (row = 0; row < IMAGE_HEIGHT; row += 997) {
+        for (col = 0; col < IMAGE_WIDTH; col += 13) {
+          if (data[row * IMAGE_WIDTH + col] != pixel(i, row, col)) {
+            fprintf(stderr, "image %d: wrong pixel at %ld,%ld\n", i, col, row);
+            errors++;
+            row = IMAGE_HEIGHT;
+            break;
+          }
+        }
+      }
+    }
+    texpdf_release_obj(image);
+  }
+  texpdf_release_obj(xobjects);
+
+  texpdf_files_close();
+  fclose(fp);
+
+  return errors;
+}
+
+int
+main (int argc, char **argv)
+{
+  const char *filename = argc > 1 ? argv[1] : "test-largefile.pdf";
+  int         version, errors = 0;
+#ifndef WIN32
+  struct statvfs fs;
+
+  if (statvfs(".", &fs) == 0 &&
+      (int64_t) fs.f_bavail * fs.f_frsize < FILE_SPACE + ((int64_t) 256 << 20)) {
+    printf("SKIP: not enough disk space for a %lld byte file\n", (long long) FILE_SPACE);
+    return 77;
+  }
+#endif
+
+  for (version = 4; version <= 5; version++) {
+    int n;
+
+    write_file(filename, version);
+    n = check_file(filename);
+    remove(filename);
+    printf("PDF 1.%d: %d error(s)\n", version, n);
+    errors += n;
+  }
+
+  return errors ? 1 : 0;
+}
@@ -0,0 +1,371 @@
+/* Test for linearized output.
+
+Writes a linearized PDF with page-private resources and resources that
+several pages share, and checks it byte by byte against Annex F of the
+PDF specification:
+
+ - the linearization dictionary: /L, /N, /O (first page object), /E (end
+   of the first page), /T (main xref) and /H (hint stream);
+ - both xref sections and the final startxref;
+ - the page offset hint table: first page offset, page lengths, and
+   shared object identifiers;
+ - the shared object hint table: first page groups, shared section
+   offset and group lengths.
+
+./test-linearize [file]
+
+*/
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "libtexpdf.h"
+
+#define NUM_PAGES 6
+#define MAX_OBJS  1024
+
+static char *data;
+static long  data_length;
+static long  offsets[MAX_OBJS]; /* of "N 0 obj", -1 if absent */
+static int   errors;
+
+#define CHECK(cond, what) do { \
+  if (!(cond)) { fprintf(stderr, "%s\n", what); errors++; } \
+} while (0)
+
+static void
+write_file (const char *filename, int version)
+{
+  pdf_rect mediabox = { 0.0, 0.0, 300.0, 400.0 };
+  pdf_doc *p;
+  pdf_obj *all, *most;
+  char     buf[96];
+  int      page, len;
+
+  texpdf_set_version(version);
+  texpdf_set_compression(0);
+  texpdf_set_linearize(1);
+  p = texpdf_open_document(filename, 0, 300.0, 400.0, 0, 0, 0);
+  texpdf_init_device(p, 1.0, 2, 0);
+  texpdf_doc_set_mediabox(p, 0, &mediabox);
+
+  /* One resource used by every page, one by all but the first */
+  all  = texpdf_new_dict();
+  texpdf_add_dict(all, texpdf_new_name("LW"), texpdf_new_number(2));
+  most = texpdf_new_dict();
+  texpdf_add_dict(most, texpdf_new_name("CA"), texpdf_new_number(0.5));
+
+  for (page = 1; page <= NUM_PAGES; page++) {
+    pdf_obj *own = texpdf_new_dict();
+
+    texpdf_doc_begin_page(p, 1.0, 0.0, 0.0);
+    texpdf_add_dict(own, texpdf_new_name("LW"), texpdf_new_number(page));
+    texpdf_doc_add_page_resource(p, "ExtGState", "All", texpdf_ref_obj(all));
+    if (page > 1)
+      texpdf_doc_add_page_resource(p, "ExtGState", "Most", texpdf_ref_obj(most));
+    texpdf_doc_add_page_resource(p, "ExtGState", "Own", texpdf_ref_obj(own));
+    texpdf_release_obj(own);
+    len = sprintf(buf, " /All gs /Own gs %s 0 0 m %d %d l S",
+                  page > 1 ? "/Most gs" : "", 10 * page, 20 * page);
+    texpdf_doc_add_page_content(p, buf, len);
+    texpdf_doc_end_page(p);
+  }
+  texpdf_release_obj(all);
+  texpdf_release_obj(most);
+
+  texpdf_close_document(p);
+  texpdf_close_device();
+  texpdf_set_linearize(0);
+}
+
+static int
+read_file (const char *filename)
+{
+  FILE *fp;
+  long  i;
+
+  if (!(fp = fopen(filename, "rb")))
+    return -1;
+  fseek(fp, 0, SEEK_END);
+  data_length = ftell(fp);
+  rewind(fp);
+  data = malloc(data_length + 1);
+  if (fread(data, 1, data_length, fp) != (size_t) data_length) {
+    fclose(fp);
+    return -1;
+  }
+  fclose(fp);
+  data[data_length] = 0;
+
+  for (i = 0; i < MAX_OBJS; i++)
+    offsets[i] = -1;
+  for (i = 0; i < data_length; i++) {
+    if (i == 0 || data[i-1] == '\n') {
+      char *end;
+      long  num = strtol(data + i, &end, 10);
+
+      if (end > data + i && !strncmp(end, " 0 obj", 6) && num >= 0 && num < MAX_OBJS)
+        offsets[num] = i;
+    }
+  }
+
+  return 0;
+}
+
+/* Finds TEXT in data from START on, within LIMIT bytes; -1 if not found */
+static long
+find (long start, long limit, const char *text)
+{
+  long i, n = strlen(text);
+
+  for (i = start; i + n <= data_length && i < start + limit; i++) {
+    if (!memcmp(data + i, text, n))
+      return i;
+  }
+  return -1;
+}
+
+/* The integer after KEY in the dictionary of object NUM, or -1 */
+static long
+dict_value (long pos, const char *key)
+{
+  long at = find(pos, 1024, key);
+
+  return at < 0 ? -1 : strtol(data + at + strlen(key), NULL, 10);
+}
+
+/* Leaf pages under the page tree node NUM, in order */
+static void
+collect_pages (long num, long *pages, int *count)
+{
+  long  kids;
+  char *p;
+
+  if (num <= 0 || num >= MAX_OBJS || offsets[num] < 0)
+    return;
+  kids = find(offsets[num], 512, "/Kids");
+  if (kids < 0 || kids > find(offsets[num], 512, "endobj")) {
+    if (*count < NUM_PAGES)
+      pages[*count] = num;
+    (*count)++;
+    return;
+  }
+  p = data + kids + 5;
+  while (*p == ' ' || *p == '[')
+    p++;
+  while (*p != ']') {
+    long kid = strtol(p, &p, 10);
+
+    collect_pages(kid, pages, count);
+    strtol(p, &p, 10); /* generation */
+    while (*p == ' ' || *p == 'R')
+      p++;
+  }
+}
+
+/* Reads bits from the hint stream, most significant first */
+struct bits
+{
+  const unsigned char *data;
+  long pos;
+};
+
+static unsigned long
+get_bits (struct bits *b, int n)
+{
+  unsigned long value = 0;
+
+  while (n-- > 0) {
+    value = (value << 1) | ((b->data[b->pos >> 3] >> (7 - (b->pos & 7))) & 1);
+    b->pos++;
+  }
+  return value;
+}
+
+static void
+align_bits (struct bits *b)
+{
+  b->pos = (b->pos + 7) & ~7L;
+}
+
+/* Checks the xref table at POS against the object offsets */
+static long
+check_xref (long pos, const char *what)
+{
+  char *p = data + pos + 5;
+  long  first = strtol(p, &p, 10), count = strtol(p, &p, 10), i;
+
+  p++;
+  for (i = 0; i < count; i++, p += 20) {
+    if (first + i == 0)
+      continue;
+    if (first + i >= MAX_OBJS || strtol(p, NULL, 10) != offsets[first + i] || p[17] != 'n') {
+      fprintf(stderr, "%s: wrong entry for object %ld\n", what, first + i);
+      errors++;
+    }
+  }
+  return first;
+}
+
+static void
+check_file (void)
+{
+  long  lin, L, O, E, N, T, H0, H1, hint, S, hint_length, main_xref, first_xref;
+  long  root, pages[NUM_PAGES];
+  long  nobjs[NUM_PAGES], lengths[NUM_PAGES], nshared[NUM_PAGES], ids[NUM_PAGES][8];
+  long  min_nobjs, fp_offset, min_length, min_glength, offset;
+  long  fs_obj, fs_offset, n_first, n_total, glengths[MAX_OBJS];
+  int   bits_nobjs, bits_length, bits_nshared, bits_id, bits_glength;
+  int   count = 0, i, j;
+  char *p;
+  struct bits b;
+
+  /* Linearization dictionary */
+  lin = find(0, 1024, "/Linearized 1");
+  CHECK(lin >= 0, "no linearization dictionary in the first 1024 bytes");
+  if (lin < 0)
+    return;
+  L = dict_value(lin, "/L ");
+  O = dict_value(lin, "/O ");
+  E = dict_value(lin, "/E ");
+  N = dict_value(lin, "/N ");
+  T = dict_value(lin, "/T ");
+  p = data + find(lin, 256, "/H") + 2;
+  while (*p == ' ' || *p == '[')
+    p++;
+  H0 = strtol(p, &p, 10);
+  H1 = strtol(p, &p, 10);
+  CHECK(L == data_length, "/L is not the file length");
+
+  /* Page objects, through the catalog of the first-page trailer */
+  root = dict_value(find(0, data_length, "trailer"), "/Root ");
+  CHECK(root > 0 && root < MAX_OBJS && offsets[root] >= 0, "no catalog");
+  if (root <= 0 || root >= MAX_OBJS || offsets[root] < 0)
+    return;
+  collect_pages(dict_value(offsets[root], "/Pages "), pages, &count);
+  CHECK(count == NUM_PAGES && N == count, "/N is not the number of pages");
+  if (count != NUM_PAGES)
+    return;
+  CHECK(O == pages[0], "/O is not the first page");
+
+  /* Hint stream */
+  CHECK(H0 > 0 && H0 < data_length && data[H0] >= '0' && data[H0] <= '9',
+        "/H does not point to an object");
+  CHECK(H1 > 7 && !memcmp(data + H0 + H1 - 7, "endobj\n", 7), "/H has the wrong length");
+  S = dict_value(H0, "/S ");
+  hint_length = dict_value(H0, "/Length ");
+  hint = find(H0, 256, "stream\n") + 7;
+
+  /* Main xref, startxref and the first-page xref */
+  main_xref = find(H0, data_length, "xref\n0 ");
+  CHECK(main_xref > 0 && T == main_xref + 5 + (long) strcspn(data + main_xref + 5, "\n"),
+        "/T is not the end of the main xref header");
+  first_xref = find(0, 2048, "xref\n");
+  CHECK(check_xref(first_xref, "first-page xref") == dict_value(main_xref, "xref\n0 "),
+        "first-page xref does not continue the main one");
+  check_xref(main_xref, "main xref");
+  p = data + data_length - 1;
+  while (p > data && strncmp(p, "startxref", 9))
+    p--;
+  CHECK(strtol(p + 9, NULL, 10) == first_xref, "startxref is not the first-page xref");
+
+  /* Page offset hint table; offsets there leave out the hint stream */
+#define REAL(o) ((o) >= H0 ? (o) + H1 : (o))
+  b.data = (const unsigned char *) data + hint;
+  b.pos  = 0;
+  min_nobjs   = get_bits(&b, 32);
+  fp_offset   = get_bits(&b, 32);
+  bits_nobjs  = get_bits(&b, 16);
+  min_length  = get_bits(&b, 32);
+  bits_length = get_bits(&b, 16);
+  get_bits(&b, 32 + 16 + 32 + 16);
+  bits_nshared = get_bits(&b, 16);
+  bits_id      = get_bits(&b, 16);
+  get_bits(&b, 32);
+  CHECK(REAL(fp_offset) == offsets[O], "hint table: wrong first page offset");
+  for (i = 0; i < NUM_PAGES; i++)
+    nobjs[i] = min_nobjs + get_bits(&b, bits_nobjs);
+  align_bits(&b);
+  for (i = 0; i < NUM_PAGES; i++)
+    lengths[i] = min_length + get_bits(&b, bits_length);
+  align_bits(&b);
+  for (i = 0; i < NUM_PAGES; i++)
+    nshared[i] = get_bits(&b, bits_nshared);
+  align_bits(&b);
+  for (i = 0; i < NUM_PAGES; i++) {
+    for (j = 0; j < nshared[i] && j < 8; j++)
+      ids[i][j] = get_bits(&b, bits_id);
+  }
+  CHECK(b.pos / 8 <= S, "hint table: page offset table overlaps the shared object table");
+
+  for (i = 0, offset = fp_offset; i < NUM_PAGES; offset += lengths[i++]) {
+    if (REAL(offset) != offsets[pages[i]]) {
+      fprintf(stderr, "hint table: page %d does not start at its page object\n", i + 1);
+      errors++;
+    }
+  }
+  CHECK(E == REAL(fp_offset + lengths[0]), "/E is not the end of the first page");
+  /* Pages after the first share "All" and "Most" */
+  for (i = 1; i < NUM_PAGES; i++)
+    CHECK(nshared[i] == 2, "hint table: wrong number of shared objects");
+
+  /* Shared object hint table */
+  b.pos = S * 8;
+  fs_obj    = get_bits(&b, 32);
+  fs_offset = get_bits(&b, 32);
+  n_first   = get_bits(&b, 32);
+  n_total   = get_bits(&b, 32);
+  get_bits(&b, 16);
+  min_glength  = get_bits(&b, 32);
+  bits_glength = get_bits(&b, 16);
+  CHECK(n_first == nobjs[0], "shared hint table: wrong number of first page groups");
+  CHECK(n_total > n_first && n_total < MAX_OBJS, "shared hint table: no shared objects");
+  if (n_total <= n_first || n_total >= MAX_OBJS)
+    return;
+  for (i = 0, offset = 0; i < n_total; i++) {
+    glengths[i] = min_glength + get_bits(&b, bits_glength);
+    if (i < n_first)
+      offset += glengths[i];
+  }
+  CHECK(offset == lengths[0], "shared hint table: first page groups do not add up");
+  CHECK(fs_obj < MAX_OBJS && REAL(fs_offset) == offsets[fs_obj],
+        "shared hint table: wrong offset of the first shared object");
+  for (i = n_first, offset = fs_offset; i < n_total; offset += glengths[i++]) {
+    char text[32];
+
+    sprintf(text, "%ld 0 obj", fs_obj + i - n_first);
+    CHECK(!strncmp(data + REAL(offset), text, strlen(text)),
+          "shared hint table: wrong group length");
+  }
+  for (i = 1; i < NUM_PAGES; i++) {
+    for (j = 0; j < nshared[i] && j < 8; j++)
+      CHECK(ids[i][j] < n_total, "hint table: shared object identifier out of range");
+  }
+  CHECK(hint_length > 0 && S < hint_length, "hint stream: bad /S or /Length");
+}
+
+int
+main (int argc, char **argv)
+{
+  const char *filename = argc > 1 ? argv[1] : "test-linearize.pdf";
+  int         version, total = 0;
+
+  for (version = 4; version <= 5; version++) {
+    errors = 0;
+    write_file(filename, version);
+    if (read_file(filename) < 0) {
+      fprintf(stderr, "cannot read back %s\n", filename);
+      errors++;
+    } else {
+      check_file();
+    }
+    free(data);
+    data = NULL;
+    remove(filename);
+    printf("PDF 1.%d: %d error(s)\n", version, errors);
+    total += errors;
+  }
+
+  return total ? 1 : 0;
+}
@@ -0,0 +1,216 @@
+/* Test for incremental updates.
+
+Writes a three-page PDF, replaces its second page with
+texpdf_open_document_update() and texpdf_doc_replace_page(), and reads
+the file back. Checks that the original bytes are unchanged, that the
+new xref section points back to the old one with /Prev, that the old
+page tree now leads to the new page and that the other pages are still
+there. This is done for PDF 1.4 (xref table) and PDF 1.5 (xref stream).
+
+./test-update [file]
+
+*/
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "libtexpdf.h"
+
+#define NUM_PAGES 3
+
+static int
+contains (const char *data, long length, const char *text)
+{
+  long i, n = strlen(text);
+
+  for (i = 0; i + n <= length; i++) {
+    if (!memcmp(data + i, text, n))
+      return 1;
+  }
+  return 0;
+}
+
+static void
+add_content (pdf_doc *p, int page, int revision)
+{
+  char buf[64];
+  int  len;
+
+  len = sprintf(buf, " %% page %d revision %d\n 0 0 m %d 100 l S", page, revision, 100 * page);
+  texpdf_doc_add_page_content(p, buf, len);
+}
+
+static void
+write_file (const char *filename, int version)
+{
+  pdf_rect mediabox = { 0.0, 0.0, 300.0, 400.0 };
+  pdf_doc *p;
+  int      page;
+
+  texpdf_set_version(version);
+  texpdf_set_compression(0);
+  p = texpdf_open_document(filename, 0, 300.0, 400.0, 0, 0, 0);
+  texpdf_init_device(p, 1.0, 2, 0);
+  texpdf_doc_set_mediabox(p, 0, &mediabox);
+  for (page = 1; page <= NUM_PAGES; page++) {
+    texpdf_doc_begin_page(p, 1.0, 0.0, 0.0);
+    add_content(p, page, 1);
+    texpdf_doc_end_page(p);
+  }
+  texpdf_close_document(p);
+  texpdf_close_device();
+}
+
+static void
+update_file (const char *filename)
+{
+  pdf_doc *p;
+
+  p = texpdf_open_document_update(filename);
+  texpdf_init_device(p, 1.0, 2, 0);
+  texpdf_doc_replace_page(p, 2);
+  texpdf_doc_begin_page(p, 1.0, 0.0, 0.0);
+  add_content(p, 2, 2);
+  texpdf_doc_end_page(p);
+  texpdf_close_document(p);
+  texpdf_close_device();
+}
+
+/* Contents of FILENAME, with its length in *LENGTH */
+static char *
+read_file (const char *filename, long *length)
+{
+  FILE *fp;
+  char *data;
+
+  if (!(fp = fopen(filename, "rb")))
+    return NULL;
+  fseek(fp, 0, SEEK_END);
+  *length = ftell(fp);
+  rewind(fp);
+  data = malloc(*length + 1);
+  if (fread(data, 1, *length, fp) != (size_t) *length) {
+    free(data);
+    data = NULL;
+  }
+  fclose(fp);
+
+  return data;
+}
+
+/* Offset of the last xref section, from the "startxref" line */
+static long
+last_startxref (const char *data, long length)
+{
+  long i;
+
+  for (i = length - 9; i >= 0; i--) {
+    if (!memcmp(data + i, "startxref", 9))
+      return atol(data + i + 9);
+  }
+  return -1;
+}
+
+/* Returns 1 if page PAGE_IDX of PF does not show REVISION */
+static int
+check_page (pdf_file *pf, long page_idx, int revision)
+{
+  const pdf_file_page *page = pdf_file_get_page(pf, page_idx);
+  pdf_obj *dict, *contents;
+  char     text[32];
+  int      i, found = 0;
+
+  if (!page) {
+    fprintf(stderr, "page %ld: missing\n", page_idx + 1);
+    return 1;
+  }
+
+  sprintf(text, "page %ld revision %d", page_idx + 1, revision);
+  dict = pdf_deref_obj(page->ref);
+  contents = pdf_deref_obj(texpdf_lookup_dict(dict, "Contents"));
+  for (i = 0; PDF_OBJ_ARRAYTYPE(contents) && i < (int) texpdf_array_length(contents); i++) {
+    pdf_obj *stream = pdf_deref_obj(texpdf_get_array(contents, i));
+
+    if (PDF_OBJ_STREAMTYPE(stream) &&
+        contains(pdf_stream_dataptr(stream), pdf_stream_length(stream), text))
+      found = 1;
+    texpdf_release_obj(stream);
+  }
+  texpdf_release_obj(contents);
+  texpdf_release_obj(dict);
+
+  if (!found) {
+    fprintf(stderr, "page %ld: \"%s\" not found\n", page_idx + 1, text);
+    return 1;
+  }
+  return 0;
+}
+
+/* Returns the number of errors found */
+static int
+test_version (const char *filename, int version)
+{
+  FILE     *fp;
+  pdf_file *pf;
+  pdf_obj  *prev;
+  char     *before, *after;
+  long      before_length, after_length, startxref;
+  int       errors = 0;
+
+  write_file(filename, version);
+  before = read_file(filename, &before_length);
+  startxref = last_startxref(before, before_length);
+
+  update_file(filename);
+  after = read_file(filename, &after_length);
+  if (after_length <= before_length || memcmp(before, after, before_length)) {
+    fprintf(stderr, "original bytes were not kept\n");
+    errors++;
+  }
+  if (last_startxref(after, after_length) <= startxref) {
+    fprintf(stderr, "no new xref section\n");
+    errors++;
+  }
+  free(before);
+  free(after);
+
+  texpdf_files_init();
+  fp = fopen(filename, "rb");
+  pf = texpdf_open(filename, fp);
+  if (!pf || pdf_file_get_page_count(pf) != NUM_PAGES) {
+    fprintf(stderr, "cannot read back the updated %s\n", filename);
+    errors++;
+  } else {
+    prev = texpdf_lookup_dict(pdf_file_get_trailer(pf), "Prev");
+    if (!PDF_OBJ_NUMBERTYPE(prev) || (long) texpdf_number_value(prev) != startxref) {
+      fprintf(stderr, "/Prev does not point to the old xref at %ld\n", startxref);
+      errors++;
+    }
+    /* The page tree is not written again, so this is the old /Kids entry */
+    errors += check_page(pf, 0, 1);
+    errors += check_page(pf, 1, 2);
+    errors += check_page(pf, 2, 1);
+  }
+  texpdf_files_close();
+  fclose(fp);
+
+  return errors;
+}
+
+int
+main (int argc, char **argv)
+{
+  const char *filename = argc > 1 ? argv[1] : "test-update.pdf";
+  int         version, errors = 0;
+
+  for (version = 4; version <= 5; version++) {
+    int n = test_version(filename, version);
+
+    remove(filename);
+    printf("PDF 1.%d: %d error(s)\n", version, n);
+    errors += n;
+  }
+
+  return errors ? 1 : 0;
+}
@@ -425,6 +425,7 @@ write_fontfile (pdf_font *font, cff_font *cffont)
 
   /* Flush Font File */
   fontfile    = texpdf_new_stream(STREAM_COMPRESS);
+  texpdf_stream_set_class(fontfile, STREAM_CLASS_FONT);
   stream_dict = texpdf_stream_dict(fontfile);
   texpdf_add_dict(descriptor,
 	       texpdf_new_name("FontFile3"), texpdf_ref_obj (fontfile));
@@ -696,6 +696,7 @@ pdf_font_load_type1c (pdf_font *font)
    * Write PDF FontFile data.
    */
   fontfile    = texpdf_new_stream(STREAM_COMPRESS);
+  texpdf_stream_set_class(fontfile, STREAM_CLASS_FONT);
   stream_dict = texpdf_stream_dict(fontfile);
   texpdf_add_dict(descriptor,
 	       texpdf_new_name("FontFile3"), texpdf_ref_obj (fontfile));